@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sched.h>
+#include <assert.h>
+
+#include "ag.h"
+#include "pages.h"
+#include "inode.h"
+#include "bitmap.h"
+#include "superblock.h"
+#include "fs.h"
+
+// state of the calling thread's instance, see fs.h
+#define group_count (nufs_cur->ags.group_count)
+#define groups      (nufs_cur->ags.groups)
+#define alloc_gen   (nufs_cur->ags.alloc_gen)
+
+// lay out the groups the image was formatted with and count what is
+// free in each; the counts live only in memory
+void
+ag_init()
+{
+    superblock* sb = get_superblock();
+    if (sb->ag_count == 0) {
+        sb->ag_count = AG_COUNT;
+    }
+    assert(sb->ag_count > 0 && sb->ag_count <= AG_MAX);
+    group_count = sb->ag_count;
+
+    void* pbm = get_pages_bitmap();
+    void* ibm = get_inode_bitmap();
+    for (int gg = 0; gg < group_count; ++gg) {
+        ag* g = &groups[gg];
+        g->first_page = gg * PAGE_COUNT / group_count;
+        g->pages = (gg + 1) * PAGE_COUNT / group_count - g->first_page;
+        g->first_inode = gg * INODE_COUNT / group_count;
+        g->inodes = (gg + 1) * INODE_COUNT / group_count - g->first_inode;
+        g->free_pages = 0;
+        for (int pn = g->first_page; pn < g->first_page + g->pages; ++pn) {
+            g->free_pages += !bitmap_get(pbm, pn);
+        }
+        g->free_inodes = 0;
+        for (int in = g->first_inode; in < g->first_inode + g->inodes; ++in) {
+            g->free_inodes += !bitmap_get(ibm, in);
+        }
+    }
+    printf("+ ag_init: %d groups of %d pages\n", group_count, groups[0].pages);
+}
+
+int
+ag_total()
+{
+    return group_count;
+}
+
+ag*
+ag_get(int group)
+{
+    return &groups[group];
+}
+
+// the group for the calling thread's CPU
+int
+ag_local()
+{
+    int cpu = sched_getcpu();
+    return (cpu < 0) ? 0 : cpu % group_count;
+}
+
+// which of count equal slices of n items item falls in; slice gg starts
+// at gg * n / count, rounded down
+static int
+slice_of(int item, int n)
+{
+    int gg = item * group_count / n;
+    if (gg + 1 < group_count && item >= (gg + 1) * n / group_count) {
+        gg++;
+    }
+    return gg;
+}
+
+int
+ag_of_page(int pnum)
+{
+    return slice_of(pnum, PAGE_COUNT);
+}
+
+int
+ag_of_inode(int inum)
+{
+    return slice_of(inum, INODE_COUNT);
+}
+
+// where allocation in a group starts; page 0 is never handed out
+int
+ag_goal(int group)
+{
+    int pn = groups[group].first_page;
+    return (pn == 0) ? 1 : pn;
+}
+
+// a page's bitmap bit was set (used) or cleared
+void
+ag_page_used(int pnum, int used)
+{
+    groups[ag_of_page(pnum)].free_pages += used ? -1 : 1;
+    alloc_gen++;
+}
+
+void
+ag_inode_used(int inum, int used)
+{
+    groups[ag_of_inode(inum)].free_inodes += used ? -1 : 1;
+    alloc_gen++;
+}
+
+// changes when anything is allocated or freed, so reports built from
+// the bitmaps can tell whether they are still current
+int
+ag_gen()
+{
+    return alloc_gen;
+}
@@ -0,0 +1,41 @@
+#ifndef NUFS_AG_H
+#define NUFS_AG_H
+
+// Allocation groups: the page space and the inode table are cut into
+// equal slices, each with its own part of the page and inode bitmaps and
+// its own free counts. Allocations without a neighbour to follow start
+// in the group of the CPU asking, so parallel creators and writers fill
+// separate groups instead of interleaving in one; a group that runs out
+// takes from the next.
+
+// groups on a newly formatted image; the count is kept in the superblock
+#define AG_COUNT 4
+#define AG_MAX   8
+
+typedef struct ag {
+    int first_page;
+    int pages;
+    int first_inode;
+    int inodes;
+    int free_pages; // clear in the page bitmap, reserved or not
+    int free_inodes;
+} ag;
+
+typedef struct ag_state {
+    int group_count;
+    ag  groups[AG_MAX];
+    int alloc_gen; // bumped whenever a page or inode is taken or freed
+} ag_state;
+
+void ag_init();
+int  ag_total();
+ag*  ag_get(int group);
+int  ag_local();
+int  ag_of_page(int pnum);
+int  ag_of_inode(int inum);
+int  ag_goal(int group);
+void ag_page_used(int pnum, int used);
+void ag_inode_used(int inum, int used);
+int  ag_gen();
+
+#endif
@@ -13,5 +13,10 @@ void
 bitmap_put(void* bm, int ii, int vv) {
 	int byte = ii / 8;
 	int bit = ii % 8;
-	((char*)bm)[byte] |= vv << 7 - bit;
+	if (vv) {
+		((char*)bm)[byte] |= 1 << 7 - bit;
+	}
+	else {
+		((char*)bm)[byte] &= ~(1 << 7 - bit);
+	}
 }
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "changes.h"
+#include "superblock.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "csum.h"
+
+static uint32_t*
+change_table()
+{
+    return pages_get_page(get_superblock()->change_page);
+}
+
+// write page 0 and wait, so the clean flag is on disk before anything
+// that relies on it
+static void
+sync_superblock()
+{
+    page_run run = { 0, 1 };
+    pages_write_runs(&run, 1, 1);
+}
+
+// allocate the change table on images that don't have one yet; called at
+// mount after the superblock is set up. Returns -1 if there is no room,
+// in which case changes aren't tracked.
+int
+changes_init()
+{
+    superblock* sb = get_superblock();
+    if (sb->change_page == 0) {
+        int pn = alloc_page();
+        if (pn < 0) {
+            printf("+ changes: no room for the change table\n");
+            return -1;
+        }
+        // everything already there is only in a full backup (since 0)
+        sb->change_page = pn;
+        sb->change_gen = 1;
+    }
+    else if (!sb->change_clean) {
+        // pages may have reached the disk without their stamps
+        printf("+ changes: not unmounted cleanly, every page counts as changed\n");
+        uint32_t* table = change_table();
+        for (int pn = 0; pn < PAGE_COUNT; ++pn) {
+            table[pn] = sb->change_gen;
+        }
+    }
+    sb->change_clean = 0;
+    pages_mark_dirty(sb->change_page, 1);
+    sync_superblock();
+    return 0;
+}
+
+// called at unmount once everything, the change table included, is on
+// disk. Setting the flag changes page 0 after its checksum was taken, so
+// the checksums are taken again and written first.
+void
+changes_stop()
+{
+    superblock* sb = get_superblock();
+    if (sb->change_page == 0) {
+        return;
+    }
+    sb->change_clean = 1;
+    if (csum_mode() != CSUM_OFF) {
+        csum_stop();
+        page_run run = { sb->csum_page, 1 };
+        pages_write_runs(&run, 1, 1);
+    }
+    sync_superblock();
+}
+
+void
+changes_mark(int pnum, int count)
+{
+    superblock* sb = get_superblock();
+    if (sb->change_page == 0) {
+        return;
+    }
+    uint32_t* table = change_table();
+    for (int pn = pnum; pn < pnum + count; ++pn) {
+        table[pn] = sb->change_gen;
+    }
+}
+
+// set a bit in bm for each page changed after generation since, or for
+// every page in use if since is 0, and start a new generation. Page 0 and
+// the other metadata pages are always included: page 0 records the
+// generation a copy is at, and the rest must agree with it. Returns
+// the generation that ended, to be passed as since the next time, or -1
+// if changes aren't tracked.
+int
+changes_collect(int since, uint8_t* bm)
+{
+    superblock* sb = get_superblock();
+    if (sb->change_page == 0) {
+        return -1;
+    }
+    uint32_t* table = change_table();
+    void* pbm = get_pages_bitmap();
+    memset(bm, 0, MAX_PAGE_COUNT / 8);
+    for (int pn = 0; pn < PAGE_COUNT; ++pn) {
+        if (since == 0 ? bitmap_get(pbm, pn) : table[pn] > (uint32_t)since) {
+            bitmap_put(bm, pn, 1);
+        }
+    }
+    int gen = sb->change_gen++;
+    int meta[] = { 0, sb->frag_page, sb->csum_page, sb->change_page };
+    for (int ii = 0; ii < 4; ++ii) {
+        if (ii == 0 || meta[ii] != 0) {
+            bitmap_put(bm, meta[ii], 1);
+        }
+    }
+    pages_mark_dirty(0, 1);
+    printf("+ changes_collect(%d) -> %d\n", since, gen);
+    return gen;
+}
@@ -0,0 +1,21 @@
+#ifndef CHANGES_H
+#define CHANGES_H
+
+#include <stdint.h>
+
+// Per-page change generations, for incremental backups. Every page is
+// stamped with the current generation whenever it is marked dirty
+// (pages_mark_dirty), in a table on a page of its own recorded in the
+// superblock. Collecting the pages changed since a generation ends the
+// current one, so the next collection picks up only what changed after.
+//
+// Stamps reach the disk along with the pages they describe, through
+// writeback; an unmount that doesn't finish cleanly leaves every page
+// counted as changed at the next mount.
+
+int  changes_init();
+void changes_stop();
+void changes_mark(int pnum, int count);
+int  changes_collect(int since, uint8_t* bm);
+
+#endif
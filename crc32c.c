@@ -0,0 +1,91 @@
+// CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU has
+// it and a table-driven fallback otherwise.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc_table[256];
+static int      crc_table_ready = 0;
+
+static void
+crc32c_init_table()
+{
+    for (uint32_t ii = 0; ii < 256; ++ii) {
+        uint32_t crc = ii;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[ii] = crc;
+    }
+    crc_table_ready = 1;
+}
+
+uint32_t
+crc32c_sw(uint32_t crc, const void* buf, size_t len)
+{
+    const uint8_t* pp = buf;
+    if (!crc_table_ready) {
+        crc32c_init_table();
+    }
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *pp++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const void* buf, size_t len)
+{
+    const uint8_t* pp = buf;
+    uint64_t cc = ~crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, pp, 8);
+        cc = _mm_crc32_u64(cc, word);
+        pp += 8;
+        len -= 8;
+    }
+    uint32_t c32 = cc;
+    while (len--) {
+        c32 = _mm_crc32_u8(c32, *pp++);
+    }
+    return ~c32;
+}
+
+int
+crc32c_hw_available()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+uint32_t
+crc32c(uint32_t crc, const void* buf, size_t len)
+{
+    static int hw = -1;
+    if (hw < 0) {
+        hw = crc32c_hw_available();
+    }
+    return hw ? crc32c_sse42(crc, buf, len) : crc32c_sw(crc, buf, len);
+}
+#else
+int
+crc32c_hw_available()
+{
+    return 0;
+}
+
+uint32_t
+crc32c(uint32_t crc, const void* buf, size_t len)
+{
+    return crc32c_sw(crc, buf, len);
+}
+#endif
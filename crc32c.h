@@ -0,0 +1,11 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void* buf, size_t len);
+int      crc32c_hw_available();
+
+#endif
@@ -0,0 +1,177 @@
+// Per-page CRC32C checksums, kept in one page recorded in the superblock.
+//
+// Data pages are re-checksummed as they are written. Metadata pages are
+// modified in place all over the engine, so their checksums are written
+// at unmount and only trusted at the next mount if that unmount was clean.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "csum.h"
+#include "crc32c.h"
+#include "superblock.h"
+#include "inode.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "snapshot.h"
+#include "xattr.h"
+#include "fs.h"
+
+#define active_mode (nufs_cur->csum.active_mode)
+
+static uint32_t*
+csum_table()
+{
+    return pages_get_page(get_superblock()->csum_page);
+}
+
+static uint32_t
+page_crc(int pnum)
+{
+    return crc32c(0, pages_get_page(pnum), PAGE_BYTES);
+}
+
+// call fn on every metadata page: page 0, the fragment map, directory
+// pages, indirect pages, those of the snapshots, and the attribute pages
+static void
+for_each_meta_page(void (*fn)(int pnum, void* arg), void* arg)
+{
+    fn(0, arg);
+    if (get_superblock()->frag_page != 0) {
+        fn(get_superblock()->frag_page, arg);
+    }
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        if (!bitmap_get(get_inode_bitmap(), ii)) {
+            continue;
+        }
+        inode* node = get_inode(ii);
+        if (S_ISDIR(node->mode) && node->ptrs[0] != 0) {
+            fn(node->ptrs[0], arg);
+        }
+        if (node->iptr != 0) {
+            fn(node->iptr, arg);
+        }
+    }
+    snap_for_each_meta(fn, arg);
+    xattr_for_each_meta(fn, arg);
+}
+
+static void
+update_one(int pnum, void* arg)
+{
+    csum_table()[pnum] = page_crc(pnum);
+}
+
+static void
+verify_one(int pnum, void* arg)
+{
+    if (csum_table()[pnum] != page_crc(pnum)) {
+        printf("+ csum: metadata page %d is corrupt\n", pnum);
+        ++*(int*)arg;
+    }
+}
+
+// checksum every allocated page from scratch
+static void
+rebuild()
+{
+    void* pbm = get_pages_bitmap();
+    for (int pn = 0; pn < PAGE_COUNT; ++pn) {
+        if (bitmap_get(pbm, pn) && pn != get_superblock()->csum_page) {
+            update_one(pn, 0);
+        }
+    }
+}
+
+// called at mount, after the superblock is set up: verifies metadata if
+// the last unmount left valid checksums, otherwise rebuilds them. Returns
+// the number of corrupt metadata pages found.
+int
+csum_init(int new_mode)
+{
+    superblock* sb = get_superblock();
+    active_mode = new_mode;
+
+    if (active_mode == CSUM_OFF) {
+        // nothing keeps them current from here on
+        sb->csum_valid = 0;
+        return 0;
+    }
+
+    int bad = 0;
+    if (sb->csum_page == 0) {
+        int pn = alloc_page();
+        if (pn < 0) {
+            printf("+ csum: no room for the checksum page, disabled\n");
+            active_mode = CSUM_OFF;
+            return 0;
+        }
+        sb->csum_page = pn;
+        rebuild();
+    }
+    else if (sb->csum_valid == 0) {
+        printf("+ csum: not unmounted cleanly, rebuilding checksums\n");
+        rebuild();
+    }
+    else {
+        for_each_meta_page(verify_one, &bad);
+        if (sb->csum_valid < active_mode) {
+            // data pages weren't being checksummed last time
+            rebuild();
+        }
+    }
+
+    sb->csum_valid = 0;
+    printf("+ csum_init(%d) -> %d corrupt\n", active_mode, bad);
+    return bad;
+}
+
+// write the metadata checksums and mark them valid; called at unmount
+void
+csum_stop()
+{
+    if (active_mode == CSUM_OFF) {
+        return;
+    }
+    get_superblock()->csum_valid = active_mode;
+    // page 0 goes last since it holds the clean flag
+    for_each_meta_page(update_one, 0);
+    update_one(0, 0);
+}
+
+int
+csum_mode()
+{
+    return active_mode;
+}
+
+// a data page was written
+void
+csum_update(int pnum)
+{
+    if (active_mode == CSUM_ALL) {
+        update_one(pnum, 0);
+    }
+}
+
+// check a data page before handing its contents out
+int
+csum_verify(int pnum)
+{
+    if (active_mode != CSUM_ALL || csum_table()[pnum] == page_crc(pnum)) {
+        return 0;
+    }
+    printf("+ csum: data page %d is corrupt\n", pnum);
+    return -EIO;
+}
+
+// a page was relocated along with its contents
+void
+csum_move(int from, int to)
+{
+    if (active_mode != CSUM_OFF) {
+        csum_table()[to] = csum_table()[from];
+    }
+}
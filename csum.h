@@ -0,0 +1,22 @@
+#ifndef CSUM_H
+#define CSUM_H
+
+// which pages carry checksums, selected with -o csum=off/meta/all
+enum {
+    CSUM_OFF,
+    CSUM_META, // page 0, directory pages and indirect pages
+    CSUM_ALL,  // metadata and file data
+};
+
+typedef struct csum_state {
+    int active_mode;
+} csum_state;
+
+int  csum_init(int mode);
+void csum_stop();
+int  csum_mode();
+void csum_update(int pnum);
+int  csum_verify(int pnum);
+void csum_move(int from, int to);
+
+#endif
@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "defrag.h"
+#include "storage.h"
+#include "inode.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "csum.h"
+#include "snapshot.h"
+#include "util.h"
+#include "fs.h"
+
+// default rate limit, in pages moved per second
+#define DEFRAG_DEFAULT_RATE 256
+// a file, with its indirect page, can't hold more pages than the image
+#define MAX_FILE_PAGES MAX_PAGE_COUNT
+
+#define defrag_thread   (nufs_cur->defrag.defrag_thread)
+#define defrag_joinable (nufs_cur->defrag.defrag_joinable)
+#define defrag_stopping (nufs_cur->defrag.defrag_stopping)
+#define defrag_rate     (nufs_cur->defrag.defrag_rate)
+#define status          (nufs_cur->defrag.status)
+
+static int
+inode_in_use(int inum)
+{
+    return bitmap_get(get_inode_bitmap(), inum) && get_inode(inum)->refs > 0;
+}
+
+// pages a file occupies, including its indirect page
+static int
+file_page_count(inode* node)
+{
+    int count = (node->iptr != 0) ? 1 : 0;
+    for (int ii = 0; ii < bytes_to_pages(node->size); ++ii) {
+        if (inode_get_pnum(node, ii) != 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// lowest page the file occupies, 0 if it has none
+static int
+file_first_page(inode* node)
+{
+    int first = node->iptr;
+    for (int ii = 0; ii < bytes_to_pages(node->size); ++ii) {
+        int pn = inode_get_pnum(node, ii);
+        if (pn != 0 && (first == 0 || pn < first)) {
+            first = pn;
+        }
+    }
+    return first;
+}
+
+static int
+total_extents()
+{
+    int extents = 0;
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        if (inode_in_use(ii)) {
+            extents += inode_extents(get_inode(ii));
+        }
+    }
+    return extents;
+}
+
+// the file's pages in allocator layout order: ptrs[0], ptrs[1], the
+// indirect page, the rest; returns how many there are
+static int
+file_layout(inode* node, int* pages)
+{
+    int count = 0;
+    for (int ii = 0; ii < bytes_to_pages(node->size); ++ii) {
+        if (ii == 2 && node->iptr != 0) {
+            pages[count++] = node->iptr;
+        }
+        int pn = inode_get_pnum(node, ii);
+        if (pn != 0) {
+            pages[count++] = pn;
+        }
+    }
+    return count;
+}
+
+// move a file's pages, in layout order, to the run starting at start.
+// The run must be free, or overlap the file only from below: pages are
+// moved in ascending order, so each target is either free or was vacated
+// by an earlier move. Returns the number of pages moved.
+static int
+relocate_file(inode* node, int start)
+{
+    int next = start;
+    int moved = 0;
+
+    for (int ii = 0; ii < bytes_to_pages(node->size); ++ii) {
+        if (ii == 2 && node->iptr != 0) {
+            if (node->iptr != next) {
+                pages_move(node->iptr, next);
+                csum_move(node->iptr, next);
+                node->iptr = next;
+                moved++;
+            }
+            next++;
+        }
+
+        int pn = inode_get_pnum(node, ii);
+        if (pn == 0) {
+            continue;
+        }
+        if (pn != next) {
+            pages_move(pn, next);
+            csum_move(pn, next);
+            inode_set_pnum(node, ii, next);
+            moved++;
+        }
+        next++;
+    }
+    return moved;
+}
+
+// slide one file down to the lowest place it fits; a packed file also
+// absorbs the free pages directly below it
+static int
+compact_one(int inum)
+{
+    static int pages[MAX_FILE_PAGES];
+    if (!inode_in_use(inum)) {
+        return 0;
+    }
+    inode* node = get_inode(inum);
+    int count = file_layout(node, pages);
+    if (count == 0) {
+        return 0;
+    }
+
+    int first = file_first_page(node);
+    int start = pages_find_free_run(count, first);
+    if (start > 0) {
+        return relocate_file(node, start);
+    }
+
+    int packed = 1;
+    for (int ii = 0; ii < count; ++ii) {
+        packed = packed && pages[ii] == first + ii;
+    }
+    if (!packed) {
+        return 0;
+    }
+    start = first;
+    while (start > 1 && pages_available(start - 1)) {
+        start--;
+    }
+    return (start < first) ? relocate_file(node, start) : 0;
+}
+
+// keep foreground latency intact by spreading the copying out over time
+static void
+throttle(int moved)
+{
+    if (moved > 0) {
+        usleep((long)moved * 1000000 / defrag_rate);
+    }
+}
+
+// make one fragmented file contiguous in the lowest free run that fits
+// it; called with the storage lock held
+static int
+defrag_one(int inum)
+{
+    if (!inode_in_use(inum)) {
+        return 0;
+    }
+    inode* node = get_inode(inum);
+    if (inode_extents(node) <= 1) {
+        return 0;
+    }
+
+    int start = pages_find_free_run(file_page_count(node), PAGE_COUNT);
+    if (start == 0) {
+        return 0;
+    }
+    return relocate_file(node, start);
+}
+
+static void*
+defrag_main(void* arg)
+{
+    storage_bind(arg);
+    // stay out of the way of the FUSE workers
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    int inums[INODE_COUNT];
+    int firsts[INODE_COUNT];
+    int count = 0;
+
+    storage_lock(nufs_cur);
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        if (inode_in_use(ii)) {
+            inums[count++] = ii;
+        }
+    }
+    status.files_total = count;
+    storage_unlock(nufs_cur);
+
+    // pass 1: make every fragmented file contiguous
+    for (int ii = 0; ii < count && !defrag_stopping; ++ii) {
+        storage_lock(nufs_cur);
+        int moved = defrag_one(inums[ii]);
+        status.files_done = ii + 1;
+        status.pages_moved += moved;
+        storage_unlock(nufs_cur);
+        throttle(moved);
+    }
+
+    // pass 2: compact free space by sliding files, lowest first, down into
+    // the free pages below them so free space gathers at the end
+    storage_lock(nufs_cur);
+    for (int ii = 0; ii < count; ++ii) {
+        firsts[ii] = inode_in_use(inums[ii]) ? file_first_page(get_inode(inums[ii])) : 0;
+    }
+    storage_unlock(nufs_cur);
+    for (int ii = 1; ii < count; ++ii) {
+        for (int jj = ii; jj > 0 && firsts[jj] < firsts[jj - 1]; --jj) {
+            int tf = firsts[jj]; firsts[jj] = firsts[jj - 1]; firsts[jj - 1] = tf;
+            int ti = inums[jj];  inums[jj]  = inums[jj - 1];  inums[jj - 1]  = ti;
+        }
+    }
+
+    for (int ii = 0; ii < count && !defrag_stopping; ++ii) {
+        storage_lock(nufs_cur);
+        int moved = 0;
+        if (inode_in_use(inums[ii])) {
+            moved = compact_one(inums[ii]);
+        }
+        status.pages_moved += moved;
+        storage_unlock(nufs_cur);
+        throttle(moved);
+    }
+
+    storage_lock(nufs_cur);
+    int free_pages;
+    status.extents_after = total_extents();
+    pages_free_stats(&free_pages, &status.free_runs_after, &status.largest_free_after);
+    status.running = 0;
+    printf("+ defrag done: %d pages moved, extents %d -> %d, free runs %d -> %d, largest free %d -> %d\n",
+           status.pages_moved, status.extents_before, status.extents_after,
+           status.free_runs_before, status.free_runs_after,
+           status.largest_free_before, status.largest_free_after);
+    storage_unlock(nufs_cur);
+    return 0;
+}
+
+int
+defrag_start(int rate)
+{
+    // moving pages would move them out from under the snapshots
+    if (status.running || snap_count() > 0) {
+        return -EBUSY;
+    }
+    if (defrag_joinable) {
+        // the last pass has finished, reap it
+        pthread_join(defrag_thread, 0);
+        defrag_joinable = 0;
+    }
+
+    memset(&status, 0, sizeof(status));
+    int free_pages;
+    status.running = 1;
+    status.extents_before = total_extents();
+    pages_free_stats(&free_pages, &status.free_runs_before, &status.largest_free_before);
+    defrag_rate = (rate > 0) ? rate : DEFRAG_DEFAULT_RATE;
+    defrag_stopping = 0;
+
+    int rv = pthread_create(&defrag_thread, 0, defrag_main, nufs_cur);
+    if (rv != 0) {
+        status.running = 0;
+        return -rv;
+    }
+    defrag_joinable = 1;
+    printf("+ defrag started at %d pages/s\n", defrag_rate);
+    return 0;
+}
+
+void
+defrag_status(nufs_defrag_status* st)
+{
+    *st = status;
+}
+
+// stop a running pass and wait for it; drops the storage lock meanwhile
+void
+defrag_stop()
+{
+    if (!defrag_joinable) {
+        return;
+    }
+    defrag_stopping = 1;
+    storage_unlock(nufs_cur);
+    pthread_join(defrag_thread, 0);
+    storage_lock(nufs_cur);
+    defrag_joinable = 0;
+}
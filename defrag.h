@@ -0,0 +1,22 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <pthread.h>
+
+#include "nufs_ioctl.h"
+
+typedef struct defrag_state {
+    pthread_t defrag_thread;
+    int defrag_joinable;
+    volatile int defrag_stopping;
+    int defrag_rate;
+    // protected by the storage lock
+    nufs_defrag_status status;
+} defrag_state;
+
+// all of these expect the storage lock to be held
+int  defrag_start(int rate);
+void defrag_status(nufs_defrag_status* st);
+void defrag_stop();
+
+#endif
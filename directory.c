@@ -4,26 +4,113 @@
 #include "slist.h"
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "csum.h"
+#include "snapshot.h"
 
 #include "util.h"
 
+// record size for a name of n bytes, keeping records 4-byte aligned
+#define REC_SIZE(n) ((sizeof(dirent) + (n) + 3) & ~3)
+
+// rec_len is 16 bits, so pages bigger than this are split into chunks of
+// it and no record crosses a chunk boundary
+#define DIR_CHUNK 4096
+
+// the fixed 64-byte entry used before FEAT_VARDIRENT
+typedef struct legacy_dirent {
+    char name[48];
+    int  inum;
+    char _reserved[12];
+} legacy_dirent;
+
 void directory_init(){
-	int rootn = alloc_inode();
-	assert(rootn > -1);
+	// the root is always inode 0
+	int rootn = alloc_inode_in(0);
+	assert(rootn == 0);
 	inode* root = get_inode(rootn);
 	root->refs = 1;
 	root->mode = 040755;
 	root->size = 0;
 	root->ptrs[0] = alloc_page();
+	directory_init_page(root->ptrs[0]);
 	printf("root mode %d \n", root->mode);
 }
 
+// an empty directory page is a single unused record spanning each chunk
+void directory_init_page(int pnum){
+	char* page = pages_get_page(pnum);
+	for (int off = 0; off < PAGE_BYTES; off += DIR_CHUNK) {
+		dirent* de = (dirent*)(page + off);
+		de->rec_len = DIR_CHUNK;
+		de->name_len = 0;
+		de->type = 0;
+		de->inum = 0;
+	}
+	pages_mark_dirty(pnum, 1);
+}
+
+// rewrite directories from the old fixed-size format, which only ever
+// had 4K pages
+void directory_upgrade(){
+	static legacy_dirent old[4096 / sizeof(legacy_dirent)];
+	int count = 4096 / sizeof(legacy_dirent);
+
+	for (int ii = 0; ii < INODE_COUNT; ++ii) {
+		if (!bitmap_get(get_inode_bitmap(), ii)) {
+			continue;
+		}
+		inode* dd = get_inode(ii);
+		if (!S_ISDIR(dd->mode) || dd->ptrs[0] == 0) {
+			continue;
+		}
+		memcpy(old, pages_get_page(dd->ptrs[0]), sizeof(old));
+		directory_init_page(dd->ptrs[0]);
+		for (int jj = 0; jj < count; ++jj) {
+			if (old[jj].name[0] != 0) {
+				old[jj].name[47] = 0;
+				directory_put(dd, old[jj].name, old[jj].inum);
+			}
+		}
+		csum_update(dd->ptrs[0]);
+	}
+	printf("+ directory_upgrade()\n");
+}
+
+// walk a directory's records: start with *pos = 0, returns NULL at the
+// end; unused records are skipped
+dirent* directory_next(inode* dd, int* pos){
+	char* page = pages_get_page(dd->ptrs[0]);
+	while (*pos < PAGE_BYTES) {
+		dirent* de = (dirent*)(page + *pos);
+		if (de->rec_len == 0) {
+			// corrupt chain, don't spin
+			*pos = PAGE_BYTES;
+			return NULL;
+		}
+		*pos += de->rec_len;
+		if (de->name_len != 0) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+static int
+name_matches(dirent* de, const char* name, int len){
+	return de->name_len == len && memcmp(de->name, name, len) == 0;
+}
+
 int directory_lookup(inode* dd, const char* name){
-	dirent* dirs = (dirent*)pages_get_page(dd->ptrs[0]);
-	for(int ii = 0; ii < 64; ++ii){
-		dirent curr = dirs[ii];
-		if(strcmp(name, curr.name) == 0){
-			return curr.inum;
+	int len = strlen(name);
+	int pos = 0;
+	dirent* de;
+	while ((de = directory_next(dd, &pos)) != NULL) {
+		if (name_matches(de, name, len)) {
+			return de->inum;
 		}
 	}
 	return -ENOENT;
@@ -31,47 +118,131 @@ int directory_lookup(inode* dd, const char* name){
 
 int tree_lookup(const char* path){
 	slist* parts = s_split(path, '/');
+	slist* head = parts;
 	int dn = 0;
 
-	if (parts == NULL || parts->next == NULL) {
-		// root directory
-		return 0;
-	}
-
 	while(parts != NULL){
-		inode* dir = get_inode(dn);
-		dn = directory_lookup(dir, parts->data);
+		// empty components come from leading, trailing or doubled '/'
+		if (parts->data[0] != 0) {
+			inode* dir = get_inode(dn);
+			if (!S_ISDIR(dir->mode)) {
+				dn = -ENOTDIR;
+				break;
+			}
+			dn = directory_lookup(dir, parts->data);
+			if (dn < 0) {
+				break;
+			}
+		}
 		parts = parts->next;
 	}
 
-	s_free(parts);
+	s_free(head);
 	return dn;
 }
 
-int directory_put(inode* dd, const char* name, int inum) {
-    dirent* dirs = (dirent*)pages_get_page(dd->ptrs[0]);
-    for (int i = 0; i < 64; i++) {
-        // find the next empty spot and place the inode
-        if (streq(dirs[i].name, "")) {
-            strcpy(dirs[i].name, name);
-            dirs[i].inum = inum;
+// insert into the first record of a directory page with enough slack,
+// splitting it
+static int put_in(char* page, const char* name, int len, int inum) {
+    int need = REC_SIZE(len);
+    for (int pos = 0; pos < PAGE_BYTES; ) {
+        dirent* de = (dirent*)(page + pos);
+        if (de->rec_len == 0) {
+            break;
+        }
+        int used = (de->name_len == 0) ? 0 : REC_SIZE(de->name_len);
+        if (de->rec_len - used >= need) {
+            dirent* slot = de;
+            if (used > 0) {
+                // split the slack off the end of this record
+                slot = (dirent*)(page + pos + used);
+                slot->rec_len = de->rec_len - used;
+                de->rec_len = used;
+            }
+            slot->name_len = len;
+            slot->type = (get_inode(inum)->mode & S_IFMT) >> 12;
+            slot->inum = inum;
+            memcpy(slot->name, name, len);
             return 0;
         }
+        pos += de->rec_len;
     }
-    return -ENOENT;
+    return -ENOSPC;
+}
+
+int directory_put(inode* dd, const char* name, int inum) {
+    int len = strlen(name);
+    if (len == 0 || len > DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    if (snap_unshare(&dd->ptrs[0]) < 0) {
+        return -ENOSPC;
+    }
+    int rv = put_in(pages_get_page(dd->ptrs[0]), name, len, inum);
+    if (rv == 0) {
+        pages_mark_dirty(dd->ptrs[0], 1);
+    }
+    return rv;
+}
+
+// insert count entries, all or none: they are added to a copy of the
+// page, which replaces it only if every one fits
+int directory_put_many(inode* dd, char** names, int* inums, int count) {
+    for (int ii = 0; ii < count; ++ii) {
+        int len = strlen(names[ii]);
+        if (len == 0 || len > DIR_NAME) {
+            return -ENAMETOOLONG;
+        }
+    }
+    if (snap_unshare(&dd->ptrs[0]) < 0) {
+        return -ENOSPC;
+    }
+    char* page = pages_get_page(dd->ptrs[0]);
+    char* copy = malloc(PAGE_BYTES);
+    memcpy(copy, page, PAGE_BYTES);
+    int rv = 0;
+    for (int ii = 0; ii < count && rv == 0; ++ii) {
+        rv = put_in(copy, names[ii], strlen(names[ii]), inums[ii]);
+    }
+    if (rv == 0) {
+        memcpy(page, copy, PAGE_BYTES);
+        pages_mark_dirty(dd->ptrs[0], 1);
+    }
+    free(copy);
+    return rv;
 }
 
+// free a record by merging it into the one before it; the first record
+// of a chunk just becomes unused
 int directory_delete(inode* dd, const char* name) {
-    // TODO: ch03
-    dirent* dirs = (dirent*)pages_get_page(dd->ptrs[0]);
-    for (int i = 0; i < 64; i++) {
-        // find the empty spot and delete
-        if (streq(dirs[i].name, name)) {
-            dirs[i].name[0] = 0;
-            dirs[i].inum = 0;
+    int len = strlen(name);
+    if (snap_unshare(&dd->ptrs[0]) < 0) {
+        return -ENOSPC;
+    }
+    char* page = pages_get_page(dd->ptrs[0]);
+    dirent* prev = NULL;
+
+    for (int pos = 0; pos < PAGE_BYTES; ) {
+        dirent* de = (dirent*)(page + pos);
+        if (de->rec_len == 0) {
+            break;
+        }
+        if (pos % DIR_CHUNK == 0) {
+            prev = NULL;
+        }
+        if (de->name_len != 0 && name_matches(de, name, len)) {
+            if (prev != NULL) {
+                prev->rec_len += de->rec_len;
+            }
+            else {
+                de->name_len = 0;
+                de->inum = 0;
+            }
+            pages_mark_dirty(dd->ptrs[0], 1);
             return 0;
         }
+        prev = de;
+        pos += de->rec_len;
     }
     return -ENOENT;
 }
-
@@ -3,25 +3,35 @@
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
-#define DIR_NAME 48
+#define DIR_NAME 255
+
+#include <stdint.h>
 
 #include "slist.h"
 #include "pages.h"
 #include "inode.h"
 
+// a variable-length directory entry; the records of a directory page
+// chain through rec_len and together cover the whole page, in 4K chunks
+// on images with larger pages
 typedef struct direntry {
-    char name[DIR_NAME];
-    int  inum;
-    char _reserved[12];
+    uint16_t rec_len;  // bytes from this record to the next
+    uint8_t  name_len; // 0 for an unused record
+    uint8_t  type;     // DT_* of the inode, so readdir needn't load it
+    int32_t  inum;
+    char     name[];   // name_len bytes, not NUL-terminated
 } dirent;
 
 void directory_init();
+void directory_init_page(int pnum);
+void directory_upgrade();
 int directory_lookup(inode* dd, const char* name);
 int tree_lookup(const char* path);
 int directory_put(inode* dd, const char* name, int inum);
+int directory_put_many(inode* dd, char** names, int* inums, int count);
 int directory_delete(inode* dd, const char* name);
+dirent* directory_next(inode* dd, int* pos);
 slist* directory_list(const char* path);
 void print_directory(inode* dd);
 
 #endif
-
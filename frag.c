@@ -0,0 +1,171 @@
+// Fragment allocation. Which fragments of each page are in use is kept in
+// the fragment map, one byte per page on a page of its own recorded in the
+// superblock. A page with a nonzero map byte is a fragment page; it is
+// allocated in the page bitmap like any other and freed with its last
+// fragment.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "frag.h"
+#include "pages.h"
+#include "superblock.h"
+#include "csum.h"
+#include "snapshot.h"
+
+static uint8_t*
+frag_map()
+{
+    return pages_get_page(get_superblock()->frag_page);
+}
+
+static uint8_t
+run_bits(int idx, int count)
+{
+    return (uint8_t)(((1 << count) - 1) << idx);
+}
+
+// first run of count free fragments in a page's map byte, or -1
+static int
+find_run(uint8_t used, int count)
+{
+    for (int idx = 0; idx + count <= FRAGS_PER_PAGE; ++idx) {
+        if ((used & run_bits(idx, count)) == 0) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+static void
+take_run(int pnum, int idx, int count)
+{
+    frag_map()[pnum] |= run_bits(idx, count);
+    // hand fragments out zeroed, like whole pages
+    memset((char*)pages_get_page(pnum) + idx * FRAG_SIZE, 0, count * FRAG_SIZE);
+    pages_mark_dirty(pnum, 1);
+    csum_update(pnum);
+}
+
+// allocate the fragment map on images that don't have one yet; called
+// at mount after the superblock is set up. Returns -1 if there is no room,
+// in which case files only ever get whole pages.
+int
+frag_init()
+{
+    superblock* sb = get_superblock();
+    if (sb->frag_page == 0) {
+        int pn = alloc_page();
+        if (pn < 0) {
+            printf("+ frag: no room for the fragment map\n");
+            return -1;
+        }
+        sb->frag_page = pn;
+        sb->features |= FEAT_FRAGMENTS;
+        csum_update(pn);
+    }
+    return 0;
+}
+
+// allocate count contiguous fragments, in a partly used fragment page if
+// one has room, else in a new page near goal; returns a fragment pointer
+// or -1
+int
+frag_alloc(int count, int goal)
+{
+    if (get_superblock()->frag_page == 0) {
+        return -1;
+    }
+    uint8_t* map = frag_map();
+
+    // fill the fullest page that fits, so pages free up again as a whole
+    int best = 0;
+    int best_idx = -1;
+    int best_free = FRAGS_PER_PAGE;
+    for (int pn = 1; pn < PAGE_COUNT; ++pn) {
+        // a snapshot's fragments may sit in the free part of a page it holds
+        if (map[pn] == 0 || snap_shared(pn)) {
+            continue;
+        }
+        int idx = find_run(map[pn], count);
+        int nfree = FRAGS_PER_PAGE - __builtin_popcount(map[pn]);
+        if (idx >= 0 && nfree < best_free) {
+            best = pn;
+            best_idx = idx;
+            best_free = nfree;
+        }
+    }
+
+    if (best == 0) {
+        best = alloc_page_near(goal);
+        if (best < 0) {
+            return -1;
+        }
+        best_idx = 0;
+    }
+    take_run(best, best_idx, count);
+    return FRAG_PTR(best, best_idx, count);
+}
+
+// change a fragment run's length, in place if the neighbouring fragments
+// allow it, else by moving it; returns the new pointer, or -1 with the
+// old run left alone
+int
+frag_resize(int ptr, int count, int goal)
+{
+    int pn = FRAG_PNUM(ptr);
+    int idx = FRAG_INDEX(ptr);
+    int old = FRAG_COUNT(ptr);
+    uint8_t* map = frag_map();
+
+    if (count <= old) {
+        map[pn] &= ~run_bits(idx + count, old - count);
+        return FRAG_PTR(pn, idx, count);
+    }
+    uint8_t more = run_bits(idx + old, count - old);
+    if (idx + count <= FRAGS_PER_PAGE && (map[pn] & more) == 0 && !snap_shared(pn)) {
+        take_run(pn, idx + old, count - old);
+        return FRAG_PTR(pn, idx, count);
+    }
+
+    int moved = frag_alloc(count, goal);
+    if (moved < 0) {
+        return -1;
+    }
+    int to = FRAG_PNUM(moved);
+    memcpy((char*)pages_get_page(to) + FRAG_OFFSET(moved),
+           (char*)pages_get_page(pn) + FRAG_OFFSET(ptr), FRAG_BYTES(ptr));
+    csum_update(to);
+    frag_free(ptr);
+    return moved;
+}
+
+void
+frag_free(int ptr)
+{
+    int pn = FRAG_PNUM(ptr);
+    uint8_t* map = frag_map();
+    map[pn] &= ~run_bits(FRAG_INDEX(ptr), FRAG_COUNT(ptr));
+    if (map[pn] == 0) {
+        free_page(pn);
+    }
+}
+
+// fragment pages in use, and how many of their fragments are taken
+void
+frag_stats(int* pages, int* frags_used)
+{
+    *pages = 0;
+    *frags_used = 0;
+    if (get_superblock()->frag_page == 0) {
+        return;
+    }
+    uint8_t* map = frag_map();
+    for (int pn = 1; pn < PAGE_COUNT; ++pn) {
+        if (map[pn] != 0) {
+            ++*pages;
+            *frags_used += __builtin_popcount(map[pn]);
+        }
+    }
+}
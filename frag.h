@@ -0,0 +1,32 @@
+#ifndef FRAG_H
+#define FRAG_H
+
+#include "pages.h"
+
+// Small files and file tails are packed into fragments of shared pages
+// instead of taking a page each; an eighth of a page, 512 bytes on a 4K
+// image.
+#define FRAGS_PER_PAGE 8
+#define FRAG_SIZE      (PAGE_BYTES / FRAGS_PER_PAGE)
+
+// A block pointer that names a run of fragments rather than a page:
+// flag, run length - 1, first fragment, page.
+#define FRAG_FLAG        (1 << 30)
+#define FRAG_PTR(pn, idx, count) \
+    (FRAG_FLAG | ((count) - 1) << 24 | (idx) << 20 | (pn))
+#define IS_FRAG(ptr)     (((ptr) & FRAG_FLAG) != 0)
+#define FRAG_PNUM(ptr)   ((ptr) & 0xfffff)
+#define FRAG_INDEX(ptr)  (((ptr) >> 20) & 0xf)
+#define FRAG_COUNT(ptr)  ((((ptr) >> 24) & 0x3f) + 1)
+#define FRAG_OFFSET(ptr) (FRAG_INDEX(ptr) * FRAG_SIZE)
+#define FRAG_BYTES(ptr)  (FRAG_COUNT(ptr) * FRAG_SIZE)
+// the page a block pointer's data is on
+#define PTR_PNUM(ptr)    (IS_FRAG(ptr) ? FRAG_PNUM(ptr) : (ptr))
+
+int  frag_init();
+int  frag_alloc(int count, int goal);
+int  frag_resize(int ptr, int count, int goal);
+void frag_free(int ptr);
+void frag_stats(int* pages, int* frags_used);
+
+#endif
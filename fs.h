@@ -0,0 +1,37 @@
+#ifndef NUFS_FS_H
+#define NUFS_FS_H
+
+#include "pages.h"
+#include "inode.h"
+#include "storage.h"
+#include "csum.h"
+#include "defrag.h"
+#include "reclaim.h"
+#include "ag.h"
+#include "tier.h"
+#include "spacemap.h"
+#include "writeback.h"
+#include "xattr.h"
+
+// One open image: everything the engine keeps between calls.
+struct nufs_fs {
+    pages_state   pages;
+    inode_state   inodes;
+    storage_state storage;
+    csum_state    csum;
+    defrag_state  defrag;
+    reclaim_state reclaim;
+    ag_state      ags;
+    tier_state    tier;
+    spacemap_state spacemap;
+    writeback_state writeback;
+    xattr_state   xattrs;
+};
+
+// The instance the calling thread works on. The engine below storage.c
+// reaches its state through this rather than taking the handle in every
+// function; the storage_* entry points set it from their handle, and
+// each background thread from the instance it serves.
+extern __thread nufs_fs* nufs_cur;
+
+#endif
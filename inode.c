@@ -1,7 +1,16 @@
+#include <assert.h>
+#include <errno.h>
+
 #include "inode.h"
 #include "pages.h"
 #include "storage.h"
 #include "bitmap.h"
+#include "csum.h"
+#include "fs.h"
+#include "frag.h"
+#include "ag.h"
+#include "snapshot.h"
+#include "xattr.h"
 
 #include "util.h"
 
@@ -11,74 +20,360 @@ get_inode(int inum){
 	return in + (inum * sizeof(inode));
 }
 
+// take an inode from the calling CPU's allocation group
 int
 alloc_inode(){
+	return alloc_inode_in(ag_local());
+}
+
+// take an inode from group, or failing that from the groups after it
+int
+alloc_inode_in(int group){
 	void* inode_bm = get_inode_bitmap();
-	// from 0 to PAGECOUNT
-	for(int i = 0; i < 256; ++i){
-		if(!bitmap_get(inode_bm, i)){
-			bitmap_put(inode_bm, i, 1);
-			return i;
+	for (int nn = 0; nn < ag_total(); ++nn) {
+		ag* g = ag_get((group + nn) % ag_total());
+		if (g->free_inodes == 0) {
+			continue;
+		}
+		for(int i = g->first_inode; i < g->first_inode + g->inodes; ++i){
+			if(!bitmap_get(inode_bm, i)){
+				bitmap_put(inode_bm, i, 1);
+				ag_inode_used(i, 1);
+				return i;
+			}
 		}
 	}
 	return -1;
 }
 
+void free_inode(int inum){
+	xattr_drop(inum);
+	bitmap_put(get_inode_bitmap(), inum, 0);
+	ag_inode_used(inum, 0);
+}
+
+// pages set aside for a growing inode at a time
+#define ALLOC_WINDOW 8
+
+// allocation windows of the calling thread's instance
+#define windows (nufs_cur->inodes.windows)
+
+int inode_num(inode* node){
+	return node - (inode*)get_inode(0);
+}
+
+void inode_set_goal(int inum, int goal){
+	windows[inum].goal = goal;
+}
+
+void inode_release_window(int inum){
+	alloc_window* w = &windows[inum];
+	if (w->len > 0) {
+		unreserve_pages(w->start, w->len);
+	}
+	w->len = 0;
+}
+
+// allocate a page for inum at goal, out of its window where possible
+static int window_alloc(int inum, int goal){
+	alloc_window* w = &windows[inum];
+	if (w->len == 0 || w->start != goal) {
+		inode_release_window(inum);
+		w->start = reserve_pages(goal, ALLOC_WINDOW, &w->len);
+	}
+	while (w->len > 0) {
+		int pnum = w->start;
+		w->start++;
+		w->len--;
+		if (claim_page(pnum) == 0) {
+			w->goal = pnum + 1;
+			return pnum;
+		}
+	}
+	// nothing left to reserve, take whatever is free
+	int pnum = alloc_page_near(goal);
+	if (pnum > 0) {
+		w->goal = pnum + 1;
+	}
+	return pnum;
+}
+
+static int promote_frag(inode* node, int fpn);
+static int unshare_ptr(inode* node, int fpn, int ptr);
+
+// pages are assigned when data is written into them (inode_alloc_pnum),
+// so growing only moves the size and leaves holes behind
 int grow_inode(inode* node, int size){
-	int new_size = bytes_to_pages(size);
-	int start = bytes_to_pages(node->size);
-	for (int ii = start; ii < new_size; ii++){
-		if (ii < 2) 
-		{
-			node->ptrs[ii] = alloc_page();
-		}
-		else
-		{
-			if (node->iptr == 0)
-			{
-				node->iptr = alloc_page();
+	// a fragment tail the file grows past becomes a page of its own
+	if (node->size > 0) {
+		int last = PAGE_OF(node->size - 1);
+		if (IS_FRAG(inode_get_ptr(node, last)) && PAGE_OF(size - 1) > last) {
+			if (last >= 2 && snap_unshare(&node->iptr) < 0) {
+				return -ENOSPC;
 			}
-			int* iptrs = pages_get_page(node->iptr);
-			iptrs[ii - 2] = alloc_page();
-		} 
+			promote_frag(node, last);
+		}
 	}
 	node->size = size;
 	return 0;
 }
 
 int shrink_inode(inode* node, int size) {
-	int new_size = bytes_to_pages(size);
-	int start = bytes_to_pages(node->size);
-
-	for (int ii = start; ii > new_size; ii--){
-		if (ii < 2) 
-		{
-			memset(pages_get_page(node->ptrs[ii]), 0, 4096);
-			free_page(node->ptrs[ii]);
-		}
-		else
-		{
-			int* iptrs = pages_get_page(node->iptr);
-			memset(pages_get_page(iptrs[ii - 2]), 0, 4096);
-			free_page(iptrs[ii - 2]);
-			if (node->iptr == 2)
-			{
-				memset(pages_get_page(node->iptr), 0, 4096);
-				free_page(node->iptr);
+	int new_pages = bytes_to_pages(size);
+	int old_pages = bytes_to_pages(node->size);
+	int tail = PAGE_OFF(size);
+
+	// pages a snapshot holds are copied before anything is freed, so
+	// running out of room leaves the file as it was: the indirect page
+	// if it keeps entries that get cleared, and the last page if its
+	// tail gets zeroed. An indirect page that goes entirely is just
+	// dropped.
+	if (new_pages > 2 && old_pages > new_pages && snap_unshare(&node->iptr) < 0) {
+		return -ENOSPC;
+	}
+	if (tail != 0) {
+		int ptr = inode_get_ptr(node, new_pages - 1);
+		if (ptr != 0 && snap_shared(PTR_PNUM(ptr))
+		    && unshare_ptr(node, new_pages - 1, ptr) < 0) {
+			return -ENOSPC;
+		}
+	}
+
+	for (int ii = new_pages; ii < old_pages; ii++){
+		int ptr = inode_get_ptr(node, ii);
+		if (ptr == 0) {
+			continue;
+		}
+		if (IS_FRAG(ptr)) {
+			frag_free(ptr);
+		}
+		else {
+			free_page(ptr);
+		}
+		if (ii < 2 || new_pages > 2) {
+			inode_set_pnum(node, ii, 0);
+		}
+	}
+	if (new_pages <= 2 && node->iptr != 0) {
+		free_page(node->iptr);
+		node->iptr = 0;
+	}
+
+	// clear the tail of the last page so a later grow reads zeros; a
+	// fragment tail gives back the fragments it no longer needs
+	if (tail != 0) {
+		int ptr = inode_get_ptr(node, new_pages - 1);
+		if (IS_FRAG(ptr)) {
+			int want = (tail + FRAG_SIZE - 1) / FRAG_SIZE;
+			if (want < FRAG_COUNT(ptr)) {
+				ptr = frag_resize(ptr, want, 0);
+				inode_set_pnum(node, new_pages - 1, ptr);
+			}
+			if (tail < FRAG_BYTES(ptr)) {
+				memset(pages_get_page(FRAG_PNUM(ptr)) + FRAG_OFFSET(ptr) + tail, 0,
+				       FRAG_BYTES(ptr) - tail);
+				pages_mark_dirty(FRAG_PNUM(ptr), 1);
+				csum_update(FRAG_PNUM(ptr));
 			}
-		} 
+		}
+		else if (ptr > 0) {
+			memset(pages_get_page(ptr) + tail, 0, PAGE_BYTES - tail);
+			pages_mark_dirty(ptr, 1);
+			csum_update(ptr);
+		}
 	}
 	node->size = size;
 	return 0;
 }
 
-// get the parent node number
-int inode_get_pnum(inode* node, int fpn) {
+// the raw block pointer for file page fpn: a page, a fragment pointer
+// (see frag.h) or 0 for a hole
+int inode_get_ptr(inode* node, int fpn) {
     if (fpn < 2) return node->ptrs[fpn];
+    if (node->iptr == 0) return 0;
     int* plist = pages_get_page(node->iptr);
     return plist[fpn - 2];
 }
 
+// get the page number backing file page fpn, 0 for a hole or a fragment
+// tail; whole pages are all that defrag and readahead deal in
+int inode_get_pnum(inode* node, int fpn) {
+    int ptr = inode_get_ptr(node, fpn);
+    return IS_FRAG(ptr) ? 0 : ptr;
+}
+
+// where the data of file page fpn is: returns the page (0 for a hole) and
+// sets *base to the data's offset in it and *len to how much is stored;
+// bytes past that read as zeros
+int inode_locate(inode* node, int fpn, int* base, int* len) {
+    int ptr = inode_get_ptr(node, fpn);
+    if (IS_FRAG(ptr)) {
+        *base = FRAG_OFFSET(ptr);
+        *len = FRAG_BYTES(ptr);
+        return FRAG_PNUM(ptr);
+    }
+    *base = 0;
+    *len = PAGE_BYTES;
+    return ptr;
+}
+
+void inode_set_pnum(inode* node, int fpn, int pnum) {
+    if (fpn < 2) {
+        node->ptrs[fpn] = pnum;
+        return;
+    }
+    assert(!snap_shared(node->iptr));
+    int* plist = pages_get_page(node->iptr);
+    plist[fpn - 2] = pnum;
+    pages_mark_dirty(node->iptr, 1);
+}
+
+// assign a page to file page fpn, placed right after the previous file
+// page when possible; returns the page or -1 when the image is full
+int inode_alloc_pnum(inode* node, int fpn) {
+	int inum = inode_num(node);
+	int goal = windows[inum].goal;
+	if (fpn > 0) {
+		int prev = inode_get_pnum(node, fpn - 1);
+		if (prev > 0) {
+			goal = prev + 1;
+		}
+	}
+
+	if (fpn >= 2 && node->iptr == 0) {
+		int ip = window_alloc(inum, goal);
+		if (ip < 0) {
+			return -1;
+		}
+		node->iptr = ip;
+		goal = ip + 1;
+	}
+
+	int pn = window_alloc(inum, goal);
+	if (pn < 0) {
+		return -1;
+	}
+	inode_set_pnum(node, fpn, pn);
+	return pn;
+}
+
+// move a fragment tail into a page of its own; returns the page, or -1
+// with the fragments left in place
+static int promote_frag(inode* node, int fpn) {
+	int old = inode_get_ptr(node, fpn);
+	inode_set_pnum(node, fpn, 0);
+	int pn = inode_alloc_pnum(node, fpn);
+	if (pn < 0) {
+		inode_set_pnum(node, fpn, old);
+		return -1;
+	}
+	memcpy(pages_get_page(pn), pages_get_page(FRAG_PNUM(old)) + FRAG_OFFSET(old),
+	       FRAG_BYTES(old));
+	csum_update(pn);
+	frag_free(old);
+	return pn;
+}
+
+// give file page fpn its own copy of data a snapshot holds: a page is
+// copied, a fragment run moved to fragments of an unshared page (or a
+// page of its own if there are none). Returns the new block pointer, or
+// -1 with nothing changed when the image is full.
+static int unshare_ptr(inode* node, int fpn, int ptr) {
+	if (fpn >= 2 && snap_unshare(&node->iptr) < 0) {
+		return -1;
+	}
+	if (!IS_FRAG(ptr)) {
+		int pn = snap_cow(ptr);
+		if (pn > 0) {
+			inode_set_pnum(node, fpn, pn);
+		}
+		return pn;
+	}
+	int moved = frag_alloc(FRAG_COUNT(ptr), FRAG_PNUM(ptr) + 1);
+	if (moved < 0) {
+		return promote_frag(node, fpn);
+	}
+	memcpy(pages_get_page(FRAG_PNUM(moved)) + FRAG_OFFSET(moved),
+	       pages_get_page(FRAG_PNUM(ptr)) + FRAG_OFFSET(ptr), FRAG_BYTES(ptr));
+	csum_update(FRAG_PNUM(moved));
+	frag_free(ptr);
+	inode_set_pnum(node, fpn, moved);
+	return moved;
+}
+
+// make file page fpn ready to take a write of its bytes [0, end): the last
+// page of the file is kept in fragments while it fits in fewer than a
+// page's worth, anything else gets a whole page. Returns the page and sets
+// *base to the offset of the file page's data in it, or returns -1 when
+// the image is full.
+int inode_prepare_write(inode* node, int fpn, int end, int* base) {
+	*base = 0;
+	if (fpn >= 2 && snap_unshare(&node->iptr) < 0) {
+		return -1;
+	}
+	int ptr = inode_get_ptr(node, fpn);
+	if (ptr != 0 && snap_shared(PTR_PNUM(ptr))) {
+		ptr = unshare_ptr(node, fpn, ptr);
+		if (ptr < 0) {
+			return -1;
+		}
+	}
+	if (ptr > 0 && !IS_FRAG(ptr)) {
+		return ptr;
+	}
+
+	int want = (end + FRAG_SIZE - 1) / FRAG_SIZE;
+	int tail = (fpn == PAGE_OF(node->size - 1));
+	if (tail && want < FRAGS_PER_PAGE) {
+		int inum = inode_num(node);
+		int goal = (fpn > 0) ? inode_get_pnum(node, fpn - 1) + 1 : windows[inum].goal;
+		if (fpn >= 2 && node->iptr == 0) {
+			int ip = window_alloc(inum, goal);
+			if (ip < 0) {
+				return -1;
+			}
+			node->iptr = ip;
+		}
+		int nptr = ptr;
+		if (ptr == 0) {
+			nptr = frag_alloc(want, goal);
+		}
+		else if (want > FRAG_COUNT(ptr)) {
+			nptr = frag_resize(ptr, want, goal);
+		}
+		if (nptr > 0) {
+			inode_set_pnum(node, fpn, nptr);
+			*base = FRAG_OFFSET(nptr);
+			return FRAG_PNUM(nptr);
+		}
+		// no fragments to be had, fall back to a page
+	}
+
+	if (ptr != 0) {
+		return promote_frag(node, fpn);
+	}
+	return inode_alloc_pnum(node, fpn);
+}
+
+// count the physically contiguous runs backing the file, holes skipped;
+// the indirect page sitting inside a run doesn't break it
+int inode_extents(inode* node) {
+	int extents = 0;
+	int prev = -1;
+	for (int ii = 0; ii < bytes_to_pages(node->size); ++ii) {
+		int pn = inode_get_pnum(node, ii);
+		if (pn == 0) {
+			continue;
+		}
+		int skip_iptr = (node->iptr != 0 && node->iptr == prev + 1);
+		if (pn != prev + 1 && !(skip_iptr && pn == prev + 2)) {
+			extents++;
+		}
+		prev = pn;
+	}
+	return extents;
+}
+
 void print_inode(inode* node) {
 	printf("LOCATION: %p\n", node);
 	printf("Ref Count: %d\n", node->refs);
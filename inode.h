@@ -5,6 +5,7 @@
 #define INODE_H
 
 #include "pages.h"
+#include "superblock.h"
 #include "time.h"
 
 typedef struct inode {
@@ -19,12 +20,37 @@ typedef struct inode {
 
 } inode;
 
+// the inode table runs from byte 64 of page 0 up to the superblock
+#define INODE_COUNT ((SUPERBLOCK_OFFSET - 64) / (int)sizeof(inode))
+
+// in-memory allocation window per inode: a run of free pages reserved so
+// that a file stays contiguous even when several writers interleave
+typedef struct alloc_window {
+	int goal;  // where this inode's next page should go
+	int start; // next reserved page
+	int len;   // reserved pages left
+} alloc_window;
+
+typedef struct inode_state {
+	alloc_window windows[INODE_COUNT];
+} inode_state;
+
 void print_inode(inode* node);
 inode* get_inode(int inum);
 int alloc_inode();
-void free_inode();
+int alloc_inode_in(int group);
+void free_inode(int inum);
 int grow_inode(inode* node, int size);
 int shrink_inode(inode* node, int size);
+int inode_get_ptr(inode* node, int fpn);
 int inode_get_pnum(inode* node, int fpn);
+int inode_locate(inode* node, int fpn, int* base, int* len);
+int inode_prepare_write(inode* node, int fpn, int end, int* base);
+void inode_set_pnum(inode* node, int fpn, int pnum);
+int inode_alloc_pnum(inode* node, int fpn);
+int inode_num(inode* node);
+int inode_extents(inode* node);
+void inode_set_goal(int inum, int goal);
+void inode_release_window(int inum);
 
 #endif
@@ -10,6 +10,8 @@
 #include <bsd/string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <stddef.h>
+#include <fcntl.h>
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
@@ -17,6 +19,17 @@
 #include "storage.h"
 #include "util.h"
 #include "directory.h"
+#include "defrag.h"
+#include "spacemap.h"
+#include "snapshot.h"
+#include "nufs_ioctl.h"
+#include "csum.h"
+#include "trace.h"
+
+// the mounted image
+static nufs_fs* fs;
+// where calls are logged with -o trace=FILE, else NULL
+static trace* tr;
 
 // implementation for: man 2 access
 // Checks if a file exists.
@@ -33,9 +46,13 @@ nufs_access(const char *path, int mask)
 int
 nufs_getattr(const char *path, struct stat *st)
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = -ENOENT;
-    rv = storage_stat(path, st);
+    storage_lock(fs);
+    rv = storage_stat(fs, path, st);
+    storage_unlock(fs);
 
+    trace_end(tr, TR_GETATTR, path, NULL, 0, 0, 0, rv, t0);
     printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode, st->st_size);   
     return rv;
 }
@@ -46,29 +63,59 @@ int
 nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
              off_t offset, struct fuse_file_info *fi)
 {
+    uint64_t t0 = trace_begin(tr);
     struct stat st;
+    char name[DIR_NAME + 1];
     int rv = -ENOENT;
-    // TODO: actually iterate through directories
-    inode* rn = get_inode(tree_lookup(path));
-    dirent* root = (dirent*)pages_get_page(rn->ptrs[0]); 
-
-    for (int i = 0; i < 64; i++) {
-        // find the empty spot and place the dir
-        if (root[i].inum != 0) {
-            inode * node = get_inode(root[i].inum);
-            struct stat st;
-            st.st_mode = node->mode;
-            st.st_nlink = node->refs;
-            st.st_uid  = getuid();
-            st.st_size = node->size;
-            st.st_ino = root[i].inum;
-            st.st_atime = node->atime;
-            st.st_mtime = node->mtime;
-            st.st_ctime = node->ctime;
-            filler(buf, root[i].name, &st, 0);
-            rv = 0;
+    storage_lock(fs);
+    inode* dd = NULL;
+    int dn;
+    if (snap_is_dir(path)) {
+        // one directory per snapshot
+        dn = (snap_count() > 0) ? 0 : -ENOENT;
+        for (int ii = 0; ii < snap_count(); ++ii) {
+            memset(&st, 0, sizeof(st));
+            st.st_mode = 040000;
+            filler(buf, snap_name(ii), &st, 0);
+        }
+    }
+    else if (snap_path(path)) {
+        int idx;
+        dn = snap_lookup(path, &dd, &idx);
+    }
+    else {
+        dn = tree_lookup(path);
+        if (dn >= 0) {
+            dd = get_inode(dn);
+        }
+        if (dn == 0 && snap_count() > 0) {
+            memset(&st, 0, sizeof(st));
+            st.st_mode = 040000;
+            filler(buf, SNAP_DIR + 1, &st, 0);
         }
     }
+    if (dn < 0 || dd == NULL) {
+        storage_unlock(fs);
+        trace_end(tr, TR_READDIR, path, NULL, 0, 0, 0, dn, t0);
+        printf("getaddir(%s) -> (%d)\n", path, dn);
+        return dn;
+    }
+    rv = 0;
+
+    // entries carry their type, so there is no need to load each inode;
+    // FUSE stats them itself when it needs more
+    int pos = 0;
+    dirent* de;
+    while ((de = directory_next(dd, &pos)) != NULL) {
+        memcpy(name, de->name, de->name_len);
+        name[de->name_len] = 0;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = de->inum;
+        st.st_mode = de->type << 12;
+        filler(buf, name, &st, 0);
+    }
+    storage_unlock(fs);
+    trace_end(tr, TR_READDIR, path, NULL, 0, 0, 0, rv, t0);
     printf("getaddir(%s) -> (%d)\n", path, rv);
     return rv;
 }
@@ -78,7 +125,12 @@ nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 int
 nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-    int rv = storage_mknod(path, mode);
+    uint64_t t0 = trace_begin(tr);
+    int rv = -1;
+    storage_lock(fs);
+    rv = storage_mknod(fs, path, mode);
+    storage_unlock(fs);
+    trace_end(tr, TR_MKNOD, path, NULL, 0, mode, 0, rv, t0);
     printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
     return rv;
 }
@@ -89,7 +141,12 @@ nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 int
 nufs_mkdir(const char *path, mode_t mode)
 {
-    int rv = storage_mknod(path, 040000 + mode);
+    uint64_t t0 = trace_begin(tr);
+    int rv = -1;
+    storage_lock(fs);
+    rv = storage_mknod(fs, path, 040000 + mode);
+    storage_unlock(fs);
+    trace_end(tr, TR_MKDIR, path, NULL, 0, mode, 0, rv, t0);
     printf("mkdir(%s, %04o) -> %d\n", path, mode, rv);
     return rv;
 }
@@ -97,8 +154,12 @@ nufs_mkdir(const char *path, mode_t mode)
 int
 nufs_unlink(const char *path)
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = -1;
-    rv = storage_unlink(path);
+    storage_lock(fs);
+    rv = storage_unlink(fs, path);
+    storage_unlock(fs);
+    trace_end(tr, TR_UNLINK, path, NULL, 0, 0, 0, rv, t0);
     printf("unlink(%s) -> %d\n", path, rv);
     return rv;
 }
@@ -106,8 +167,12 @@ nufs_unlink(const char *path)
 int
 nufs_link(const char *from, const char *to)
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = -1;
-    rv = storage_link(from, to);
+    storage_lock(fs);
+    rv = storage_link(fs, from, to);
+    storage_unlock(fs);
+    trace_end(tr, TR_LINK, from, to, 0, 0, 0, rv, t0);
     printf("link(%s => %s) -> %d\n", from, to, rv);
 	return rv;
 }
@@ -115,7 +180,9 @@ nufs_link(const char *from, const char *to)
 int
 nufs_rmdir(const char *path)
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = -1;
+    trace_end(tr, TR_RMDIR, path, NULL, 0, 0, 0, rv, t0);
     printf("rmdir(%s) -> %d\n", path, rv);
     return rv;
 }
@@ -125,8 +192,12 @@ nufs_rmdir(const char *path)
 int
 nufs_rename(const char *from, const char *to)
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = -1;
-    rv = storage_rename(from,to);
+    storage_lock(fs);
+    rv = storage_rename(fs, from,to);
+    storage_unlock(fs);
+    trace_end(tr, TR_RENAME, from, to, 0, 0, 0, rv, t0);
     printf("rename(%s => %s) -> %d\n", from, to, rv);
     return rv;
 }
@@ -134,8 +205,12 @@ nufs_rename(const char *from, const char *to)
 int
 nufs_chmod(const char *path, mode_t mode)
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = -1;
-    rv = storage_chmod(path, mode);
+    storage_lock(fs);
+    rv = storage_chmod(fs, path, mode);
+    storage_unlock(fs);
+    trace_end(tr, TR_CHMOD, path, NULL, 0, mode, 0, rv, t0);
     printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
     return rv;
 }
@@ -143,29 +218,84 @@ nufs_chmod(const char *path, mode_t mode)
 int
 nufs_truncate(const char *path, off_t size)
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = -1;
-    rv = storage_truncate(path, size);
+    storage_lock(fs);
+    rv = storage_truncate(fs, path, size);
+    storage_unlock(fs);
+    trace_end(tr, TR_TRUNCATE, path, NULL, 0, 0, size, rv, t0);
     printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
     return rv;
 }
 
-// this is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
+// this is called on open; the per-file state (readahead) is
+// kept in fi->fh until release.
 int
 nufs_open(const char *path, struct fuse_file_info *fi)
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = 0;
+    nufs_file* fh = NULL;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY && snap_path(path)) {
+        // snapshots are read-only; fail here, not at the first write
+        rv = -EROFS;
+    }
+    else {
+        storage_lock(fs);
+        fh = storage_open(fs, path);
+        storage_unlock(fs);
+    }
+    if (fh == NULL) {
+        rv = rv ? rv : -ENOENT;
+    }
+    else {
+        // all changes go through us, so unchanged contents can keep
+        // the kernel's page cache across opens
+        fi->keep_cache = fh->keep_cache;
+    }
+    fi->fh = (uint64_t)fh;
+    trace_end(tr, TR_OPEN, path, NULL, fi->fh, 0, 0, rv, t0);
     printf("open(%s) -> %d\n", path, rv);
     return rv;
 }
 
+int
+nufs_release(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t0 = trace_begin(tr);
+    storage_lock(fs);
+    storage_release(fs, (nufs_file*)fi->fh);
+    storage_unlock(fs);
+    trace_end(tr, TR_RELEASE, path, NULL, fi->fh, 0, 0, 0, t0);
+    printf("release(%s) -> 0\n", path);
+    return 0;
+}
+
+// called on each close(2) of an open file; stores the writes buffered
+// for it, so errors they run into are returned by close
+int
+nufs_flush(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t0 = trace_begin(tr);
+    int rv = 0;
+    storage_lock(fs);
+    rv = storage_flush(fs, (nufs_file*)fi->fh);
+    storage_unlock(fs);
+    trace_end(tr, TR_FLUSH, path, NULL, fi->fh, 0, 0, rv, t0);
+    printf("flush(%s) -> %d\n", path, rv);
+    return rv;
+}
+
 // Actually read data
 int
 nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = 6;
-    rv = storage_read(path, buf, size, offset);
+    storage_lock(fs);
+    rv = storage_read(fs, path, buf, size, offset, (nufs_file*)fi->fh);
+    storage_unlock(fs);
+    trace_end(tr, TR_READ, path, NULL, fi->fh, offset, size, rv, t0);
     printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
     return rv;
 }
@@ -174,8 +304,12 @@ nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_fi
 int
 nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = -1;
-    rv = storage_write(path, buf, size, offset);
+    storage_lock(fs);
+    rv = storage_write(fs, path, buf, size, offset, (nufs_file*)fi->fh);
+    storage_unlock(fs);
+    trace_end(tr, TR_WRITE, path, NULL, fi->fh, offset, size, rv, t0);
     printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
     return rv;
 }
@@ -185,44 +319,176 @@ nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct
 int
 nufs_utimens(const char* path, const struct timespec ts[2])
 {
+    uint64_t t0 = trace_begin(tr);
     int rv = -1;
-    rv = storage_set_time(path, ts);
+    storage_lock(fs);
+    rv = storage_set_time(fs, path, ts);
+    storage_unlock(fs);
+    trace_end(tr, TR_UTIMENS, path, NULL, 0, ts[0].tv_sec, ts[1].tv_sec, rv, t0);
     printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
            path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
 	return rv;
 }
 
+// implements: man 2 fsync
+// stores buffered writes and timestamps that lazytime is still holding
+// in memory
+int
+nufs_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    uint64_t t0 = trace_begin(tr);
+    int rv = -1;
+    storage_lock(fs);
+    rv = storage_fsync(fs, path);
+    storage_unlock(fs);
+    trace_end(tr, TR_FSYNC, path, NULL, fi->fh, 0, 0, rv, t0);
+    printf("fsync(%s, %d) -> %d\n", path, datasync, rv);
+    return rv;
+}
+
+// called once mounted, after FUSE has daemonized
+void*
+nufs_init(struct fuse_conn_info* conn)
+{
+    storage_start(fs);
+    printf("init()\n");
+    return NULL;
+}
+
+// called on unmount
+void
+nufs_destroy(void* private_data)
+{
+    storage_lock(fs);
+    storage_stop(fs);
+    storage_unlock(fs);
+    printf("destroy()\n");
+}
+
 // Extended operations
 int
 nufs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
            unsigned int flags, void* data)
 {
     int rv = -1;
+    storage_lock(fs);
+    switch ((unsigned int)cmd) {
+    case NUFS_IOC_DEFRAG:
+        rv = defrag_start(*(int*)data);
+        break;
+    case NUFS_IOC_DEFRAG_STATUS:
+        defrag_status((nufs_defrag_status*)data);
+        rv = 0;
+        break;
+    case NUFS_IOC_SPACEMAP:
+        spacemap_report((nufs_spacemap*)data);
+        rv = 0;
+        break;
+    case NUFS_IOC_SNAPSHOT:
+        rv = storage_snapshot(fs, ((nufs_snapshot_arg*)data)->name);
+        break;
+    case NUFS_IOC_SNAPSHOT_DELETE:
+        rv = storage_snapshot_delete(fs, ((nufs_snapshot_arg*)data)->name);
+        break;
+    case NUFS_IOC_CHANGES:
+        rv = storage_changes(fs, (nufs_changes*)data);
+        break;
+    case NUFS_IOC_BULKSTAT:
+        rv = storage_bulkstat(fs, path, (nufs_bulkstat*)data);
+        break;
+    case NUFS_IOC_BULKCREATE:
+        rv = storage_bulkcreate(fs, path, (nufs_bulkcreate*)data);
+        break;
+    default:
+        rv = -ENOTTY;
+    }
+    storage_unlock(fs);
     printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
     return rv;
 }
 
 int
 nufs_readlink(const char* path, char* buf, size_t size) {
+    uint64_t t0 = trace_begin(tr);
     int rv = -ENOENT;
-    rv = storage_read(path, buf, size , 0);
+    storage_lock(fs);
+    rv = storage_read(fs, path, buf, size , 0, NULL);
+    storage_unlock(fs);
+    trace_end(tr, TR_READLINK, path, NULL, 0, 0, size, rv, t0);
     printf("readlink(%s) -> (%d)\n", path, rv);
     return rv;
 }
 
 int
 nufs_symlink(const char* to, const char* from){
+    uint64_t t0 = trace_begin(tr);
     int rv = -ENOENT;
-    rv = nufs_mknod(from, 0120000, 0);
+    // not through nufs_mknod, so a trace holds this as one call
+    storage_lock(fs);
+    rv = storage_mknod(fs, from, 0120000);
     if (rv < 0) {
+        storage_unlock(fs);
+        trace_end(tr, TR_SYMLINK, from, to, 0, 0, 0, rv, t0);
         printf("SYMLINK ERROR\n");
         return rv;
     }
-    rv = storage_write(from, to, strlen(to), 0);
+    rv = storage_write(fs, from, to, strlen(to), 0, NULL);
+    storage_unlock(fs);
+    trace_end(tr, TR_SYMLINK, from, to, 0, 0, 0, rv, t0);
     printf("symlink(%s, %s) -> (%d)\n", from, to, rv);
     return rv;
 }
 
+// implements: man 2 getxattr; a file without attributes answers from
+// memory, which is what the kernel's security.capability probes hit
+int
+nufs_getxattr(const char* path, const char* name, char* value, size_t size)
+{
+    uint64_t t0 = trace_begin(tr);
+    storage_lock(fs);
+    int rv = storage_getxattr(fs, path, name, value, size);
+    storage_unlock(fs);
+    trace_end(tr, TR_GETXATTR, path, name, 0, 0, size, rv, t0);
+    printf("getxattr(%s, %s, %zu) -> %d\n", path, name, size, rv);
+    return rv;
+}
+
+int
+nufs_setxattr(const char* path, const char* name, const char* value, size_t size, int flags)
+{
+    uint64_t t0 = trace_begin(tr);
+    storage_lock(fs);
+    int rv = storage_setxattr(fs, path, name, value, size, flags);
+    storage_unlock(fs);
+    trace_end(tr, TR_SETXATTR, path, name, 0, flags, size, rv, t0);
+    printf("setxattr(%s, %s, %zu, %d) -> %d\n", path, name, size, flags, rv);
+    return rv;
+}
+
+int
+nufs_listxattr(const char* path, char* list, size_t size)
+{
+    uint64_t t0 = trace_begin(tr);
+    storage_lock(fs);
+    int rv = storage_listxattr(fs, path, list, size);
+    storage_unlock(fs);
+    trace_end(tr, TR_LISTXATTR, path, NULL, 0, 0, size, rv, t0);
+    printf("listxattr(%s, %zu) -> %d\n", path, size, rv);
+    return rv;
+}
+
+int
+nufs_removexattr(const char* path, const char* name)
+{
+    uint64_t t0 = trace_begin(tr);
+    storage_lock(fs);
+    int rv = storage_removexattr(fs, path, name);
+    storage_unlock(fs);
+    trace_end(tr, TR_REMOVEXATTR, path, name, 0, 0, 0, rv, t0);
+    printf("removexattr(%s, %s) -> %d\n", path, name, rv);
+    return rv;
+}
+
 void
 nufs_init_ops(struct fuse_operations* ops)
 {
@@ -239,23 +505,116 @@ nufs_init_ops(struct fuse_operations* ops)
     ops->chmod    = nufs_chmod;
     ops->truncate = nufs_truncate;
     ops->open	  = nufs_open;
+    ops->release  = nufs_release;
+    ops->flush    = nufs_flush;
     ops->read     = nufs_read;
     ops->write    = nufs_write;
     ops->utimens  = nufs_utimens;
     ops->ioctl    = nufs_ioctl;
     ops->readlink = nufs_readlink;
     ops->symlink  = nufs_symlink;
+    ops->fsync    = nufs_fsync;
+    ops->getxattr    = nufs_getxattr;
+    ops->setxattr    = nufs_setxattr;
+    ops->listxattr   = nufs_listxattr;
+    ops->removexattr = nufs_removexattr;
+    ops->init     = nufs_init;
+    ops->destroy  = nufs_destroy;
 };
 
 
 struct fuse_operations nufs_ops;
 
+// nufs-specific mount options, consumed before the rest go to FUSE
+// default kernel cache timeouts, in seconds
+#define NUFS_CACHE_OPTS "entry_timeout=60,attr_timeout=60,negative_timeout=10"
+// with -o cache=short: for mounts that bulk create or take snapshots
+#define NUFS_SHORT_CACHE_OPTS "entry_timeout=0,attr_timeout=1,negative_timeout=0"
+
+struct nufs_config {
+    int atime_mode;
+    int lazytime;
+    int backend;
+    int queue_depth;
+    int stripe_pages;
+    int csum;
+    int tier_pages;
+    char* trace;
+    int page_size;
+    int wb_interval;
+    int dirty_bytes;
+    int short_cache;
+};
+
+#define NUFS_OPT(t, p, v) { t, offsetof(struct nufs_config, p), v }
+
+static struct fuse_opt nufs_opts[] = {
+    NUFS_OPT("strictatime", atime_mode, ATIME_STRICT),
+    NUFS_OPT("relatime",    atime_mode, ATIME_RELATIME),
+    NUFS_OPT("noatime",     atime_mode, ATIME_NOATIME),
+    NUFS_OPT("lazytime",    lazytime,   1),
+    NUFS_OPT("backend=mmap",  backend, PAGES_MMAP),
+    NUFS_OPT("backend=uring", backend, PAGES_URING),
+    NUFS_OPT("queue_depth=%u", queue_depth, 0),
+    NUFS_OPT("stripe=%u",      stripe_pages, 0),
+    NUFS_OPT("csum=off",  csum, CSUM_OFF),
+    NUFS_OPT("csum=meta", csum, CSUM_META),
+    NUFS_OPT("csum=all",  csum, CSUM_ALL),
+    NUFS_OPT("tier=%u",   tier_pages, 0),
+    NUFS_OPT("trace=%s",  trace, 0),
+    NUFS_OPT("blocksize=%u", page_size, 0),
+    NUFS_OPT("wb_interval=%u", wb_interval, 0),
+    NUFS_OPT("dirty_bytes=%u", dirty_bytes, 0),
+    NUFS_OPT("cache=long",  short_cache, 0),
+    NUFS_OPT("cache=short", short_cache, 1),
+    FUSE_OPT_END
+};
+
 int
 main(int argc, char *argv[])
 {
-    assert(argc > 2 && argc < 6);
-    storage_init(argv[--argc]);
+    assert(argc > 2);
+    // the image is the last argument: one file, or several
+    // comma-separated files to stripe over; with -o tier=N, a fast and
+    // a slow file, the first N pages on the fast one
+    const char* image = argv[--argc];
+
+    struct nufs_config conf = { ATIME_RELATIME, 0, PAGES_MMAP, 32, 16, CSUM_OFF, 0, NULL, 4096,
+                                1000, 256 * 1024, 0 };
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    int rv = fuse_opt_parse(&args, &conf, nufs_opts, NULL);
+    assert(rv == 0);
+    // nothing changes the image behind the kernel's back, so let it
+    // cache lookups and attributes; these go first so that -o on the
+    // command line still overrides them. A bulk create or a snapshot
+    // (nufsctl) does add and remove names behind its back, so a mount
+    // that uses them takes -o cache=short to look names up every time
+    fuse_opt_insert_arg(&args, 1, conf.short_cache ? "-o" NUFS_SHORT_CACHE_OPTS
+                                                   : "-o" NUFS_CACHE_OPTS);
+    fs = storage_new();
+    // only used when formatting; an image keeps the size it was made with
+    if (storage_set_page_size(fs, conf.page_size) < 0) {
+        fprintf(stderr, "blocksize must be 4096, 16384 or 65536\n");
+        return 1;
+    }
+    storage_set_stripe(fs, conf.stripe_pages);
+    storage_set_csum(fs, conf.csum);
+    storage_set_tier(fs, conf.tier_pages);
+    storage_set_writeback(fs, conf.wb_interval, conf.dirty_bytes);
+    storage_init(fs, image);
+    storage_set_time_opts(fs, conf.atime_mode, conf.lazytime);
+    storage_set_io_opts(fs, conf.backend, conf.queue_depth);
+    if (conf.trace != NULL) {
+        // opened before FUSE daemonizes, so a relative path still works
+        tr = trace_open(conf.trace);
+        assert(tr != NULL);
+    }
+
     nufs_init_ops(&nufs_ops);
-    return fuse_main(argc, argv, &nufs_ops, NULL);
+    rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+    storage_free(fs);
+    trace_close(tr);
+    fuse_opt_free_args(&args);
+    return rv;
 }
 
@@ -0,0 +1,148 @@
+// ioctls understood by nufs_ioctl, shared with the tools
+
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+typedef struct nufs_defrag_status {
+    int running;             // a defrag pass is in progress
+    int files_total;         // files considered by the pass
+    int files_done;          // files processed so far
+    int pages_moved;
+    int extents_before;      // summed over all files
+    int extents_after;
+    int free_runs_before;    // separate runs of free pages
+    int free_runs_after;
+    int largest_free_before; // longest free run, in pages
+    int largest_free_after;
+} nufs_defrag_status;
+
+// log2 buckets of free run lengths: bucket b counts runs of 2^b to
+// 2^(b+1) - 1 pages
+#define NUFS_SPACEMAP_BUCKETS 9
+#define NUFS_SPACEMAP_REGIONS 8
+#define NUFS_SPACEMAP_FILES   128
+
+// one allocation group's share of the image
+typedef struct nufs_spacemap_region {
+    int first_page;
+    int pages;
+    int free_pages;
+    int inodes;
+    int free_inodes;
+} nufs_spacemap_region;
+
+typedef struct nufs_spacemap {
+    int page_size;
+    int pages;               // pages in the image, page 0 included
+    int free_pages;
+    int inodes;
+    int free_inodes;
+    int free_runs;           // separate runs of free pages
+    int largest_free;        // longest free run, in pages
+    int run_hist[NUFS_SPACEMAP_BUCKETS];
+    int files;               // inodes in use with data pages
+    int file_pages;          // data pages of those files
+    int extents;             // summed over those files
+    int fragmented_files;    // files in more than one extent
+    // scores from 0 (none) to 100: how much of the free space is outside
+    // the largest run, and how many of the files' page boundaries are
+    // breaks between extents
+    int free_frag;
+    int file_frag;
+    int region_count;
+    nufs_spacemap_region regions[NUFS_SPACEMAP_REGIONS];
+    // extents of each inode's file data: 0 for directories and empty
+    // files, -1 for an inode not in use
+    int file_extents[NUFS_SPACEMAP_FILES];
+} nufs_spacemap;
+
+// snapshot names are at most NUFS_SNAP_NAME - 1 bytes, without '/'
+#define NUFS_SNAP_NAME 32
+
+typedef struct nufs_snapshot_arg {
+    char name[NUFS_SNAP_NAME];
+} nufs_snapshot_arg;
+
+// pages changed since a generation, for incremental backups: since is
+// the generation the last backup ended at, or 0 for a full one. The
+// generation this one ends at comes back in gen, and a new one starts.
+typedef struct nufs_changes {
+    int     since;
+    int     gen;
+    int     page_size;
+    int     pages;
+    int     members;      // backing files; a single one holds page n at
+                          // n * page_size
+    uint8_t changed[32];  // a bit per page, first page in the first
+                          // byte's high bit
+} nufs_changes;
+
+// Batched metadata calls pack records into a buffer that, with its
+// header, stays under the 16K an ioctl argument can have. Records are
+// 8-byte aligned; rec_len leads from one to the next.
+#define NUFS_BULK_BUF (16384 - 64)
+
+// one entry's attributes
+typedef struct nufs_bulk_stat {
+    int64_t  size;
+    int64_t  atime;
+    int64_t  mtime;
+    int64_t  ctime;
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t nlink;
+    int32_t  err;      // -errno for a path that couldn't be looked up
+    uint16_t rec_len;
+    uint16_t name_len;
+    char     name[];   // name_len bytes, not NUL-terminated
+} nufs_bulk_stat;
+
+// stat a whole directory, the one the ioctl is made on, or with
+// NUFS_BULK_PATHS the count NUL-separated paths in buf, relative to it.
+// Results replace buf; when they don't all fit, more is set and the call
+// is repeated with pos as returned.
+#define NUFS_BULK_PATHS 0x1
+
+typedef struct nufs_bulkstat {
+    int  flags;
+    int  pos;      // where to go on from: 0 at first
+    int  count;    // paths in, records out
+    int  more;
+    char buf[NUFS_BULK_BUF];
+} nufs_bulkstat;
+
+// one file to create: name_len bytes of name, then data_len bytes of
+// contents (regular files and symlinks only)
+typedef struct nufs_bulk_file {
+    uint32_t mode;
+    uint32_t data_len;
+    uint16_t rec_len;
+    uint16_t name_len;
+    char     name[];
+} nufs_bulk_file;
+
+// create count files in the directory the ioctl is made on, all or none;
+// on an error, failed is the record it was about, or -1
+typedef struct nufs_bulkcreate {
+    int  count;
+    int  failed;
+    char buf[NUFS_BULK_BUF];
+} nufs_bulkcreate;
+
+// start a background defrag of the whole image; the argument is the
+// rate limit in pages per second, 0 for the default
+#define NUFS_IOC_DEFRAG        _IOW('N', 1, int)
+#define NUFS_IOC_DEFRAG_STATUS _IOR('N', 2, nufs_defrag_status)
+// how full and how fragmented the image is
+#define NUFS_IOC_SPACEMAP      _IOR('N', 3, nufs_spacemap)
+// take a read-only snapshot, shown as /.snapshots/<name>, or delete one
+#define NUFS_IOC_SNAPSHOT        _IOW('N', 4, nufs_snapshot_arg)
+#define NUFS_IOC_SNAPSHOT_DELETE _IOW('N', 5, nufs_snapshot_arg)
+#define NUFS_IOC_CHANGES         _IOWR('N', 6, nufs_changes)
+#define NUFS_IOC_BULKSTAT        _IOWR('N', 7, nufs_bulkstat)
+#define NUFS_IOC_BULKCREATE      _IOWR('N', 8, nufs_bulkcreate)
+
+#endif
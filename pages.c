@@ -2,6 +2,7 @@
 
 #define _GNU_SOURCE
 #include <string.h>
+#include <stdlib.h>
 
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -16,40 +17,215 @@
 #include "pages.h"
 #include "util.h"
 #include "bitmap.h"
+#include "uring.h"
+#include "ag.h"
+#include "superblock.h"
+#include "snapshot.h"
+#include "changes.h"
+#include "fs.h"
 
-const int PAGE_COUNT = 256;
-const int NUFS_SIZE  = 4096 * 256; // 1MB
 
-static int   pages_fd   = -1;
-static void* pages_base =  0;
+// state of the calling thread's instance, see fs.h
+#define pages_base    (nufs_cur->pages.pages_base)
+#define member_fds    (nufs_cur->pages.member_fds)
+#define member_count  (nufs_cur->pages.member_count)
+#define stripe_pages  (nufs_cur->pages.stripe_pages)
+#define tier_pages    (nufs_cur->pages.tier_pages)
+#define page_shift    (nufs_cur->pages.page_shift)
+#define reserved_bm   (nufs_cur->pages.reserved_bm)
+#define dirty_bm      (nufs_cur->pages.dirty_bm)
+#define dirty_pages   (nufs_cur->pages.dirty_pages)
+#define pages_backend (nufs_cur->pages.pages_backend)
+#define ring          (&nufs_cur->pages.ring)
+#define prefetch_buf  (nufs_cur->pages.prefetch_buf)
 
+// prefetches land in prefetch_buf; only the page cache fill matters,
+// not the data
+#define PREFETCH_PAGES 32
+
+// set the stripe width; must be called before pages_init
 void
-pages_init(const char* path)
+pages_set_stripe(int pages)
+{
+    assert(pages > 0);
+    stripe_pages = pages;
+}
+
+// choose the page size a new image is formatted with: 4K, 16K or 64K;
+// must be called before pages_init. Returns -1 for any other size.
+int
+pages_set_page_size(int bytes)
+{
+    if (bytes != 4096 && bytes != 16384 && bytes != 65536) {
+        return -1;
+    }
+    page_shift = __builtin_ctz(bytes);
+    nufs_page_shift = page_shift;
+    return 0;
+}
+
+// put the first pages pages on the first member and the rest on the
+// second; must be called before pages_init
+void
+pages_set_tier(int pages)
 {
-    pages_fd = open(path, O_CREAT | O_RDWR, 0644);
-    assert(pages_fd != -1);
+    assert(pages >= 0 && pages < PAGE_COUNT);
+    tier_pages = pages;
+}
+
+// pages on the fast tier, 0 if the image is not tiered
+int
+pages_tier_size()
+{
+    return tier_pages;
+}
 
-    int rv = ftruncate(pages_fd, NUFS_SIZE);
+// where page pnum lives: which member file, and at what byte offset
+static void
+page_location(int pnum, int* fd, off_t* off)
+{
+    if (tier_pages > 0) {
+        int slow = (pnum >= tier_pages);
+        *fd = member_fds[slow];
+        *off = (off_t)(slow ? pnum - tier_pages : pnum) << page_shift;
+        return;
+    }
+    int unit = pnum / stripe_pages;
+    *fd = member_fds[unit % member_count];
+    *off = ((off_t)(unit / member_count) * stripe_pages + pnum % stripe_pages) << page_shift;
+}
+
+// pages from pnum to the end of the run that is contiguous in its
+// member file: the rest of a stripe unit, or of a tier
+static int
+run_left(int pnum)
+{
+    if (tier_pages > 0) {
+        return (pnum < tier_pages) ? tier_pages - pnum : PAGE_COUNT - pnum;
+    }
+    return min(stripe_pages - pnum % stripe_pages, PAGE_COUNT - pnum);
+}
+
+// an existing image keeps the page size it was formatted with; page 0
+// starts the first member, so its superblock can be read before the
+// layout, which depends on the page size, is worked out
+static void
+read_page_size()
+{
+    struct stat st;
+    int rv = fstat(member_fds[0], &st);
     assert(rv == 0);
+    if (st.st_size == 0) {
+        // a new image
+        return;
+    }
+    superblock sb;
+    ssize_t got = pread(member_fds[0], &sb, sizeof(sb), SUPERBLOCK_OFFSET);
+    // images without a superblock, or from before page_size, are all 4K
+    int bytes = 4096;
+    if (got == sizeof(sb) && sb.magic == NUFS_MAGIC && sb.page_size != 0) {
+        bytes = sb.page_size;
+    }
+    if (bytes != PAGE_BYTES) {
+        printf("+ pages_init: image has %d byte pages\n", bytes);
+    }
+    rv = pages_set_page_size(bytes);
+    assert(rv == 0);
+}
 
-    pages_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
-    assert(pages_base != MAP_FAILED);
+// path is one image file, or several comma-separated ones to stripe
+// the image across
+void
+pages_init(const char* path)
+{
+    char* paths = strdup(path);
+    char* save = 0;
+    member_count = 0;
+    for (char* pp = strtok_r(paths, ",", &save); pp; pp = strtok_r(0, ",", &save)) {
+        assert(member_count < MAX_MEMBERS);
+        member_fds[member_count] = open(pp, O_CREAT | O_RDWR, 0644);
+        assert(member_fds[member_count] != -1);
+        member_count++;
+    }
+    free(paths);
+    assert(member_count > 0);
+    assert(tier_pages == 0 || member_count == 2);
+    read_page_size();
+    assert(tier_pages < PAGE_COUNT);
+
+    for (int mm = 0; mm < member_count; ++mm) {
+        off_t size = 0;
+        for (int pn = 0; pn < PAGE_COUNT; ++pn) {
+            int fd;
+            off_t off;
+            page_location(pn, &fd, &off);
+            if (fd == member_fds[mm] && off + PAGE_BYTES > size) {
+                size = off + PAGE_BYTES;
+            }
+        }
+        int rv = ftruncate(member_fds[mm], size);
+        assert(rv == 0);
+    }
+
+    if (member_count == 1) {
+        pages_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, member_fds[0], 0);
+        assert(pages_base != MAP_FAILED);
+    }
+    else {
+        // reserve the address range, then map each stripe unit over it
+        // so pages_get_page stays plain pointer arithmetic
+        pages_base = mmap(0, NUFS_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(pages_base != MAP_FAILED);
+        for (int pn = 0; pn < PAGE_COUNT; pn += run_left(pn)) {
+            int fd;
+            off_t off;
+            page_location(pn, &fd, &off);
+            // one stripe unit, or all of a tier
+            size_t len = (size_t)run_left(pn) << page_shift;
+            void* unit = mmap(pages_get_page(pn), len, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_FIXED, fd, off);
+            assert(unit != MAP_FAILED);
+        }
+    }
+    if (tier_pages > 0) {
+        printf("+ pages_init: tiered, %d fast pages\n", tier_pages);
+    }
+    else {
+        printf("+ pages_init: %d member(s), stripe %d pages\n", member_count, stripe_pages);
+    }
+    if (PAGE_BYTES != 4096) {
+        printf("+ pages_init: %d byte pages\n", PAGE_BYTES);
+    }
 
     void* pbm = get_pages_bitmap();
     bitmap_put(pbm, 0, 1);
 }
 
+void
+pages_layout(int* members, int* stripe)
+{
+    *members = member_count;
+    *stripe = stripe_pages;
+}
+
 void
 pages_free()
 {
+    pages_set_backend(PAGES_MMAP, 0);
     int rv = munmap(pages_base, NUFS_SIZE);
     assert(rv == 0);
+    for (int mm = 0; mm < member_count; ++mm) {
+        close(member_fds[mm]);
+    }
+    member_count = 0;
+    free(prefetch_buf);
+    prefetch_buf = 0;
 }
 
 void*
 pages_get_page(int pnum)
 {
-    return pages_base + 4096 * pnum;
+    return pages_base + ((size_t)pnum << nufs_page_shift);
 }
 
 void*
@@ -65,15 +241,70 @@ get_inode_bitmap()
     return (void*)(page + 32);
 }
 
+static int
+page_available(void* pbm, int pnum)
+{
+    return !bitmap_get(pbm, pnum) && !bitmap_get(reserved_bm, pnum);
+}
+
+// mark a page in use, handing it out zeroed
+static void
+take_page(void* pbm, int pnum)
+{
+    bitmap_put(pbm, pnum, 1);
+    bitmap_put(reserved_bm, pnum, 0);
+    ag_page_used(pnum, 1);
+    memset(pages_get_page(pnum), 0, PAGE_BYTES);
+    pages_mark_dirty(pnum, 1);
+}
+
 int
 alloc_page()
+{
+    return alloc_page_near(1);
+}
+
+// how many pages a scan at pnum can skip because its group is full;
+// 0 when the group has free pages
+static int
+full_group_skip(int pnum)
+{
+    ag* g = ag_get(ag_of_page(pnum));
+    if (g->free_pages > 0) {
+        return 0;
+    }
+    return g->first_page + g->pages - pnum;
+}
+
+// allocate the first free page at or after goal, wrapping around;
+// reserved pages are only taken when nothing else is left. Without a
+// goal, allocation starts in the calling CPU's group.
+int
+alloc_page_near(int goal)
 {
     void* pbm = get_pages_bitmap();
+    if (goal < 1 || goal >= PAGE_COUNT) {
+        goal = ag_goal(ag_local());
+    }
+
+    for (int nn = 0; nn < PAGE_COUNT - 1; ++nn) {
+        int ii = 1 + (goal - 1 + nn) % (PAGE_COUNT - 1);
+        int skip = full_group_skip(ii);
+        if (skip > 0) {
+            nn += skip - 1;
+            continue;
+        }
+        if (page_available(pbm, ii)) {
+            take_page(pbm, ii);
+            printf("+ alloc_page_near(%d) -> %d\n", goal, ii);
+            return ii;
+        }
+    }
 
     for (int ii = 1; ii < PAGE_COUNT; ++ii) {
         if (!bitmap_get(pbm, ii)) {
-            bitmap_put(pbm, ii, 1);
-            printf("+ alloc_page() -> %d\n", ii);
+            take_page(pbm, ii);
+            printf("+ alloc_page_near(%d) -> %d (stolen)\n", goal, ii);
             return ii;
         }
     }
@@ -81,11 +312,306 @@ alloc_page()
     return -1;
 }
 
+// reserve a run of up to want free pages, starting at the first available
+// page at or after goal; returns the first page and sets *got to the
+// run length (0 if nothing could be reserved)
+int
+reserve_pages(int goal, int want, int* got)
+{
+    void* pbm = get_pages_bitmap();
+    if (goal < 1 || goal >= PAGE_COUNT) {
+        goal = ag_goal(ag_local());
+    }
+    *got = 0;
+
+    for (int nn = 0; nn < PAGE_COUNT - 1; ++nn) {
+        int start = 1 + (goal - 1 + nn) % (PAGE_COUNT - 1);
+        int skip = full_group_skip(start);
+        if (skip > 0) {
+            nn += skip - 1;
+            continue;
+        }
+        if (!page_available(pbm, start)) {
+            continue;
+        }
+        int len = 0;
+        while (len < want && start + len < PAGE_COUNT
+               && page_available(pbm, start + len)) {
+            bitmap_put(reserved_bm, start + len, 1);
+            len++;
+        }
+        *got = len;
+        return start;
+    }
+    return 0;
+}
+
+// free and not reserved by anyone
+int
+pages_available(int pnum)
+{
+    return page_available(get_pages_bitmap(), pnum);
+}
+
+// take a page out of a reservation; fails if it was stolen meanwhile
+int
+claim_page(int pnum)
+{
+    void* pbm = get_pages_bitmap();
+    if (bitmap_get(pbm, pnum)) {
+        return -1;
+    }
+    take_page(pbm, pnum);
+    return 0;
+}
+
+void
+unreserve_pages(int start, int count)
+{
+    for (int ii = start; ii < start + count; ++ii) {
+        bitmap_put(reserved_bm, ii, 0);
+    }
+}
+
 void
 free_page(int pnum)
 {
+    assert(pnum > 0);
     printf("+ free_page(%d)\n", pnum);
+    if (snap_shared(pnum)) {
+        // a snapshot still uses it; it is freed with the last of those
+        return;
+    }
     void* pbm = get_pages_bitmap();
     bitmap_put(pbm, pnum, 0);
+    ag_page_used(pnum, 0);
+}
+
+// switch the data path to the given backend; depth is the io_uring queue
+// depth. Falls back to mmap and returns -errno if io_uring is unavailable.
+int
+pages_set_backend(int backend, int depth)
+{
+    if (pages_backend == PAGES_URING) {
+        uring_exit(ring);
+    }
+    pages_backend = PAGES_MMAP;
+    if (backend != PAGES_URING) {
+        return 0;
+    }
+
+    if (prefetch_buf == 0) {
+        prefetch_buf = aligned_alloc(4096, (size_t)PAGE_BYTES * PREFETCH_PAGES);
+    }
+    int rv = uring_init(ring, depth, prefetch_buf, (size_t)PAGE_BYTES * PREFETCH_PAGES);
+    if (rv < 0) {
+        printf("+ pages_set_backend: io_uring unavailable (%s), using mmap\n", strerror(-rv));
+        return rv;
+    }
+    pages_backend = PAGES_URING;
+    return 0;
+}
+
+// move data between buffers and runs of pages. With io_uring all the
+// segments are issued as one batch and waited for together.
+int
+pages_rw(page_seg* segs, int count, int write)
+{
+    if (pages_backend == PAGES_MMAP) {
+        for (int ii = 0; ii < count; ++ii) {
+            char* data = (char*)pages_get_page(segs[ii].pnum) + segs[ii].off;
+            if (write) {
+                memcpy(data, segs[ii].buf, segs[ii].len);
+                pages_mark_dirty(segs[ii].pnum, PAGE_OF(segs[ii].off + segs[ii].len - 1) + 1);
+            }
+            else {
+                memcpy(segs[ii].buf, data, segs[ii].len);
+            }
+        }
+        return 0;
+    }
+
+    // split where runs end in the member files; the pieces for different
+    // members are all in flight at once
+    uring_batch batch = { 0, 0 };
+    for (int ii = 0; ii < count; ++ii) {
+        int pn = segs[ii].pnum;
+        int off = segs[ii].off;
+        int done = 0;
+        while (done < segs[ii].len) {
+            pn += PAGE_OF(off);
+            off = PAGE_OFF(off);
+            int unit_left = (run_left(pn) << page_shift) - off;
+            int len = min(unit_left, segs[ii].len - done);
+            int fd;
+            off_t pos;
+            page_location(pn, &fd, &pos);
+            uring_queue(ring, fd, write, segs[ii].buf + done, len, pos + off, &batch);
+            if (write) {
+                // in the page cache now, and as dirty as a store would be
+                pages_mark_dirty(pn, PAGE_OF(off + len - 1) + 1);
+            }
+            done += len;
+            off += len;
+        }
+    }
+    return uring_wait(ring, &batch);
+}
+
+// relocate the contents of page from to the free page to
+void
+pages_move(int from, int to)
+{
+    int rv = claim_page(to);
+    assert(rv == 0);
+    memcpy(pages_get_page(to), pages_get_page(from), PAGE_BYTES);
+    free_page(from);
+}
+
+// find the lowest run of len available pages that starts before below;
+// returns its first page, or 0 if there is none
+int
+pages_find_free_run(int len, int below)
+{
+    void* pbm = get_pages_bitmap();
+    int start = 1;
+    int run = 0;
+
+    for (int ii = 1; ii < PAGE_COUNT && start < below; ++ii) {
+        if (!page_available(pbm, ii)) {
+            start = ii + 1;
+            run = 0;
+            continue;
+        }
+        if (++run == len) {
+            return start;
+        }
+    }
+    return 0;
+}
+
+// count free pages, the number of free runs and the longest one
+void
+pages_free_stats(int* free_pages, int* runs, int* largest)
+{
+    void* pbm = get_pages_bitmap();
+    int run = 0;
+    *free_pages = 0;
+    *runs = 0;
+    *largest = 0;
+
+    for (int ii = 1; ii <= PAGE_COUNT; ++ii) {
+        if (ii < PAGE_COUNT && !bitmap_get(pbm, ii)) {
+            ++*free_pages;
+            ++run;
+            continue;
+        }
+        if (run > 0) {
+            ++*runs;
+            *largest = max(*largest, run);
+        }
+        run = 0;
+    }
+}
+
+// pass an access-pattern hint (MADV_*) for a run of pages to the kernel;
+// with io_uring, WILLNEED becomes asynchronous reads that fill the page
+// cache without waiting for them
+void
+pages_advise(int pnum, int count, int advice)
+{
+    if (pages_backend == PAGES_URING && advice == MADV_WILLNEED) {
+        for (int ii = 0; ii < count; ) {
+            int pn = pnum + ii;
+            int len = min(PREFETCH_PAGES, count - ii);
+            len = min(len, run_left(pn));
+            int fd;
+            off_t pos;
+            page_location(pn, &fd, &pos);
+            uring_queue(ring, fd, 0, prefetch_buf, len << page_shift, pos, 0);
+            ii += len;
+        }
+        uring_submit(ring);
+        return;
+    }
+
+    int rv = madvise(pages_get_page(pnum), (size_t)count << page_shift, advice);
+    if (rv != 0) {
+        printf("+ pages_advise(%d, %d, %d) failed: %s\n",
+               pnum, count, advice, strerror(errno));
+    }
+}
+
+// note that pages were changed, for writeback and incremental backups
+// to pick up
+void
+pages_mark_dirty(int pnum, int count)
+{
+    changes_mark(pnum, count);
+    for (int pn = pnum; pn < pnum + count; ++pn) {
+        if (!bitmap_get(dirty_bm, pn)) {
+            bitmap_put(dirty_bm, pn, 1);
+            dirty_pages++;
+        }
+    }
 }
 
+int
+pages_dirty_count()
+{
+    return dirty_pages;
+}
+
+// hand the dirty pages over to writeback as runs that are each
+// contiguous in one member file, and mark them clean; runs needs room
+// for PAGE_COUNT runs. Returns the number of runs.
+int
+pages_take_dirty(page_run* runs)
+{
+    int count = 0;
+    for (int pn = 0; pn < PAGE_COUNT; ) {
+        if (!bitmap_get(dirty_bm, pn)) {
+            pn++;
+            continue;
+        }
+        int len = 0;
+        int room = run_left(pn);
+        while (len < room && bitmap_get(dirty_bm, pn + len)) {
+            bitmap_put(dirty_bm, pn + len, 0);
+            len++;
+        }
+        runs[count].pnum = pn;
+        runs[count].count = len;
+        count++;
+        pn += len;
+    }
+    dirty_pages = 0;
+    return count;
+}
+
+// write runs of pages back to the image: start the writes and return,
+// or with wait, return once they are on disk. Doesn't need the storage
+// lock. Returns 0 or the first -errno.
+int
+pages_write_runs(page_run* runs, int count, int wait)
+{
+    int err = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        size_t len = (size_t)runs[ii].count << page_shift;
+        int rv;
+        if (wait) {
+            // stores through the mapping and writes to the file alike
+            rv = msync(pages_get_page(runs[ii].pnum), len, MS_SYNC);
+        }
+        else {
+            int fd;
+            off_t off;
+            page_location(runs[ii].pnum, &fd, &off);
+            rv = sync_file_range(fd, off, len, SYNC_FILE_RANGE_WRITE);
+        }
+        if (rv < 0 && err == 0) {
+            err = -errno;
+        }
+    }
+    return err;
+}
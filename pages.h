@@ -4,13 +4,97 @@
 #define PAGES_H
 
 #include <stdio.h>
+#include <stdint.h>
 
+#include "uring.h"
+
+// the image is 1 MB whatever its page size
+#define NUFS_SIZE (1 << 20)
+// pages in an image of the smallest page size, for sizing tables
+#define MAX_PAGE_COUNT 256
+
+// The page size of the calling thread's instance, as a shift. It is set
+// by storage_bind along with nufs_cur (see fs.h), so page arithmetic on
+// the hot paths stays shifts and masks.
+extern __thread int nufs_page_shift;
+
+#define PAGE_BYTES     (1 << nufs_page_shift)
+#define PAGE_COUNT     (NUFS_SIZE >> nufs_page_shift)
+#define PAGE_OF(off)   ((off) >> nufs_page_shift)
+#define PAGE_OFF(off)  ((off) & (PAGE_BYTES - 1))
+
+// the page space is striped over up to MAX_MEMBERS backing files
+#define MAX_MEMBERS 8
+
+// an open image's mapping and backing files. The page space is striped
+// over the members in units of stripe_pages pages; a single file is
+// laid out linearly. A tiered image has two members instead: the first
+// tier_pages pages on the fast one, the rest on the slow one.
+typedef struct pages_state {
+    void* pages_base;
+    int   member_fds[MAX_MEMBERS];
+    int   member_count;
+    int   stripe_pages;
+    int   tier_pages; // 0 unless tiered
+    int   page_shift;
+    // pages set aside for some inode's allocation window (memory only);
+    // other allocations skip them until they run out of unreserved pages
+    uint8_t reserved_bm[MAX_PAGE_COUNT / 8];
+    // pages changed since they were last handed to writeback
+    uint8_t dirty_bm[MAX_PAGE_COUNT / 8];
+    int   dirty_pages;
+    int   pages_backend;
+    uring ring;
+    char* prefetch_buf; // registered with the ring, for prefetches
+} pages_state;
+
+// how page data moves: loads/stores on the mapping, or io_uring requests
+// against the image file (metadata is always accessed through the mapping)
+enum {
+    PAGES_MMAP,
+    PAGES_URING,
+};
+
+// one piece of I/O within a run of contiguous pages
+typedef struct page_seg {
+    int   pnum; // first page of the run
+    int   off;  // byte offset into that page
+    int   len;
+    char* buf;
+} page_seg;
+
+// a run of consecutive pages
+typedef struct page_run {
+    int pnum;
+    int count;
+} page_run;
+
+void pages_set_stripe(int pages);
+int pages_set_page_size(int bytes);
+void pages_set_tier(int pages);
+int pages_tier_size();
 void pages_init(const char* path);
+void pages_layout(int* members, int* stripe);
 void pages_free();
+int pages_set_backend(int backend, int depth);
+int pages_rw(page_seg* segs, int count, int write);
 void* pages_get_page(int pnum);
 void* get_pages_bitmap();
 void* get_inode_bitmap();
 int alloc_page();
+int alloc_page_near(int goal);
+int reserve_pages(int goal, int want, int* got);
+int claim_page(int pnum);
+int pages_available(int pnum);
+void unreserve_pages(int start, int count);
 void free_page(int pnum);
+void pages_move(int from, int to);
+int pages_find_free_run(int len, int below);
+void pages_free_stats(int* free_pages, int* runs, int* largest);
+void pages_advise(int pnum, int count, int advice);
+void pages_mark_dirty(int pnum, int count);
+int pages_dirty_count();
+int pages_take_dirty(page_run* runs);
+int pages_write_runs(page_run* runs, int count, int wait);
 
 #endif
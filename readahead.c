@@ -0,0 +1,82 @@
+#include <string.h>
+#include <sys/mman.h>
+
+#include "readahead.h"
+#include "inode.h"
+#include "pages.h"
+#include "util.h"
+
+#define RA_MIN_PAGES   4
+#define RA_MAX_PAGES   32
+// how many pages a long scan keeps mapped behind the reader
+#define RA_DROP_BEHIND 64
+
+void
+ra_init(ra_state* ra)
+{
+    memset(ra, 0, sizeof(ra_state));
+}
+
+// advise the file pages [fpn, fpn + count), coalescing them into runs of
+// physically contiguous pages so each run is a single madvise
+static void
+advise_file_range(inode* node, int fpn, int count, int advice)
+{
+    int run_start = 0;
+    int run_len = 0;
+
+    for (int ii = fpn; ii < fpn + count; ++ii) {
+        int pn = inode_get_pnum(node, ii);
+        if (run_len > 0 && pn == run_start + run_len) {
+            run_len++;
+            continue;
+        }
+        if (run_len > 0) {
+            pages_advise(run_start, run_len, advice);
+        }
+        // holes are never prefetched
+        run_start = pn;
+        run_len = (pn > 0) ? 1 : 0;
+    }
+    if (run_len > 0) {
+        pages_advise(run_start, run_len, advice);
+    }
+}
+
+void
+ra_observe(ra_state* ra, inode* node, off_t offset, size_t size)
+{
+    int npages = bytes_to_pages(node->size);
+    int cur = PAGE_OF(offset + size);
+
+    if (offset != ra->next) {
+        // random access, start over
+        ra->next = offset + size;
+        ra->window = 0;
+        ra->ra_fpn = cur;
+        ra->drop_fpn = PAGE_OF(offset);
+        return;
+    }
+    ra->next = offset + size;
+
+    ra->window = ra->window ? min(ra->window * 2, RA_MAX_PAGES) : RA_MIN_PAGES;
+    if (ra->ra_fpn < cur) {
+        ra->ra_fpn = cur;
+    }
+
+    // issue the next window once the reader is halfway into the last one
+    if (ra->ra_fpn - cur <= ra->window / 2) {
+        int end = min(cur + ra->window, npages);
+        if (end > ra->ra_fpn) {
+            advise_file_range(node, ra->ra_fpn, end - ra->ra_fpn, MADV_WILLNEED);
+            ra->ra_fpn = end;
+        }
+    }
+
+    // a long scan won't come back, so drop what it has left behind
+    if (cur - ra->drop_fpn >= 2 * RA_DROP_BEHIND) {
+        int end = cur - RA_DROP_BEHIND;
+        advise_file_range(node, ra->drop_fpn, end - ra->drop_fpn, MADV_DONTNEED);
+        ra->drop_fpn = end;
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <sys/types.h>
+
+#include "inode.h"
+
+// sequential-stream detection state, one per open file
+typedef struct ra_state {
+    off_t next;     // offset the next read starts at if the stream is sequential
+    int   window;   // current readahead window in pages, 0 when not streaming
+    int   ra_fpn;   // first file page not yet prefetched
+    int   drop_fpn; // first file page not yet released behind a long scan
+} ra_state;
+
+void ra_init(ra_state* ra);
+void ra_observe(ra_state* ra, inode* node, off_t offset, size_t size);
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include "reclaim.h"
+#include "storage.h"
+#include "superblock.h"
+#include "inode.h"
+#include "pages.h"
+#include "snapshot.h"
+#include "util.h"
+#include "fs.h"
+
+// data pages freed per trip through the storage lock
+#define RECLAIM_BATCH 64
+
+#define reclaim_thread (nufs_cur->reclaim.reclaim_thread)
+#define kick_mutex     (nufs_cur->reclaim.kick_mutex)
+#define kick_cond      (nufs_cur->reclaim.kick_cond)
+#define kicked         (nufs_cur->reclaim.kicked)
+#define stopping       (nufs_cur->reclaim.stopping)
+#define running        (nufs_cur->reclaim.running)
+
+static void
+kick()
+{
+    pthread_mutex_lock(&kick_mutex);
+    kicked = 1;
+    pthread_cond_signal(&kick_cond);
+    pthread_mutex_unlock(&kick_mutex);
+}
+
+// free up to RECLAIM_BATCH pages of an orphan, from the end of the file
+// so that the inode stays consistent if we crash halfway; returns 1 once
+// the inode itself is gone
+static int
+reclaim_step(int inum)
+{
+    inode* in = get_inode(inum);
+    int pages = bytes_to_pages(in->size);
+    if (pages > 0) {
+        // an indirect page a snapshot holds would need copying to have
+        // entries cleared from it, so such a file goes in one step
+        int keep = snap_shared(in->iptr) ? min(pages, 2) : max(0, pages - RECLAIM_BATCH);
+        shrink_inode(in, keep * PAGE_BYTES);
+        return 0;
+    }
+
+    // directories keep their entry page at size 0
+    if (in->ptrs[0] != 0) {
+        free_page(in->ptrs[0]);
+        in->ptrs[0] = 0;
+    }
+    free_inode(inum);
+    return 1;
+}
+
+static void
+orphan_remove_first()
+{
+    superblock* sb = get_superblock();
+    for (int ii = 1; ii < sb->orphan_count; ++ii) {
+        sb->orphans[ii - 1] = sb->orphans[ii];
+    }
+    sb->orphan_count--;
+}
+
+// work through the orphan list, releasing the lock between batches
+static void
+reclaim_drain()
+{
+    for (;;) {
+        storage_lock(nufs_cur);
+        superblock* sb = get_superblock();
+        if (sb->orphan_count == 0 || stopping) {
+            storage_unlock(nufs_cur);
+            return;
+        }
+        int inum = sb->orphans[0];
+        if (reclaim_step(inum)) {
+            orphan_remove_first();
+            printf("+ reclaimed inode %d\n", inum);
+        }
+        storage_unlock(nufs_cur);
+    }
+}
+
+static void*
+reclaim_main(void* arg)
+{
+    storage_bind(arg);
+    for (;;) {
+        pthread_mutex_lock(&kick_mutex);
+        while (!kicked && !stopping) {
+            pthread_cond_wait(&kick_cond, &kick_mutex);
+        }
+        kicked = 0;
+        int stop = stopping;
+        pthread_mutex_unlock(&kick_mutex);
+
+        if (stop) {
+            return 0;
+        }
+        reclaim_drain();
+    }
+}
+
+// start the reclaimer; anything left on the orphan list by the last
+// mount (or a crash) is processed right away
+void
+reclaim_start()
+{
+    pthread_mutex_init(&kick_mutex, 0);
+    pthread_cond_init(&kick_cond, 0);
+    stopping = 0;
+    kicked = 1;
+    int rv = pthread_create(&reclaim_thread, 0, reclaim_main, nufs_cur);
+    running = (rv == 0);
+}
+
+// called with the storage lock held, which is dropped while waiting;
+// unfinished orphans stay on disk for the next mount
+void
+reclaim_stop()
+{
+    if (!running) {
+        return;
+    }
+    pthread_mutex_lock(&kick_mutex);
+    stopping = 1;
+    pthread_cond_signal(&kick_cond);
+    pthread_mutex_unlock(&kick_mutex);
+
+    storage_unlock(nufs_cur);
+    pthread_join(reclaim_thread, 0);
+    storage_lock(nufs_cur);
+    running = 0;
+    pthread_mutex_destroy(&kick_mutex);
+    pthread_cond_destroy(&kick_cond);
+}
+
+// hand an inode whose last link is gone to the reclaimer; called with the
+// storage lock held. If the orphan list is full, or no reclaimer is
+// running, the inode is freed right here instead.
+void
+reclaim_orphan(int inum)
+{
+    superblock* sb = get_superblock();
+    if (sb->orphan_count == ORPHAN_SLOTS || !running) {
+        while (!reclaim_step(inum)) {
+        }
+        return;
+    }
+    sb->orphans[sb->orphan_count++] = inum;
+    kick();
+}
@@ -0,0 +1,19 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <pthread.h>
+
+typedef struct reclaim_state {
+    pthread_t       reclaim_thread;
+    pthread_mutex_t kick_mutex;
+    pthread_cond_t  kick_cond;
+    int kicked;
+    int stopping;
+    int running;
+} reclaim_state;
+
+void reclaim_start();
+void reclaim_stop();
+void reclaim_orphan(int inum);
+
+#endif
@@ -0,0 +1,347 @@
+// Snapshots; see snapshot.h. Everything here runs with the storage lock
+// held.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "superblock.h"
+#include "bitmap.h"
+#include "frag.h"
+#include "csum.h"
+#include "slist.h"
+#include "directory.h"
+#include "util.h"
+
+_Static_assert(sizeof(snap_list) <= 4096, "the snapshot list must fit the smallest page");
+
+static snap_list*
+list()
+{
+    return pages_get_page(get_superblock()->snap_page);
+}
+
+int
+snap_count()
+{
+    return get_superblock()->snap_page ? list()->count : 0;
+}
+
+const char*
+snap_name(int idx)
+{
+    return list()->snaps[idx].name;
+}
+
+// whether a snapshot holds pnum, so it must not change in place
+int
+snap_shared(int pnum)
+{
+    return get_superblock()->snap_page != 0 && list()->refs[pnum] > 0;
+}
+
+static int
+find(const char* name)
+{
+    for (int ii = 0; ii < snap_count(); ++ii) {
+        if (strncmp(list()->snaps[ii].name, name, NUFS_SNAP_NAME) == 0) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+// a frozen inode table has page 0's layout: the inode bitmap and the
+// inodes sit at the same offsets
+static uint8_t*
+table_inode_bm(char* table)
+{
+    return (uint8_t*)table + ((char*)get_inode_bitmap() - (char*)pages_get_page(0));
+}
+
+static inode*
+table_inode(char* table, int inum)
+{
+    char* inodes = table + ((char*)get_inode(0) - (char*)pages_get_page(0));
+    return (inode*)inodes + inum;
+}
+
+// call fn on every page the inodes of a table use: directory and data
+// pages, fragment pages and indirect pages; a page may come up more than
+// once
+static void
+walk_table(char* table, void (*fn)(int pnum, void* arg), void* arg)
+{
+    uint8_t* ibm = table_inode_bm(table);
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        if (!bitmap_get(ibm, ii)) {
+            continue;
+        }
+        inode* node = table_inode(table, ii);
+        for (int jj = 0; jj < 2; ++jj) {
+            if (node->ptrs[jj] != 0) {
+                fn(PTR_PNUM(node->ptrs[jj]), arg);
+            }
+        }
+        if (node->iptr == 0) {
+            continue;
+        }
+        fn(node->iptr, arg);
+        int* plist = pages_get_page(node->iptr);
+        for (int fpn = 2; fpn < bytes_to_pages(node->size); ++fpn) {
+            if (plist[fpn - 2] != 0) {
+                fn(PTR_PNUM(plist[fpn - 2]), arg);
+            }
+        }
+    }
+}
+
+static void
+add_page(int pnum, void* set)
+{
+    bitmap_put(set, pnum, 1);
+}
+
+// give the live side its own copy of a page a snapshot holds; returns
+// the copy, or -1 when the image is full
+int
+snap_cow(int pnum)
+{
+    int pn = alloc_page_near(pnum + 1);
+    if (pn < 0) {
+        return -1;
+    }
+    memcpy(pages_get_page(pn), pages_get_page(pnum), PAGE_BYTES);
+    csum_update(pn);
+    // only drops the live claim, the snapshot keeps the original
+    free_page(pnum);
+    printf("+ snap_cow(%d) -> %d\n", pnum, pn);
+    return pn;
+}
+
+// copy *pnum first if a snapshot holds it; returns -1 when the image is
+// full, with *pnum unchanged
+int
+snap_unshare(int* pnum)
+{
+    if (*pnum == 0 || !snap_shared(*pnum)) {
+        return 0;
+    }
+    int pn = snap_cow(*pnum);
+    if (pn < 0) {
+        return -1;
+    }
+    *pnum = pn;
+    return 0;
+}
+
+// freeze the live inode table; the pages stay where they are and only
+// gain a reference. Write buffers must have been stored first.
+int
+snapshot_create(const char* name)
+{
+    // straight from an ioctl, so not necessarily terminated
+    int len = strnlen(name, NUFS_SNAP_NAME);
+    if (len == 0 || len >= NUFS_SNAP_NAME || strchr(name, '/') != NULL
+        || streq(name, ".") || streq(name, "..")) {
+        return -EINVAL;
+    }
+    if (find(name) >= 0) {
+        return -EEXIST;
+    }
+    if (snap_count() == SNAP_MAX) {
+        return -ENOSPC;
+    }
+
+    superblock* sb = get_superblock();
+    if (sb->snap_page == 0) {
+        int pn = alloc_page();
+        if (pn < 0) {
+            return -ENOSPC;
+        }
+        sb->snap_page = pn;
+        sb->features |= FEAT_SNAPSHOTS;
+    }
+    int table = alloc_page();
+    if (table < 0) {
+        if (list()->count == 0) {
+            free_page(sb->snap_page);
+            sb->snap_page = 0;
+        }
+        return -ENOSPC;
+    }
+    memcpy(pages_get_page(table), pages_get_page(0), SUPERBLOCK_OFFSET);
+    csum_update(table);
+
+    snap_list* sl = list();
+    uint8_t used[MAX_PAGE_COUNT / 8];
+    memset(used, 0, sizeof(used));
+    walk_table(pages_get_page(table), add_page, used);
+    int held = 0;
+    for (int pn = 1; pn < PAGE_COUNT; ++pn) {
+        if (bitmap_get(used, pn)) {
+            sl->refs[pn]++;
+            held++;
+        }
+    }
+
+    snap_entry* se = &sl->snaps[sl->count++];
+    memset(se, 0, sizeof(snap_entry));
+    memcpy(se->name, name, len);
+    se->table = table;
+    se->ctime = time(0);
+    pages_mark_dirty(sb->snap_page, 1);
+    printf("+ snapshot_create(%s) -> table %d, %d pages\n", name, table, held);
+    return 0;
+}
+
+// drop a snapshot; pages that only it held go back to the free pool
+int
+snapshot_delete(const char* name)
+{
+    int idx = find(name);
+    if (idx < 0) {
+        return -ENOENT;
+    }
+    superblock* sb = get_superblock();
+    snap_list* sl = list();
+    int table = sl->snaps[idx].table;
+
+    uint8_t held[MAX_PAGE_COUNT / 8];
+    uint8_t live[MAX_PAGE_COUNT / 8];
+    memset(held, 0, sizeof(held));
+    memset(live, 0, sizeof(live));
+    walk_table(pages_get_page(table), add_page, held);
+    walk_table(pages_get_page(0), add_page, live);
+
+    int freed = 0;
+    for (int pn = 1; pn < PAGE_COUNT; ++pn) {
+        if (!bitmap_get(held, pn)) {
+            continue;
+        }
+        sl->refs[pn]--;
+        if (sl->refs[pn] == 0 && !bitmap_get(live, pn)) {
+            free_page(pn);
+            freed++;
+        }
+    }
+    free_page(table);
+
+    for (int ii = idx + 1; ii < sl->count; ++ii) {
+        sl->snaps[ii - 1] = sl->snaps[ii];
+    }
+    sl->count--;
+    pages_mark_dirty(sb->snap_page, 1);
+    if (sl->count == 0) {
+        free_page(sb->snap_page);
+        sb->snap_page = 0;
+        sb->features &= ~FEAT_SNAPSHOTS;
+    }
+    printf("+ snapshot_delete(%s) -> %d pages freed\n", name, freed);
+    return 0;
+}
+
+// whether path is /.snapshots or below it; the name is reserved whether
+// or not there are snapshots
+int
+snap_path(const char* path)
+{
+    int len = strlen(SNAP_DIR);
+    return strncmp(path, SNAP_DIR, len) == 0 && (path[len] == 0 || path[len] == '/');
+}
+
+int
+snap_is_dir(const char* path)
+{
+    return streq(path, SNAP_DIR);
+}
+
+// inode inum of snapshot idx
+inode*
+snap_inode(int idx, int inum)
+{
+    return table_inode(pages_get_page(list()->snaps[idx].table), inum);
+}
+
+// resolve /.snapshots/<name> or a path below it in that snapshot's inode
+// table; returns the inode number, with *node and the snapshot's index
+// set, or -errno
+int
+snap_lookup(const char* path, inode** node, int* idx)
+{
+    if (snap_is_dir(path)) {
+        return -EISDIR;
+    }
+    const char* name = path + strlen(SNAP_DIR) + 1;
+    const char* rest = strchr(name, '/');
+    int len = rest ? rest - name : (int)strlen(name);
+    char buf[NUFS_SNAP_NAME];
+    if (len >= NUFS_SNAP_NAME) {
+        return -ENOENT;
+    }
+    memcpy(buf, name, len);
+    buf[len] = 0;
+    int ii = find(buf);
+    if (ii < 0) {
+        return -ENOENT;
+    }
+
+    char* table = pages_get_page(list()->snaps[ii].table);
+    int dn = 0;
+    if (rest != NULL) {
+        slist* parts = s_split(rest, '/');
+        for (slist* pp = parts; pp != NULL; pp = pp->next) {
+            if (pp->data[0] == 0) {
+                continue;
+            }
+            inode* dir = table_inode(table, dn);
+            if (!S_ISDIR(dir->mode)) {
+                dn = -ENOTDIR;
+                break;
+            }
+            dn = directory_lookup(dir, pp->data);
+            if (dn < 0) {
+                break;
+            }
+        }
+        s_free(parts);
+        if (dn < 0) {
+            return dn;
+        }
+    }
+    *node = table_inode(table, dn);
+    *idx = ii;
+    return dn;
+}
+
+// call fn on the metadata pages only snapshots may still use: the list,
+// the frozen tables, and their directory and indirect pages
+void
+snap_for_each_meta(void (*fn)(int pnum, void* arg), void* arg)
+{
+    if (snap_count() == 0) {
+        return;
+    }
+    fn(get_superblock()->snap_page, arg);
+    for (int ss = 0; ss < snap_count(); ++ss) {
+        char* table = pages_get_page(list()->snaps[ss].table);
+        fn(list()->snaps[ss].table, arg);
+        uint8_t* ibm = table_inode_bm(table);
+        for (int ii = 0; ii < INODE_COUNT; ++ii) {
+            if (!bitmap_get(ibm, ii)) {
+                continue;
+            }
+            inode* node = table_inode(table, ii);
+            if (S_ISDIR(node->mode) && node->ptrs[0] != 0) {
+                fn(node->ptrs[0], arg);
+            }
+            if (node->iptr != 0) {
+                fn(node->iptr, arg);
+            }
+        }
+    }
+}
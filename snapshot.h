@@ -0,0 +1,53 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "pages.h"
+#include "inode.h"
+#include "nufs_ioctl.h"
+
+// Read-only point-in-time snapshots, shown under /.snapshots/<name>.
+//
+// Taking one copies the inode table (the start of page 0, bitmaps
+// included) into a page of its own and counts a reference on every page
+// the live files use; nothing else is copied. From then on a page with
+// references is never changed or freed in place: the live file gets a
+// copy the first time it is written (snap_cow), and freeing it only
+// drops the live side's claim. The page goes back to the free pool when
+// the last snapshot holding it is deleted.
+//
+// The snapshot list and the per-page reference counts share one page,
+// recorded in the superblock and allocated with the first snapshot.
+
+#define SNAP_MAX 8
+#define SNAP_DIR "/.snapshots"
+
+typedef struct snap_entry {
+    char    name[NUFS_SNAP_NAME];
+    int     table; // page holding the frozen inode table
+    int     _pad;
+    int64_t ctime;
+} snap_entry;
+
+typedef struct snap_list {
+    int        count;
+    int        _pad;
+    snap_entry snaps[SNAP_MAX];
+    uint8_t    refs[MAX_PAGE_COUNT]; // snapshots holding each page
+} snap_list;
+
+int   snap_count();
+const char* snap_name(int idx);
+int   snap_shared(int pnum);
+int   snap_cow(int pnum);
+int   snap_unshare(int* pnum);
+int   snapshot_create(const char* name);
+int   snapshot_delete(const char* name);
+int   snap_path(const char* path);
+int   snap_is_dir(const char* path);
+int   snap_lookup(const char* path, inode** node, int* idx);
+inode* snap_inode(int idx, int inum);
+void  snap_for_each_meta(void (*fn)(int pnum, void* arg), void* arg);
+
+#endif
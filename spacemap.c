@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "spacemap.h"
+#include "pages.h"
+#include "inode.h"
+#include "bitmap.h"
+#include "ag.h"
+#include "fs.h"
+#include "util.h"
+
+_Static_assert(INODE_COUNT <= NUFS_SPACEMAP_FILES, "spacemap can't list every inode");
+_Static_assert(AG_MAX <= NUFS_SPACEMAP_REGIONS, "spacemap can't list every group");
+
+// state of the calling thread's instance, see fs.h
+#define valid  (nufs_cur->spacemap.valid)
+#define gen    (nufs_cur->spacemap.gen)
+#define report (nufs_cur->spacemap.report)
+
+static int
+bucket_of(int run)
+{
+    int bb = 31 - __builtin_clz(run);
+    return min(bb, NUFS_SPACEMAP_BUCKETS - 1);
+}
+
+static void
+scan_free(nufs_spacemap* sm)
+{
+    void* pbm = get_pages_bitmap();
+    int run = 0;
+    for (int ii = 1; ii <= PAGE_COUNT; ++ii) {
+        if (ii < PAGE_COUNT && !bitmap_get(pbm, ii)) {
+            ++run;
+            continue;
+        }
+        if (run > 0) {
+            sm->free_runs++;
+            sm->largest_free = max(sm->largest_free, run);
+            sm->run_hist[bucket_of(run)]++;
+        }
+        run = 0;
+    }
+}
+
+static void
+scan_files(nufs_spacemap* sm)
+{
+    void* ibm = get_inode_bitmap();
+    for (int ii = 0; ii < NUFS_SPACEMAP_FILES; ++ii) {
+        sm->file_extents[ii] = -1;
+    }
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        inode* node = get_inode(ii);
+        if (!bitmap_get(ibm, ii) || node->refs == 0) {
+            continue;
+        }
+        int extents = inode_extents(node);
+        sm->file_extents[ii] = extents;
+        if (extents == 0) {
+            continue;
+        }
+        for (int fpn = 0; fpn < bytes_to_pages(node->size); ++fpn) {
+            sm->file_pages += (inode_get_pnum(node, fpn) != 0);
+        }
+        sm->files++;
+        sm->extents += extents;
+        sm->fragmented_files += (extents > 1);
+    }
+}
+
+static void
+rebuild()
+{
+    nufs_spacemap* sm = &report;
+    memset(sm, 0, sizeof(nufs_spacemap));
+    sm->page_size = PAGE_BYTES;
+    sm->pages = PAGE_COUNT;
+    sm->inodes = INODE_COUNT;
+
+    sm->region_count = ag_total();
+    for (int gg = 0; gg < ag_total(); ++gg) {
+        ag* g = ag_get(gg);
+        nufs_spacemap_region* rr = &sm->regions[gg];
+        rr->first_page = g->first_page;
+        rr->pages = g->pages;
+        rr->free_pages = g->free_pages;
+        rr->inodes = g->inodes;
+        rr->free_inodes = g->free_inodes;
+        sm->free_pages += g->free_pages;
+        sm->free_inodes += g->free_inodes;
+    }
+
+    scan_free(sm);
+    scan_files(sm);
+    if (sm->free_pages > 0) {
+        sm->free_frag = 100 - 100 * sm->largest_free / sm->free_pages;
+    }
+    if (sm->file_pages > sm->files) {
+        sm->file_frag = 100 * (sm->extents - sm->files) / (sm->file_pages - sm->files);
+    }
+
+    gen = ag_gen();
+    valid = 1;
+    printf("+ spacemap: %d/%d pages free in %d runs, %d files in %d extents\n",
+           sm->free_pages, sm->pages, sm->free_runs, sm->files, sm->extents);
+}
+
+void
+spacemap_report(nufs_spacemap* sm)
+{
+    if (!valid || gen != ag_gen()) {
+        rebuild();
+    }
+    *sm = report;
+}
@@ -0,0 +1,19 @@
+#ifndef NUFS_SPACEMAP_H
+#define NUFS_SPACEMAP_H
+
+#include "nufs_ioctl.h"
+
+// The space-map report (NUFS_IOC_SPACEMAP): free space, free-run and
+// per-file extent counts, fragmentation scores and per-group use. It is
+// built from the bitmaps and block maps, and kept until an allocation
+// changes them, so polling an idle image costs a copy.
+typedef struct spacemap_state {
+    int           valid;
+    int           gen;    // ag_gen() when the report was built
+    nufs_spacemap report;
+} spacemap_state;
+
+// expects the storage lock to be held
+void spacemap_report(nufs_spacemap* sm);
+
+#endif
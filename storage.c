@@ -2,9 +2,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <fuse.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "storage.h"
 #include "bitmap.h"
@@ -12,104 +12,648 @@
 #include "inode.h"
 #include "util.h"
 #include "directory.h"
+#include "superblock.h"
+#include "reclaim.h"
+#include "defrag.h"
+#include "csum.h"
+#include "fs.h"
+#include "frag.h"
+#include "ag.h"
+#include "tier.h"
+#include "writeback.h"
+#include "snapshot.h"
+#include "changes.h"
+#include "xattr.h"
 
+// how long lazytime may hold timestamp updates before writing them back
+#define LAZYTIME_FLUSH_SECS 60
+// relatime refreshes an atime that is at least this old
+#define RELATIME_SECS (24 * 60 * 60)
 
-void storage_init(const char* path){
+#define TOUCH_ATIME 1
+#define TOUCH_MTIME 2
+
+// writes smaller than this are collected per open file and stored
+// together once the buffer fills or the file is flushed
+#define WB_SIZE (16 * 4096)
+
+// the thread's current instance, see fs.h, and its page size
+__thread nufs_fs* nufs_cur = 0;
+__thread int nufs_page_shift = 12;
+
+#define storage_mutex   (nufs_cur->storage.storage_mutex)
+#define atime_mode      (nufs_cur->storage.atime_mode)
+#define lazytime        (nufs_cur->storage.lazytime)
+#define csum_opt        (nufs_cur->storage.csum_opt)
+#define io_backend      (nufs_cur->storage.io_backend)
+#define io_depth        (nufs_cur->storage.io_depth)
+#define lazy            (nufs_cur->storage.lazy)
+#define lazy_last_flush (nufs_cur->storage.lazy_last_flush)
+#define data_gen        (nufs_cur->storage.data_gen)
+#define cached_gen      (nufs_cur->storage.cached_gen)
+#define wb_owner        (nufs_cur->storage.wb_owner)
+
+// a new instance with default options; set options, then storage_init
+nufs_fs* storage_new(){
+    nufs_fs* fs = calloc(1, sizeof(nufs_fs));
+    assert(fs != 0);
+    storage_bind(fs);
+    pthread_mutex_init(&storage_mutex, 0);
+    atime_mode = ATIME_RELATIME;
+    csum_opt = CSUM_OFF;
+    io_backend = PAGES_MMAP;
+    io_depth = 32;
+    pages_set_page_size(4096);
+    pages_set_stripe(16);
+    writeback_set(1000, 256 * 1024);
+    return fs;
+}
+
+// unmap the image and release the instance; storage_stop first if it
+// was started
+void storage_free(nufs_fs* fs){
+    storage_bind(fs);
+    pages_free();
+    pthread_mutex_destroy(&storage_mutex);
+    free(fs);
+    nufs_cur = 0;
+}
+
+void storage_bind(nufs_fs* fs){
+    nufs_cur = fs;
+    if (fs != 0) {
+        nufs_page_shift = fs->pages.page_shift;
+    }
+}
+
+void storage_set_time_opts(nufs_fs* fs, int mode, int lazy_on){
+    storage_bind(fs);
+    atime_mode = mode;
+    lazytime = lazy_on;
+    printf("atime mode %d, lazytime %d\n", atime_mode, lazytime);
+}
+
+// the backend is switched in storage_start, since io_uring needs a thread
+void storage_set_io_opts(nufs_fs* fs, int backend, int queue_depth){
+    storage_bind(fs);
+    io_backend = backend;
+    io_depth = queue_depth;
+}
+
+// write one inode's pending timestamps back to its on-disk copy
+static void
+lazy_flush_inode(int inum){
+    lazy_times* lt = &lazy[inum];
+    if (!lt->dirty) {
+        return;
+    }
+    inode* in = get_inode(inum);
+    in->atime = lt->atime;
+    in->mtime = lt->mtime;
+    lt->dirty = 0;
+}
+
+static void
+lazy_flush_all(){
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        lazy_flush_inode(ii);
+    }
+    lazy_last_flush = time(0);
+}
+
+// drop pending timestamps, e.g. when they are being overwritten or the
+// inode goes away
+static void
+lazy_forget(int inum){
+    lazy[inum].dirty = 0;
+}
+
+static time_t
+cur_atime(int inum, inode* in){
+    return lazy[inum].dirty ? lazy[inum].atime : in->atime;
+}
+
+static time_t
+cur_mtime(int inum, inode* in){
+    return lazy[inum].dirty ? lazy[inum].mtime : in->mtime;
+}
+
+static int
+atime_needs_update(int inum, inode* in, time_t now){
+    time_t atime = cur_atime(inum, in);
+    switch (atime_mode) {
+    case ATIME_NOATIME:
+        return 0;
+    case ATIME_RELATIME:
+        return atime <= cur_mtime(inum, in) || atime <= in->ctime
+            || now - atime >= RELATIME_SECS;
+    default:
+        return 1;
+    }
+}
+
+// apply a timestamp update according to the mount options; with lazytime
+// the new times only reach the inode when it is written for another reason,
+// on fsync/unmount, or in the next periodic batch
+static void
+touch_inode(int inum, inode* in, int what){
+    time_t now = time(0);
+    if ((what & TOUCH_ATIME) && !atime_needs_update(inum, in, now)) {
+        what &= ~TOUCH_ATIME;
+    }
+    if (what == 0) {
+        return;
+    }
+
+    if (!lazytime) {
+        if (what & TOUCH_ATIME) in->atime = now;
+        if (what & TOUCH_MTIME) in->mtime = now;
+        return;
+    }
+
+    lazy_times* lt = &lazy[inum];
+    if (!lt->dirty) {
+        lt->atime = in->atime;
+        lt->mtime = in->mtime;
+        lt->dirty = 1;
+    }
+    if (what & TOUCH_ATIME) lt->atime = now;
+    if (what & TOUCH_MTIME) lt->mtime = now;
+
+    if (now - lazy_last_flush >= LAZYTIME_FLUSH_SECS) {
+        lazy_flush_all();
+    }
+}
+
+// stripe width for images spread over several files, set before init
+void storage_set_stripe(nufs_fs* fs, int pages){
+    storage_bind(fs);
+    pages_set_stripe(pages);
+}
+
+// checksum mode (CSUM_*), set before init
+void storage_set_csum(nufs_fs* fs, int mode){
+    storage_bind(fs);
+    csum_opt = mode;
+}
+
+// keep the first fast_pages pages on the first of two image files;
+// must be called before storage_init
+void storage_set_tier(nufs_fs* fs, int fast_pages){
+    storage_bind(fs);
+    pages_set_tier(fast_pages);
+}
+
+// background writeback: flush every interval_ms, and keep at most
+// dirty_bytes of changed pages; an interval of 0 leaves it to the kernel
+void storage_set_writeback(nufs_fs* fs, int interval_ms, int dirty_bytes){
+    storage_bind(fs);
+    writeback_set(interval_ms, dirty_bytes);
+}
+
+// the page size a new image is formatted with; an existing image keeps
+// its own. Returns -1 unless bytes is 4096, 16384 or 65536.
+int storage_set_page_size(nufs_fs* fs, int bytes){
+    storage_bind(fs);
+    return pages_set_page_size(bytes);
+}
+
+void storage_init(nufs_fs* fs, const char* path){
+    storage_bind(fs);
     printf("Initialize Storage: %s\n", path);
     pages_init(path);
-    directory_init();
+    int fresh = superblock_init();
+    ag_init();
+    if (fresh) {
+        directory_init();
+    }
+    if (csum_init(csum_opt) > 0) {
+        printf("WARNING: metadata checksum errors, the image may be corrupt\n");
+    }
+    frag_init();
+    changes_init();
+    xattr_init();
+    superblock* sb = get_superblock();
+    if (!(sb->features & FEAT_VARDIRENT)) {
+        // older image with fixed 64-byte entries, convert it in place
+        directory_upgrade();
+        sb->features |= FEAT_VARDIRENT;
+    }
 }
 
-int
-storage_stat(const char* path, struct stat* st){
-	int n = tree_lookup(path);
-	if (n < 0 ){
-		printf("NO MATCHING FROM GIVEN PATH\n");
-		return n;
-	}
-	inode* in = get_inode(n);
+// start the background threads; must happen after FUSE has daemonized
+void storage_start(nufs_fs* fs){
+    storage_bind(fs);
+    pages_set_backend(io_backend, io_depth);
+    reclaim_start();
+    tier_start();
+    writeback_start();
+}
+
+// stop the background threads and write back what is held in memory,
+// called on unmount with the storage lock held
+void storage_stop(nufs_fs* fs){
+    storage_bind(fs);
+    defrag_stop();
+    tier_stop();
+    reclaim_stop();
+    writeback_stop();
+    storage_sync(fs);
+    csum_stop();
+    writeback_sync();
+    changes_stop();
+    pages_set_backend(PAGES_MMAP, 0);
+}
+
+// serialises FUSE callbacks against the background threads; also binds
+// the instance to the calling thread, so engine internals may be used
+// until the matching unlock
+void storage_lock(nufs_fs* fs){
+    storage_bind(fs);
+    pthread_mutex_lock(&storage_mutex);
+}
+
+void storage_unlock(nufs_fs* fs){
+    storage_bind(fs);
+    pthread_mutex_unlock(&storage_mutex);
+}
+
+// the attributes of live inode n
+static void
+stat_inode(int n, inode* in, struct stat* st){
 	st->st_mode = in->mode;
     st->st_nlink = in->refs;
 	st->st_size = in->size;
+    nufs_file* wb = wb_owner[n];
+    if (wb != NULL && wb->wb_off + wb->wb_len > st->st_size) {
+        // appended, but still in the write buffer
+        st->st_size = wb->wb_off + wb->wb_len;
+    }
 	st->st_uid = getuid();
+    st->st_atime = cur_atime(n, in);
+    st->st_mtime = cur_mtime(n, in);
+    st->st_ctime = in->ctime;
+	st->st_ino = n;
+	st->st_blksize = PAGE_BYTES;
+}
+
+// the attributes of inode n of snapshot idx: read-only, and numbered
+// after the live inodes
+static void
+snap_stat_inode(int idx, int n, inode* in, struct stat* st){
+    st->st_mode = in->mode & ~0222;
+    st->st_nlink = in->refs;
+    st->st_size = in->size;
+    st->st_uid = getuid();
     st->st_atime = in->atime;
     st->st_mtime = in->mtime;
     st->st_ctime = in->ctime;
-	st->st_ino = n;
+    st->st_ino = INODE_COUNT * (1 + idx) + n;
+    st->st_blksize = PAGE_BYTES;
+}
+
+// /.snapshots and what is below it
+static int
+snap_stat(const char* path, struct stat* st){
+    if (snap_count() == 0) {
+        return -ENOENT;
+    }
+    st->st_uid = getuid();
+    st->st_blksize = PAGE_BYTES;
+    if (snap_is_dir(path)) {
+        st->st_mode = 040555;
+        st->st_nlink = 2;
+        st->st_size = 0;
+        st->st_atime = st->st_mtime = st->st_ctime = 0;
+        st->st_ino = INODE_COUNT * (SNAP_MAX + 1);
+        return 0;
+    }
+    inode* in;
+    int idx;
+    int n = snap_lookup(path, &in, &idx);
+    if (n < 0) {
+        return n;
+    }
+    snap_stat_inode(idx, n, in, st);
+    return 0;
+}
+
+int
+storage_stat(nufs_fs* fs, const char* path, struct stat* st){
+	storage_bind(fs);
+	if (snap_path(path)) {
+		return snap_stat(path, st);
+	}
+	int n = tree_lookup(path);
+	if (n < 0 ){
+		printf("NO MATCHING FROM GIVEN PATH\n");
+		return n;
+	}
+	stat_inode(n, get_inode(n), st);
 	return 0;
 }
 
-int storage_read(const char* path, char* buf, size_t size, off_t offset) {
+static int write_inode(int n, const char* buf, size_t size, off_t offset);
+
+// store what fh has buffered; a failure is kept in wb_err until the next
+// write, flush or fsync on fh picks it up, as the writes it came from
+// have already returned
+static void
+wb_flush(nufs_file* fh)
+{
+    if (fh->wb_len > 0) {
+        int rv = write_inode(fh->inum, fh->wbuf, fh->wb_len, fh->wb_off);
+        if (rv < fh->wb_len && fh->wb_err == 0) {
+            fh->wb_err = (rv < 0) ? rv : -ENOSPC;
+        }
+        fh->wb_len = 0;
+    }
+    if (wb_owner[fh->inum] == fh) {
+        wb_owner[fh->inum] = 0;
+    }
+}
+
+// store the buffered writes of whichever open file holds some for inode n
+static void
+wb_flush_inode(int n)
+{
+    if (wb_owner[n] != NULL) {
+        wb_flush(wb_owner[n]);
+    }
+}
+
+nufs_file* storage_open(nufs_fs* fs, const char* path) {
+    storage_bind(fs);
+    if (snap_path(path)) {
+        inode* in;
+        int idx;
+        int n = snap_lookup(path, &in, &idx);
+        if (n < 0) {
+            return NULL;
+        }
+        nufs_file* fh = calloc(1, sizeof(nufs_file));
+        fh->inum = n;
+        fh->snapshot = 1 + idx;
+        ra_init(&fh->ra);
+        return fh;
+    }
     int n = tree_lookup(path);
-    inode* in = get_inode(n);
+    if (n < 0) {
+        return NULL;
+    }
+    nufs_file* fh = calloc(1, sizeof(nufs_file));
+    fh->inum = n;
+    ra_init(&fh->ra);
+    fh->keep_cache = (cached_gen[n] == data_gen[n]);
+    cached_gen[n] = data_gen[n];
+    return fh;
+}
+
+void storage_release(nufs_fs* fs, nufs_file* fh) {
+    storage_bind(fs);
+    if (!fh->snapshot) {
+        wb_flush(fh);
+        inode_release_window(fh->inum);
+    }
+    free(fh->wbuf);
+    free(fh);
+}
+
+// store fh's buffered writes; returns, and clears, the first error any
+// store since the last flush ran into
+int storage_flush(nufs_fs* fs, nufs_file* fh) {
+    storage_bind(fs);
+    wb_flush(fh);
+    int rv = fh->wb_err;
+    fh->wb_err = 0;
+    return rv;
+}
+
+// an inode's contents changed, so pages the kernel cached for it must
+// not be reused by the next open
+void storage_invalidate(nufs_fs* fs, int inum) {
+    storage_bind(fs);
+    data_gen[inum]++;
+}
+
+// append a piece of I/O, merging it into the previous segment when it
+// continues the same run of pages
+static void
+add_seg(page_seg* segs, int* count, int pn, int off, int len, char* buf)
+{
+    if (*count > 0) {
+        page_seg* last = &segs[*count - 1];
+        if (((long)last->pnum << nufs_page_shift) + last->off + last->len
+            == ((long)pn << nufs_page_shift) + off
+            && last->buf + last->len == buf) {
+            last->len += len;
+            return;
+        }
+    }
+    segs[*count].pnum = pn;
+    segs[*count].off = off;
+    segs[*count].len = len;
+    segs[*count].buf = buf;
+    ++*count;
+}
 
+// read size bytes at offset from inode in, which may be a snapshot's
+static int
+read_inode(inode* in, char* buf, size_t size, off_t offset)
+{
+    page_seg* segs = malloc((bytes_to_pages(size) + 1) * sizeof(page_seg));
+    int nsegs = 0;
     int index = 0;
     int oindex = offset;
     int leftover = size;
 
     while (leftover > 0) {
-        int pn = inode_get_pnum(in, oindex / 4096);
-        char* data = (char*)pages_get_page(pn);
+        int base, stored;
+        int pn = inode_locate(in, PAGE_OF(oindex), &base, &stored);
+        int off_amount = PAGE_OFF(oindex);
+        int amount = min(PAGE_BYTES - off_amount, leftover);
+        // a fragment tail holds less than a page, the rest reads as zeros
+        int have = max(0, min(amount, stored - off_amount));
 
-        int off_amount = oindex % 4096;
-
-        data += off_amount;
-        int amount = min(4096 - off_amount, leftover);
-        strncpy(buf + index, data, amount);
+        if (pn == 0) {
+            // hole, never written
+            memset(buf + index, 0, amount);
+        }
+        else if (csum_verify(pn) < 0) {
+            free(segs);
+            return -EIO;
+        }
+        else {
+            tier_touch(pn);
+            if (have > 0) {
+                add_seg(segs, &nsegs, pn, base + off_amount, have, buf + index);
+            }
+            memset(buf + index + have, 0, amount - have);
+        }
         index += amount;
         oindex += amount;
         leftover -= amount;
     }
-    
-    // update the access time when read
-    time_t now = time(0);
-    in->atime = now;
 
+    int rv = pages_rw(segs, nsegs, 0);
+    free(segs);
+    if (rv < 0) {
+        return rv;
+    }
     return size;
 }
 
-int storage_write(const char* path, const char* buf, size_t size, off_t offset){
+int storage_read(nufs_fs* fs, const char* path, char* buf, size_t size, off_t offset, nufs_file* fh) {
+    storage_bind(fs);
+    if (snap_path(path)) {
+        // frozen: no buffered writes, and no atime to keep
+        inode* in;
+        int idx;
+        int n = snap_lookup(path, &in, &idx);
+        return (n < 0) ? n : read_inode(in, buf, size, offset);
+    }
     int n = tree_lookup(path);
+    if (n < 0) {
+        return n;
+    }
     inode* in = get_inode(n);
-    
+    wb_flush_inode(n);
+
+    if (fh != NULL) {
+        ra_observe(&fh->ra, in, offset, size);
+    }
+
+    int rv = read_inode(in, buf, size, offset);
+    if (rv < 0) {
+        return rv;
+    }
+
+    touch_inode(n, in, TOUCH_ATIME);
+
+    return size;
+}
+
+// store size bytes at offset in inode n; returns the bytes stored
+static int
+write_inode(int n, const char* buf, size_t size, off_t offset)
+{
+    inode* in = get_inode(n);
+    data_gen[n]++;
+
+    int old_size = in->size;
     int grow = size + offset;
     if (grow > in->size) {
-        grow_inode(in, grow);
+        // the inode is dirtied anyway, so pending times can go with it
+        lazy_flush_inode(n);
+        if (grow_inode(in, grow) < 0) {
+            return -ENOSPC;
+        }
     }
 
+    page_seg* segs = malloc((bytes_to_pages(size) + 1) * sizeof(page_seg));
+    int nsegs = 0;
     int index = 0;
     int oindex = offset;
     int leftover = size;
-    fflush(stdout);
     while (leftover > 0) {
-        int pn = inode_get_pnum(in, oindex / 4096);
-        char* data = (char*) pages_get_page(pn);
-
-        int off_amount = oindex % 4096;
+        int off_amount = PAGE_OFF(oindex);
+        int amount = min(PAGE_BYTES - off_amount, leftover);
 
-        data += off_amount;
-        int amount = min(4096 - off_amount, leftover);
+        int base;
+        int pn = inode_prepare_write(in, PAGE_OF(oindex), off_amount + amount, &base);
+        if (pn < 0) {
+            printf("WRITE: image is full\n");
+            // keep what was stored; with nothing stored, the size too is
+            // as it was, however far past the end the write started
+            int keep = (index == 0) ? old_size : max(old_size, oindex);
+            // a shrink that can't unshare changes nothing, so the size is
+            // put back by hand; the pages past it stay with the file until
+            // it is truncated or written over
+            if (in->size > keep && shrink_inode(in, keep) < 0) {
+                in->size = keep;
+            }
+            break;
+        }
 
-        strncpy(data, buf + index, amount);
+        tier_touch(pn);
+        add_seg(segs, &nsegs, pn, base + off_amount, amount, (char*)buf + index);
         index += amount;
         oindex += amount;
         leftover -= amount;
     }
 
-    // update the time when written
-    time_t now = time(0);
-    in->atime = now;
-    in->mtime = now;
+    int rv = pages_rw(segs, nsegs, 1);
+    if (rv == 0) {
+        for (int ii = 0; ii < nsegs; ++ii) {
+            int last = segs[ii].pnum + PAGE_OF(segs[ii].off + segs[ii].len - 1);
+            for (int pn = segs[ii].pnum; pn <= last; ++pn) {
+                csum_update(pn);
+            }
+        }
+    }
+    free(segs);
+    if (rv < 0) {
+        return rv;
+    }
+    if (index == 0 && size > 0) {
+        return -ENOSPC;
+    }
 
+    touch_inode(n, in, TOUCH_MTIME);
+    writeback_dirtied();
+
+    return index;
+}
+
+int storage_write(nufs_fs* fs, const char* path, const char* buf, size_t size, off_t offset, nufs_file* fh){
+    storage_bind(fs);
+    if (snap_path(path)) {
+        return -EROFS;
+    }
+    int n = tree_lookup(path);
+    if (n < 0) {
+        return n;
+    }
+
+    if (fh != NULL && fh->wb_err != 0) {
+        // an earlier buffered write could not be stored
+        int rv = fh->wb_err;
+        fh->wb_err = 0;
+        return rv;
+    }
+
+    if (fh == NULL || fh->inum != n || size >= WB_SIZE) {
+        wb_flush_inode(n);
+        return write_inode(n, buf, size, offset);
+    }
+
+    // small writes that continue this file's buffer join it; anything
+    // else stores what is buffered (ours or another open's) first
+    if (wb_owner[n] != fh || fh->wb_off + fh->wb_len != offset
+        || fh->wb_len + size > WB_SIZE) {
+        wb_flush_inode(n);
+        if (fh->wbuf == NULL) {
+            fh->wbuf = malloc(WB_SIZE);
+        }
+        fh->wb_off = offset;
+        wb_owner[n] = fh;
+    }
+    memcpy(fh->wbuf + fh->wb_len, buf, size);
+    fh->wb_len += size;
+    data_gen[n]++;
     return size;
 }
 
-int storage_link(const char *from, const char *to){
+int storage_link(nufs_fs* fs, const char *from, const char *to){
+    storage_bind(fs);
+    if (snap_path(from) || snap_path(to)) {
+        return -EROFS;
+    }
 
 	int inum = tree_lookup(from);
 
-    char* name = (char*)malloc(strlen(to));
-    char* parent = (char*)malloc(strlen(to));
+    char* name = (char*)malloc(strlen(to) + 1);
+    char* parent = (char*)malloc(strlen(to) + 1);
 	char* temp = name;
 
     strcpy(name, to);
@@ -119,7 +663,7 @@ int storage_link(const char *from, const char *to){
 
     // minus one for '/'
     // remove that name to get parent directory
-    int loc = strlen(from) - strlen(name);
+    int loc = strlen(to) - strlen(name);
     parent[loc] = 0;
 
     int p_in = tree_lookup(parent);
@@ -135,17 +679,24 @@ int storage_link(const char *from, const char *to){
     // parent to node
     inode* pnode = get_inode(p_in);
 
-    directory_put(pnode, name, inum);
+    int rv = directory_put(pnode, name, inum);
+    if (rv < 0) {
+        in->refs--;
+    }
     free(temp);
     free(parent);
-    return 0;
+    return rv;
 }
 
 
 int
-storage_unlink(const char* path){
-	char* name = (char*)malloc(strlen(path));
-    char* parent = (char*)malloc(strlen(path));
+storage_unlink(nufs_fs* fs, const char* path){
+	storage_bind(fs);
+	if (snap_path(path)) {
+		return -EROFS;
+	}
+	char* name = (char*)malloc(strlen(path) + 1);
+    char* parent = (char*)malloc(strlen(path) + 1);
 	char* temp = name;
 
     strcpy(name, path);
@@ -167,36 +718,55 @@ storage_unlink(const char* path){
 		return n;
 	}
 
-    int rv = 0;
 	inode* in = get_inode(inum);
     inode* pnode = get_inode(p_in);
 
+    // the entry goes first: with snapshots, changing the directory page
+    // may need a free page for the copy
+    int rv = directory_delete(pnode, name);
+    if (rv < 0) {
+        free(temp);
+        free(parent);
+        return rv;
+    }
+
     if (in->refs > 1) {
         in->refs--;
     } else {
-        // TODO: inode_free()
-        free_page(in->ptrs[0]);
-        void* bm = get_inode_bitmap();
-        bitmap_put(bm,inum, 0);
+        // the pages are freed in the background; the orphan list is on
+        // disk, so a crash before that only delays it to the next mount
+        in->refs = 0;
+        // nothing can read it any more, so buffered writes are dropped
+        if (wb_owner[inum] != NULL) {
+            wb_owner[inum]->wb_len = 0;
+            wb_owner[inum] = 0;
+        }
+        inode_release_window(inum);
+        lazy_forget(inum);
+        reclaim_orphan(inum);
     }
 
-    rv = directory_delete(pnode, name);
     free(temp);
     free(parent);
     return rv;
 }
 
-int storage_rename(const char* from, const char* to){
-    int rv = storage_link(from,to);
+int storage_rename(nufs_fs* fs, const char* from, const char* to){
+    storage_bind(fs);
+    int rv = storage_link(fs, from, to);
     if (rv < 0){
         return rv;
     }
-    return storage_unlink(from);
+    return storage_unlink(fs, from);
 }
 
-int storage_mknod(const char* path, int mode){
-    char* name = (char*)malloc(strlen(path));
-    char* parent = (char*)malloc(strlen(path));
+int storage_mknod(nufs_fs* fs, const char* path, int mode){
+    storage_bind(fs);
+    if (snap_path(path)) {
+        return -EROFS;
+    }
+    char* name = (char*)malloc(strlen(path) + 1);
+    char* parent = (char*)malloc(strlen(path) + 1);
     char* temp = name;
 
     strcpy(name, path);
@@ -215,14 +785,34 @@ int storage_mknod(const char* path, int mode){
     int inum = alloc_inode();
     if (inum == -1) {
         printf("ERROR: NO free inode!\n");
-        return -1;
+        free(temp);
+        free(parent);
+        return -ENOSPC;
     }
 
     inode* in = get_inode(inum);
+    // a reused inode number must not inherit the old file's cache
+    storage_invalidate(fs, inum);
     in->mode = mode;
     in->size = 0;
     in->refs = 1;
-    in->ptrs[0] = alloc_page();
+    in->ptrs[0] = 0;
+    in->ptrs[1] = 0;
+    in->iptr = 0;
+    // the new inode's pages go in the same allocation group as it
+    inode_set_goal(inum, ag_goal(ag_of_inode(inum)));
+    if (S_ISDIR(mode)) {
+        // directories need their entry page up front, files get
+        // pages when they are first written
+        if (inode_alloc_pnum(in, 0) < 0) {
+            free_inode(inum);
+            free(temp);
+            free(parent);
+            return -ENOSPC;
+        }
+        inode_release_window(inum);
+        directory_init_page(in->ptrs[0]);
+    }
     // update the time when written
     time_t now = time(0);
     in->atime = now;
@@ -231,21 +821,42 @@ int storage_mknod(const char* path, int mode){
 
 
     int rv = directory_put(p_in, name, inum);
+    if (rv < 0) {
+        // parent page full or bad name, undo the allocation
+        if (in->ptrs[0] != 0) {
+            free_page(in->ptrs[0]);
+            csum_update(in->ptrs[0]);
+            in->ptrs[0] = 0;
+        }
+        in->refs = 0;
+        free_inode(inum);
+    }
 
     free(temp);
     free(parent);
     return rv;
 }
 
-int storage_set_time(const char* path, const struct timespec ts[2]){
+int storage_set_time(nufs_fs* fs, const char* path, const struct timespec ts[2]){
+    storage_bind(fs);
+    if (snap_path(path)) {
+        return -EROFS;
+    }
     int n = tree_lookup(path);
     inode* in = get_inode(n);
+    // a later store of buffered writes would overwrite the new mtime
+    wb_flush_inode(n);
+    lazy_forget(n);
     in->atime = ts[0].tv_sec;
     in->mtime = ts[1].tv_sec;
     return 0;
 }
 
-int storage_chmod(const char* path, mode_t mode) {
+int storage_chmod(nufs_fs* fs, const char* path, mode_t mode) {
+    storage_bind(fs);
+    if (snap_path(path)) {
+        return -EROFS;
+    }
     int n = tree_lookup(path);
     if (n < 0) {
         return -ENOENT;
@@ -255,17 +866,422 @@ int storage_chmod(const char* path, mode_t mode) {
     return 0;
 }
 
-int storage_truncate(const char *path, off_t size) {
+// extended attributes, see xattr.h; snapshots don't keep them, so a
+// snapshot's files have none and can't be given any
+int storage_getxattr(nufs_fs* fs, const char* path, const char* name, char* value, size_t size) {
+    storage_bind(fs);
+    if (snap_path(path)) {
+        struct stat st;
+        int rv = snap_stat(path, &st);
+        return (rv < 0) ? rv : -ENODATA;
+    }
+    int n = tree_lookup(path);
+    if (n < 0) {
+        return -ENOENT;
+    }
+    return xattr_get(n, name, value, size);
+}
+
+int storage_listxattr(nufs_fs* fs, const char* path, char* list, size_t size) {
+    storage_bind(fs);
+    if (snap_path(path)) {
+        struct stat st;
+        int rv = snap_stat(path, &st);
+        return (rv < 0) ? rv : 0;
+    }
+    int n = tree_lookup(path);
+    if (n < 0) {
+        return -ENOENT;
+    }
+    return xattr_list(n, list, size);
+}
+
+int storage_setxattr(nufs_fs* fs, const char* path, const char* name, const char* value,
+                     size_t size, int flags) {
+    storage_bind(fs);
+    if (snap_path(path)) {
+        return -EROFS;
+    }
+    int n = tree_lookup(path);
+    if (n < 0) {
+        return -ENOENT;
+    }
+    return xattr_set(n, name, value, size, flags);
+}
+
+int storage_removexattr(nufs_fs* fs, const char* path, const char* name) {
+    storage_bind(fs);
+    if (snap_path(path)) {
+        return -EROFS;
+    }
+    int n = tree_lookup(path);
+    if (n < 0) {
+        return -ENOENT;
+    }
+    return xattr_remove(n, name);
+}
+
+int storage_truncate(nufs_fs* fs, const char *path, off_t size) {
+    storage_bind(fs);
+    if (snap_path(path)) {
+        return -EROFS;
+    }
     int n = tree_lookup(path);
     if (n < 0) {
         printf("TRUNCATION ERROR\n");
         return -ENOENT;
     }
+    wb_flush_inode(n);
     inode* in = get_inode(n);
+    storage_invalidate(fs, n);
     if (in->size > size) {
-        shrink_inode(in, size);
-    } else {
-        grow_inode(in, size);
+        return shrink_inode(in, size);
+    }
+    return grow_inode(in, size);
+}
+
+int storage_fsync(nufs_fs* fs, const char* path) {
+    storage_bind(fs);
+    if (snap_path(path)) {
+        // nothing in a snapshot is ever dirty
+        return 0;
+    }
+    int n = tree_lookup(path);
+    if (n < 0) {
+        return -ENOENT;
+    }
+    int rv = 0;
+    nufs_file* wb = wb_owner[n];
+    if (wb != NULL) {
+        rv = storage_flush(fs, wb);
+    }
+    lazy_flush_inode(n);
+    int err = writeback_sync();
+    return (rv < 0) ? rv : err;
+}
+
+// write back everything held in memory
+void storage_sync(nufs_fs* fs) {
+    storage_bind(fs);
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        wb_flush_inode(ii);
+    }
+    lazy_flush_all();
+}
+
+// freeze the filesystem as it is now, as /.snapshots/<name>; not while a
+// defrag pass is moving pages around
+int storage_snapshot(nufs_fs* fs, const char* name) {
+    storage_bind(fs);
+    nufs_defrag_status ds;
+    defrag_status(&ds);
+    if (ds.running) {
+        return -EBUSY;
+    }
+    // what is held in memory belongs in the snapshot too
+    storage_sync(fs);
+    return snapshot_create(name);
+}
+
+int storage_snapshot_delete(nufs_fs* fs, const char* name) {
+    storage_bind(fs);
+    return snapshot_delete(name);
+}
+
+_Static_assert(sizeof(((nufs_changes*)0)->changed) * 8 == MAX_PAGE_COUNT,
+               "a change bitmap covers every page");
+
+// the pages changed since generation ch->since, for an incremental
+// backup; a new generation starts. See changes.h.
+int storage_changes(nufs_fs* fs, nufs_changes* ch) {
+    storage_bind(fs);
+    int stripe;
+    pages_layout(&ch->members, &stripe);
+    if (pages_tier_size() > 0) {
+        ch->members = 2;
+    }
+    ch->page_size = PAGE_BYTES;
+    ch->pages = PAGE_COUNT;
+    ch->gen = changes_collect(ch->since, ch->changed);
+    return (ch->gen < 0) ? -ENOTSUP : 0;
+}
+
+// append one bulk stat record; returns -1 if it doesn't fit
+static int
+put_bulk_stat(char* out, int* used, const char* name, int len, struct stat* st, int err)
+{
+    int rec = (sizeof(nufs_bulk_stat) + len + 7) & ~7;
+    if (*used + rec > NUFS_BULK_BUF) {
+        return -1;
+    }
+    nufs_bulk_stat* bs = (nufs_bulk_stat*)(out + *used);
+    memset(bs, 0, rec);
+    if (err == 0) {
+        bs->size = st->st_size;
+        bs->atime = st->st_atime;
+        bs->mtime = st->st_mtime;
+        bs->ctime = st->st_ctime;
+        bs->ino = st->st_ino;
+        bs->mode = st->st_mode;
+        bs->nlink = st->st_nlink;
     }
+    bs->err = err;
+    bs->rec_len = rec;
+    bs->name_len = len;
+    memcpy(bs->name, name, len);
+    *used += rec;
     return 0;
 }
+
+// the attributes of everything in the directory at path, or of a list
+// of paths below it, in one call; see nufs_ioctl.h. A directory's
+// entries are read straight from its page, without a lookup each.
+int storage_bulkstat(nufs_fs* fs, const char* path, nufs_bulkstat* bs) {
+    storage_bind(fs);
+    char* out = calloc(1, NUFS_BULK_BUF);
+    int used = 0;
+    int done = 0;
+    struct stat st;
+    bs->more = 0;
+
+    if (bs->flags & NUFS_BULK_PATHS) {
+        char* name = bs->buf;
+        char* end = bs->buf + NUFS_BULK_BUF;
+        for (int ii = 0; ii < bs->count && name < end; ++ii) {
+            int len = strnlen(name, end - name);
+            if (ii >= bs->pos) {
+                char full[4096];
+                snprintf(full, sizeof(full), "%s/%.*s", streq(path, "/") ? "" : path, len, name);
+                memset(&st, 0, sizeof(st));
+                int rv = storage_stat(fs, full, &st);
+                if (put_bulk_stat(out, &used, name, len, &st, rv) < 0) {
+                    bs->more = 1;
+                    bs->pos = ii;
+                    break;
+                }
+                done++;
+            }
+            name += len + 1;
+        }
+    }
+    else {
+        inode* dd;
+        int snap = -1;
+        int dn;
+        if (snap_is_dir(path)) {
+            dn = -EOPNOTSUPP;
+        }
+        else if (snap_path(path)) {
+            dn = snap_lookup(path, &dd, &snap);
+        }
+        else {
+            dn = tree_lookup(path);
+            dd = (dn < 0) ? NULL : get_inode(dn);
+        }
+        if (dn >= 0 && !S_ISDIR(dd->mode)) {
+            dn = -ENOTDIR;
+        }
+        if (dn < 0) {
+            free(out);
+            return dn;
+        }
+        int pos = bs->pos;
+        for (;;) {
+            int at = pos;
+            dirent* de = directory_next(dd, &pos);
+            if (de == NULL) {
+                break;
+            }
+            memset(&st, 0, sizeof(st));
+            if (snap >= 0) {
+                snap_stat_inode(snap, de->inum, snap_inode(snap, de->inum), &st);
+            }
+            else {
+                stat_inode(de->inum, get_inode(de->inum), &st);
+            }
+            if (put_bulk_stat(out, &used, de->name, de->name_len, &st, 0) < 0) {
+                bs->more = 1;
+                pos = at;
+                break;
+            }
+            done++;
+        }
+        bs->pos = pos;
+    }
+
+    memcpy(bs->buf, out, NUFS_BULK_BUF);
+    bs->count = done;
+    free(out);
+    return 0;
+}
+
+// check a bulk create record at off; returns it, or NULL if it is bad
+static nufs_bulk_file*
+bulk_file_at(nufs_bulkcreate* bc, int off)
+{
+    if (off + (int)sizeof(nufs_bulk_file) > NUFS_BULK_BUF) {
+        return NULL;
+    }
+    nufs_bulk_file* bf = (nufs_bulk_file*)(bc->buf + off);
+    int type = bf->mode & S_IFMT;
+    if (bf->rec_len < sizeof(nufs_bulk_file) + bf->name_len + bf->data_len
+        || off + bf->rec_len > NUFS_BULK_BUF
+        || (type != S_IFREG && type != S_IFDIR && type != S_IFLNK)
+        || (type == S_IFDIR && bf->data_len > 0)) {
+        return NULL;
+    }
+    return bf;
+}
+
+// create bc->count files in the directory at path, all or none: every
+// record is checked first, then the inodes are taken, the entries go in
+// with a single directory update, and the contents are written, each
+// file's pages after the last's. A failure on the way undoes the lot.
+int storage_bulkcreate(nufs_fs* fs, const char* path, nufs_bulkcreate* bc) {
+    storage_bind(fs);
+    bc->failed = -1;
+    if (snap_path(path)) {
+        return -EROFS;
+    }
+    int dn = tree_lookup(path);
+    if (dn < 0) {
+        return dn;
+    }
+    inode* dd = get_inode(dn);
+    if (!S_ISDIR(dd->mode)) {
+        return -ENOTDIR;
+    }
+    int count = bc->count;
+    if (count < 0 || count > NUFS_BULK_BUF / (int)sizeof(nufs_bulk_file)) {
+        return -EINVAL;
+    }
+
+    nufs_bulk_file** files = calloc(count + 1, sizeof(nufs_bulk_file*));
+    char** names = calloc(count + 1, sizeof(char*));
+    int* inums = calloc(count + 1, sizeof(int));
+    int rv = 0;
+    int ii;
+
+    int off = 0;
+    for (ii = 0; ii < count; ++ii) {
+        nufs_bulk_file* bf = bulk_file_at(bc, off);
+        if (bf == NULL) {
+            rv = -EINVAL;
+            break;
+        }
+        names[ii] = strndup(bf->name, bf->name_len);
+        if (bf->name_len > DIR_NAME) {
+            rv = -ENAMETOOLONG;
+        }
+        else if (bf->name_len == 0 || strlen(names[ii]) != bf->name_len
+                 || strchr(names[ii], '/') != NULL) {
+            rv = -EINVAL;
+        }
+        else if (directory_lookup(dd, names[ii]) >= 0) {
+            rv = -EEXIST;
+        }
+        for (int jj = 0; jj < ii && rv == 0; ++jj) {
+            if (streq(names[jj], names[ii])) {
+                rv = -EEXIST;
+            }
+        }
+        if (rv < 0) {
+            break;
+        }
+        files[ii] = bf;
+        off += bf->rec_len;
+    }
+
+    int made;
+    time_t now = time(0);
+    for (made = 0; made < count && rv == 0; ++made) {
+        ii = made;
+        int inum = alloc_inode();
+        if (inum < 0) {
+            rv = -ENOSPC;
+            break;
+        }
+        inums[made] = inum;
+        inode* in = get_inode(inum);
+        storage_invalidate(fs, inum);
+        in->mode = files[made]->mode;
+        in->size = 0;
+        in->refs = 1;
+        in->ptrs[0] = 0;
+        in->ptrs[1] = 0;
+        in->iptr = 0;
+        in->atime = now;
+        in->ctime = now;
+        in->mtime = now;
+        inode_set_goal(inum, ag_goal(ag_of_inode(inum)));
+        if (S_ISDIR(in->mode)) {
+            if (inode_alloc_pnum(in, 0) < 0) {
+                free_inode(inum);
+                rv = -ENOSPC;
+                break;
+            }
+            inode_release_window(inum);
+            directory_init_page(in->ptrs[0]);
+        }
+    }
+
+    int entered = 0;
+    if (rv == 0) {
+        ii = -1;
+        rv = directory_put_many(dd, names, inums, count);
+        entered = (rv == 0);
+    }
+
+    int goal = 0;
+    for (int jj = 0; jj < count && rv == 0; ++jj) {
+        int len = files[jj]->data_len;
+        if (len == 0) {
+            continue;
+        }
+        if (goal > 0) {
+            inode_set_goal(inums[jj], goal);
+        }
+        int wrote = write_inode(inums[jj], files[jj]->name + files[jj]->name_len, len, 0);
+        inode_release_window(inums[jj]);
+        if (wrote < len) {
+            rv = (wrote < 0) ? wrote : -ENOSPC;
+            ii = jj;
+            break;
+        }
+        // a short tail may sit in a fragment; go on after the last whole page
+        for (int fpn = bytes_to_pages(len) - 1; fpn >= 0; --fpn) {
+            int last = inode_get_pnum(get_inode(inums[jj]), fpn);
+            if (last > 0) {
+                goal = last + 1;
+                break;
+            }
+        }
+    }
+
+    if (rv < 0) {
+        bc->failed = ii;
+        for (int jj = 0; jj < made; ++jj) {
+            inode* in = get_inode(inums[jj]);
+            if (entered) {
+                directory_delete(dd, names[jj]);
+            }
+            shrink_inode(in, 0);
+            if (in->ptrs[0] != 0) {
+                free_page(in->ptrs[0]);
+                csum_update(in->ptrs[0]);
+                in->ptrs[0] = 0;
+            }
+            in->refs = 0;
+            free_inode(inums[jj]);
+        }
+    }
+    printf("+ bulkcreate(%s, %d) -> %d\n", path, count, rv);
+
+    for (ii = 0; ii < count; ++ii) {
+        free(names[ii]);
+    }
+    free(names);
+    free(files);
+    free(inums);
+    return rv;
+}
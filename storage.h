@@ -7,19 +7,108 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "slist.h"
+#include "readahead.h"
+#include "inode.h"
+#include "nufs_ioctl.h"
 
-void   storage_init(const char* path);
-int    storage_stat(const char* path, struct stat* st);
-int    storage_read(const char* path, char* buf, size_t size, off_t offset);
-int    storage_write(const char* path, const char* buf, size_t size, off_t offset);
-int    storage_truncate(const char *path, off_t size);
-int    storage_mknod(const char* path, int mode);
-int    storage_unlink(const char* path);
-int    storage_link(const char *from, const char *to);
-int    storage_rename(const char *from, const char *to);
-int    storage_set_time(const char* path, const struct timespec ts[2]);
-slist* storage_list(const char* path);
-int    storage_chmod(const char* path, mode_t mode);
+// atime update policies, selected with -o strictatime/relatime/noatime
+enum {
+    ATIME_STRICT,   // update atime on every read
+    ATIME_RELATIME, // update only if older than mtime/ctime or a day old
+    ATIME_NOATIME,  // never update atime on read
+};
+
+// per-open-file state, kept in fuse_file_info.fh
+typedef struct nufs_file {
+    int      inum;
+    ra_state ra;
+    int      keep_cache; // contents unchanged since the last open
+    // small sequential writes collected here and stored together
+    char*    wbuf;
+    off_t    wb_off;
+    int      wb_len;
+    int      wb_err;     // a failed store, reported by the next write/flush
+    int      snapshot;   // 1 + the snapshot a file under /.snapshots is
+                         // in, with inum in its table; 0 for live files
+} nufs_file;
+
+// one open image; see fs.h
+typedef struct nufs_fs nufs_fs;
+
+// timestamps held in memory under lazytime, not yet written to the inode
+typedef struct lazy_times {
+    time_t atime;
+    time_t mtime;
+    int    dirty;
+} lazy_times;
+
+typedef struct storage_state {
+    // serialises FUSE callbacks against background work
+    pthread_mutex_t storage_mutex;
+
+    int atime_mode;
+    int lazytime;
+    int csum_opt;
+    int io_backend;
+    int io_depth;
+
+    lazy_times lazy[INODE_COUNT];
+    time_t     lazy_last_flush;
+
+    // contents generation per inode, and the generation the kernel's
+    // page cache was filled from at the last open
+    unsigned data_gen[INODE_COUNT];
+    unsigned cached_gen[INODE_COUNT];
+
+    // the open file holding buffered writes for each inode, if any
+    struct nufs_file* wb_owner[INODE_COUNT];
+} storage_state;
+
+// Every call takes the instance it works on, so several images can be
+// open in one process.
+nufs_fs* storage_new();
+void   storage_free(nufs_fs* fs);
+void   storage_bind(nufs_fs* fs);
+void   storage_set_stripe(nufs_fs* fs, int pages);
+void   storage_set_csum(nufs_fs* fs, int mode);
+void   storage_set_tier(nufs_fs* fs, int fast_pages);
+int    storage_set_page_size(nufs_fs* fs, int bytes);
+void   storage_set_writeback(nufs_fs* fs, int interval_ms, int dirty_bytes);
+void   storage_init(nufs_fs* fs, const char* path);
+void   storage_start(nufs_fs* fs);
+void   storage_stop(nufs_fs* fs);
+void   storage_lock(nufs_fs* fs);
+void   storage_unlock(nufs_fs* fs);
+void   storage_set_time_opts(nufs_fs* fs, int atime_mode, int lazytime);
+void   storage_set_io_opts(nufs_fs* fs, int backend, int queue_depth);
+int    storage_fsync(nufs_fs* fs, const char* path);
+int    storage_flush(nufs_fs* fs, nufs_file* fh);
+void   storage_sync(nufs_fs* fs);
+int    storage_stat(nufs_fs* fs, const char* path, struct stat* st);
+nufs_file* storage_open(nufs_fs* fs, const char* path);
+void   storage_release(nufs_fs* fs, nufs_file* fh);
+void   storage_invalidate(nufs_fs* fs, int inum);
+int    storage_read(nufs_fs* fs, const char* path, char* buf, size_t size, off_t offset, nufs_file* fh);
+int    storage_write(nufs_fs* fs, const char* path, const char* buf, size_t size, off_t offset, nufs_file* fh);
+int    storage_truncate(nufs_fs* fs, const char *path, off_t size);
+int    storage_mknod(nufs_fs* fs, const char* path, int mode);
+int    storage_unlink(nufs_fs* fs, const char* path);
+int    storage_link(nufs_fs* fs, const char *from, const char *to);
+int    storage_rename(nufs_fs* fs, const char *from, const char *to);
+int    storage_set_time(nufs_fs* fs, const char* path, const struct timespec ts[2]);
+slist* storage_list(nufs_fs* fs, const char* path);
+int    storage_chmod(nufs_fs* fs, const char* path, mode_t mode);
+int    storage_getxattr(nufs_fs* fs, const char* path, const char* name, char* value, size_t size);
+int    storage_listxattr(nufs_fs* fs, const char* path, char* list, size_t size);
+int    storage_setxattr(nufs_fs* fs, const char* path, const char* name, const char* value,
+                        size_t size, int flags);
+int    storage_removexattr(nufs_fs* fs, const char* path, const char* name);
+int    storage_snapshot(nufs_fs* fs, const char* name);
+int    storage_snapshot_delete(nufs_fs* fs, const char* name);
+int    storage_changes(nufs_fs* fs, nufs_changes* ch);
+int    storage_bulkstat(nufs_fs* fs, const char* path, nufs_bulkstat* bs);
+int    storage_bulkcreate(nufs_fs* fs, const char* path, nufs_bulkcreate* bc);
 #endif
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "superblock.h"
+#include "pages.h"
+#include "bitmap.h"
+
+_Static_assert(sizeof(superblock) == 256, "superblock must fill the tail of page 0");
+
+superblock*
+get_superblock()
+{
+    return (superblock*)((char*)pages_get_page(0) + SUPERBLOCK_OFFSET);
+}
+
+// check the superblock, writing one if the image doesn't have it yet;
+// returns 1 if the image is brand new and still needs a root directory
+int
+superblock_init()
+{
+    superblock* sb = get_superblock();
+    int members, stripe;
+    pages_layout(&members, &stripe);
+
+    if (sb->magic == NUFS_MAGIC) {
+        assert(sb->version == NUFS_VERSION);
+        if (sb->stripe_members == 0) {
+            sb->stripe_members = members;
+            sb->stripe_pages = stripe;
+        }
+        // page 0 is always at the start of the first member, but
+        // everything else moves if the layout doesn't match
+        if (sb->stripe_members != members || (members > 1 && sb->stripe_pages != stripe)) {
+            fprintf(stderr, "image is striped over %d files, %d pages wide; got %d, %d\n",
+                    sb->stripe_members, sb->stripe_pages, members, stripe);
+            abort();
+        }
+        // pages_init has already picked the size up from here
+        assert(sb->page_size == 0 || sb->page_size == PAGE_BYTES);
+        if (sb->tier_pages != pages_tier_size()) {
+            fprintf(stderr, "image has %d pages on the fast tier; got %d\n",
+                    sb->tier_pages, pages_tier_size());
+            abort();
+        }
+        return 0;
+    }
+
+    // images from before the superblock already have a root inode
+    int fresh = !bitmap_get(get_inode_bitmap(), 0);
+    memset(sb, 0, sizeof(superblock));
+    sb->magic = NUFS_MAGIC;
+    sb->version = NUFS_VERSION;
+    sb->stripe_members = members;
+    sb->stripe_pages = stripe;
+    sb->tier_pages = pages_tier_size();
+    sb->page_size = PAGE_BYTES;
+    if (fresh) {
+        sb->features = FEAT_VARDIRENT;
+    }
+    printf("+ superblock_init() -> %s\n", fresh ? "formatted" : "upgraded");
+    return fresh;
+}
@@ -0,0 +1,48 @@
+#ifndef SUPERBLOCK_H
+#define SUPERBLOCK_H
+
+#include <stdint.h>
+
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 1
+
+// the superblock lives at the end of the first 4K of page 0, after the
+// inode table, whatever the page size
+#define SUPERBLOCK_OFFSET (4096 - 256)
+
+// feature flags
+#define FEAT_VARDIRENT 0x1 // directories use variable-length entries
+#define FEAT_FRAGMENTS 0x2 // file tails may live in page fragments
+#define FEAT_SNAPSHOTS 0x4 // pages may be shared with snapshots
+#define FEAT_XATTRS    0x8 // inodes may have extended attributes
+
+// unlinked inodes waiting for the reclaimer
+#define ORPHAN_SLOTS 32
+
+typedef struct superblock {
+    uint32_t magic;
+    uint32_t version;
+    int      orphan_count;
+    int      orphans[ORPHAN_SLOTS];
+    int      stripe_members; // backing files the image is striped over
+    int      stripe_pages;   // stripe width
+    int      csum_page;      // page holding the per-page CRC32Cs, 0 if none
+    int      csum_valid;     // csum mode whose checksums were all written at
+                             // the last unmount, 0 if they can't be trusted
+    uint32_t features;       // FEAT_*
+    int      frag_page;      // page holding the fragment map, 0 if none
+    int      ag_count;       // allocation groups, see ag.h
+    int      tier_pages;     // pages on the fast tier, 0 if not tiered
+    int      page_size;      // bytes per page; 0 on older images, 4096
+    int      snap_page;      // page holding the snapshot list, 0 if none
+    int      change_page;    // page holding the per-page change generations
+    uint32_t change_gen;     // generation pages changing now are stamped with
+    int      change_clean;   // unmounted cleanly, so the stamps are complete
+    int      xattr_page;     // page holding the attribute table, 0 if none
+    char     _reserved[60];
+} superblock;
+
+superblock* get_superblock();
+int superblock_init();
+
+#endif
@@ -2,16 +2,28 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 79;
 use IO::Handle;
+require "syscall.ph";
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts) = @_;
+    $opts //= "";
+    system("(make mount OPTS='$opts' 2>&1) >> test.log &");
     sleep 1;
 }
 
 sub unmount {
     system("(make unmount 2>&1) >> test.log");
+    # the image is only complete once nufs has exited
+    system("while pgrep -x nufs > /dev/null; do sleep 0.1; done");
+}
+
+# while unmounted: start over on a new image, made with these options
+sub fresh {
+    my ($opts) = @_;
+    system("rm -f data.nufs");
+    mount($opts);
 }
 
 sub write_text {
@@ -31,6 +43,27 @@ sub read_text {
     return $data;
 }
 
+sub read_image {
+    open my $fh, "<:raw", "data.nufs" or return "";
+    local $/ = undef;
+    my $data = <$fh>;
+    close $fh;
+    return $data;
+}
+
+sub write_image {
+    my ($data) = @_;
+    open my $fh, "+<:raw", "data.nufs" or return;
+    print $fh $data;
+    close $fh;
+}
+
+# a 32-bit field of the superblock, which starts 3840 bytes in
+sub superblock_field {
+    my ($image, $offset) = @_;
+    return unpack("l", substr($image, 3840 + $offset, 4));
+}
+
 sub read_text_slice {
     my ($name, $count, $offset) = @_;
     open my $fh, "<", "mnt/$name" or return "";
@@ -41,6 +74,33 @@ sub read_text_slice {
     return $data;
 }
 
+# extended attributes, through the system calls; flags as for setxattr(2)
+sub set_xattr {
+    my ($name, $attr, $value, $flags) = @_;
+    return syscall(&SYS_setxattr, "mnt/$name", $attr, $value, length($value), $flags || 0) == 0;
+}
+
+sub get_xattr {
+    my ($name, $attr) = @_;
+    my $buf = "\0" x 4096;
+    my $len = syscall(&SYS_getxattr, "mnt/$name", $attr, $buf, length($buf));
+    return "" if $len < 0;
+    return substr($buf, 0, $len);
+}
+
+sub list_xattrs {
+    my ($name) = @_;
+    my $buf = "\0" x 4096;
+    my $len = syscall(&SYS_listxattr, "mnt/$name", $buf, length($buf));
+    return "" if $len < 0;
+    return join(" ", sort split(/\0/, substr($buf, 0, $len)));
+}
+
+sub remove_xattr {
+    my ($name, $attr) = @_;
+    return syscall(&SYS_removexattr, "mnt/$name", $attr) == 0;
+}
+
 system("rm -f data.nufs test.log");
 
 say "#           == Basic Tests ==";
@@ -188,3 +248,439 @@ my $mm = `ls mnt/numbers | wc -l`;
 ok($mm == 46, "deleted 4 files");
 
 unmount();
+
+say "#           == Access Times ==";
+
+fresh();
+write_text("atime.txt", "read me");
+my $past = 1000000000;
+utime $past, $past, "mnt/atime.txt";
+unmount();
+
+mount("-o noatime");
+read_text("atime.txt");
+unmount();
+mount();
+my $at0 = (stat "mnt/atime.txt")[8];
+say "# atime $at0";
+ok($at0 == $past, "noatime leaves the access time alone");
+unmount();
+
+# relatime, the default, updates an access time older than the
+# modification time; lazytime keeps it in memory until unmount
+mount("-o lazytime");
+read_text("atime.txt");
+unmount();
+mount();
+my $at1 = (stat "mnt/atime.txt")[8];
+say "# atime $at1";
+ok($at1 > $past, "lazytime stores the access time at unmount");
+unmount();
+
+say "#           == Defragmentation ==";
+
+# appends to two files in turn leave each in many short extents
+sub interleave {
+    my ($aa, $bb, $rounds) = @_;
+    for my $ii (1..$rounds) {
+        for my $name ($aa, $bb) {
+            open my $fh, ">>", "mnt/$name" or return;
+            print $fh ("$ii" x 4096);
+            close $fh;
+        }
+    }
+}
+
+sub defrag_wait {
+    system("./nufsctl mnt defrag >> test.log 2>&1");
+    for (1..50) {
+        last if `./nufsctl mnt defrag-status` =~ /running:\s+no/;
+        select(undef, undef, undef, 0.2);
+    }
+}
+
+fresh();
+interleave("frag1.dat", "frag2.dat", 6);
+my $frag0 = read_text("frag1.dat");
+defrag_wait();
+my $status = `./nufsctl mnt defrag-status`;
+my ($ext0, $ext1) = $status =~ /extents:\s+(\d+) -> (\d+)/;
+say "# extents $ext0 -> $ext1";
+ok($ext1 < $ext0, "Defrag joined extents.");
+unmount();
+mount();
+ok(read_text("frag1.dat") eq $frag0, "Defrag kept the contents.");
+unmount();
+
+say "#           == Orphans ==";
+
+# more than half the image, so a second one only fits once the first
+# one's pages are back
+my $big0 = "=This string is fourty characters long.=" x 15000;
+
+fresh();
+write_text("big1.dat", $big0);
+open my $bfh, "<", "mnt/big1.dat";
+system("rm -f mnt/big1.dat");
+ok(!-e "mnt/big1.dat", "Unlinked a file that is still open.");
+my $big1;
+{
+    local $/ = undef;
+    $big1 = <$bfh>;
+}
+$big1 =~ s/\s*$//;
+ok($big0 eq $big1, "Read an unlinked file through its open handle.");
+close $bfh;
+sleep 1;
+write_text("big2.dat", $big0);
+ok(read_text("big2.dat") eq $big0, "Pages came back once it was closed.");
+
+# left on the orphan list at unmount, reclaimed at the next mount
+system("rm -f mnt/big2.dat");
+unmount();
+mount();
+write_text("big3.dat", $big0);
+ok(read_text("big3.dat") eq $big0, "Pages came back after a remount.");
+unmount();
+
+say "#           == Checksums ==";
+
+fresh("-o csum=all");
+my $sum0 = "checksummed data " x 300;
+my $sum1 = "other data " x 300 . "end";
+write_text("sum1.txt", $sum0);
+write_text("sum2.txt", $sum1);
+unmount();
+
+# flip a byte of the first file behind nufs' back
+my $image = read_image();
+my $at = index($image, substr($sum0, 0, 1000));
+ok($at > 0, "Found the file in the image.");
+substr($image, $at + 100, 1) = "X";
+write_image($image);
+
+mount("-o csum=all");
+my $csum_err = 0;
+if (open my $cfh, "<", "mnt/sum1.txt") {
+    my $data;
+    $csum_err = !defined(sysread($cfh, $data, 8192)) && $!{EIO};
+    close $cfh;
+}
+ok($csum_err, "Reading a corrupted page fails with EIO.");
+ok(read_text("sum2.txt") eq $sum1, "Other files still read back.");
+unmount();
+
+say "#           == Directory Entries ==";
+
+fresh();
+my $lname = "a-name-well-past-the-old-forty-seven-byte-limit-" x 3;
+write_text($lname, "long name");
+ok(-f "mnt/$lname", "Created a file with a 144-byte name.");
+ok(read_text($lname) eq "long name", "Read back a file with a long name.");
+$files = `ls mnt`;
+ok($files =~ /\Q$lname\E/, "Long name is in the directory.");
+system("rm -f mnt/$lname");
+ok(!-e "mnt/$lname", "Deleted a file with a long name.");
+
+# names of every length, then holes of every size to refill
+system("mkdir mnt/dents");
+my %want;
+for my $ii (1..40) {
+    my $name = "n$ii-" . ("x" x ($ii * 3));
+    write_text("dents/$name", $ii);
+    $want{$name} = $ii;
+}
+for my $ii (grep { $_ % 2 } 1..40) {
+    my $name = "n$ii-" . ("x" x ($ii * 3));
+    system("rm -f 'mnt/dents/$name'");
+    delete $want{$name};
+}
+for my $ii (41..60) {
+    my $name = "m$ii-" . ("y" x (($ii - 40) * 2));
+    write_text("dents/$name", $ii);
+    $want{$name} = $ii;
+}
+my @have = sort split /\n/, `ls mnt/dents`;
+my @names = sort keys %want;
+ok("@have" eq "@names", "Refilled a directory after deletes.");
+my $right_vals = grep { read_text("dents/$_") == $want{$_} } @names;
+ok($right_vals == @names, "Read back the refilled directory.");
+unmount();
+
+# every directory in the format from before variable-length entries:
+# 64-byte records with the name in the first 48 bytes
+sub make_legacy {
+    my $image = read_image();
+    my @dirs = (0);
+    while (@dirs) {
+        my $inum = shift @dirs;
+        my $pnum = unpack("l", substr($image, 64 + 48 * $inum + 12, 4));
+        my $page = substr($image, 4096 * $pnum, 4096);
+        my $legacy = "";
+        for (my $off = 0; $off < 4096; ) {
+            my ($rec_len, $name_len, $type, $child) = unpack("S C C l", substr($page, $off, 8));
+            last if $rec_len == 0;
+            if ($name_len > 0) {
+                my $name = substr($page, $off + 8, $name_len);
+                $legacy .= pack("a48 l x12", $name, $child);
+                push @dirs, $child if $type == 4;
+            }
+            $off += $rec_len;
+        }
+        substr($image, 4096 * $pnum, 4096) = pack("a4096", $legacy);
+    }
+    # FEAT_VARDIRENT
+    my $features = superblock_field($image, 156);
+    substr($image, 3840 + 156, 4) = pack("l", $features & ~1);
+    write_image($image);
+}
+
+fresh();
+system("mkdir -p mnt/old/inner");
+write_text("old/one.txt", "legacy one");
+write_text("old/inner/two.txt", "legacy two");
+unmount();
+make_legacy();
+mount();
+ok(read_text("old/one.txt") eq "legacy one"
+   && read_text("old/inner/two.txt") eq "legacy two", "Upgraded a legacy directory.");
+write_text("old/" . $lname, "new entry");
+ok(read_text("old/" . $lname) eq "new entry", "Upgraded directory takes long names.");
+unmount();
+
+say "#           == Fragments ==";
+
+fresh();
+my @small = map { "small file $_ " x 25 . "end" } 1..6;
+for my $ii (0..5) {
+    write_text("small$ii.txt", $small[$ii]);
+}
+unmount();
+
+# six files of a few hundred bytes share one page in 512-byte pieces
+my $fimage = read_image();
+my %pages = map { int(index($fimage, $_) / 4096) => 1 } @small;
+my @fpages = keys %pages;
+say "# pages @fpages";
+ok(@fpages == 1 && $fpages[0] > 0, "Small files share a page.");
+
+mount();
+my $small_ok = grep { read_text("small$_.txt") eq $small[$_] } 0..5;
+ok($small_ok == 6, "Small files read back after a remount.");
+unmount();
+
+say "#           == Write Buffering ==";
+
+fresh();
+open my $wfh, ">", "mnt/buffered.txt";
+syswrite $wfh, "written, not yet closed";
+ok(read_text("buffered.txt") eq "written, not yet closed",
+   "A second handle reads buffered writes.");
+ok(-s "mnt/buffered.txt" == 23, "Buffered writes count in the size.");
+close $wfh;
+
+# fill the image; a small write then only fails when it is stored
+open my $ffh, ">", "mnt/fill.dat";
+my $chunk = "f" x 4096;
+my $filled = 0;
+while (defined(syswrite $ffh, $chunk)) {
+    $filled += 4096;
+    last if $filled > 2000000;
+}
+ok($!{ENOSPC}, "Filled the image.");
+close $ffh;
+
+open my $cfh, ">", "mnt/late1.dat";
+my $wrote = syswrite $cfh, "l" x 8192;
+my $closed = close $cfh;
+ok($wrote == 8192 && !$closed && $!{ENOSPC}, "close reports a buffered write that failed.");
+
+open my $sfh, ">", "mnt/late2.dat";
+$wrote = syswrite $sfh, "l" x 8192;
+my $synced = $sfh->sync;
+ok($wrote == 8192 && !$synced && $!{ENOSPC}, "fsync reports a buffered write that failed.");
+close $sfh;
+unmount();
+
+say "#           == Page Sizes ==";
+
+for my $bs (16384, 65536) {
+    fresh("-o blocksize=$bs");
+    write_text("40k.txt", $huge0);
+    write_text("one.txt", $msg0);
+    unmount();
+    ok(superblock_field(read_image(), 172) == $bs, "Formatted with $bs-byte pages.");
+
+    # the image keeps its page size without the option
+    mount();
+    ok((stat "mnt/40k.txt")[11] == $bs
+       && read_text("40k.txt") eq $huge0
+       && read_text("one.txt") eq $msg0, "Read back from $bs-byte pages.");
+    unmount();
+}
+
+say "#           == Space Map ==";
+
+sub spacemap {
+    my %map = `./nufsctl mnt spacemap` =~ /^(\w+):\s+(-?\d+)$/mg;
+    return \%map;
+}
+
+fresh();
+interleave("frag1.dat", "frag2.dat", 6);
+my $map1 = spacemap();
+say "# $map1->{extents} extents, $map1->{fragmented_files} fragmented";
+ok($map1->{files} == 2 && $map1->{file_pages} == 12, "Space map counts the files' pages.");
+ok($map1->{inode_1_extents} > 1, "Space map shows a file's extents.");
+defrag_wait();
+my $map2 = spacemap();
+say "# $map2->{extents} extents, $map2->{fragmented_files} fragmented";
+ok($map2->{extents} < $map1->{extents} && !exists $map2->{inode_1_extents},
+   "Defrag brought the file down to one extent.");
+unmount();
+
+say "#           == Snapshots ==";
+
+fresh();
+write_text("snap.txt", "before the snapshot");
+system("./nufsctl mnt snapshot snap1 >> test.log 2>&1");
+write_text("snap.txt", "after the snapshot");
+my $then = read_text(".snapshots/snap1/snap.txt");
+my $now = read_text("snap.txt");
+say "# '$then', '$now'";
+ok($then eq "before the snapshot" && $now eq "after the snapshot",
+   "Snapshot keeps the old contents.");
+
+my $opened = open my $snapfh, ">>", "mnt/.snapshots/snap1/snap.txt";
+ok(!$opened && $!{EROFS}, "Can't open a snapshot for writing.");
+
+system("./nufsctl mnt snapshot-delete snap1 >> test.log 2>&1");
+$files = `ls -a mnt`;
+ok($files !~ /\.snapshots/, "Deleted snapshot.");
+unmount();
+
+say "#           == Backups ==";
+
+# every file under mnt with its contents, one per line
+sub tree {
+    my @paths = sort split /\n/, `cd mnt && find . -type f`;
+    return join("\n", map { "$_=" . read_text($_) } @paths);
+}
+
+fresh();
+system("mkdir mnt/docs");
+write_text("docs/a.txt", "first version");
+write_text("40k.txt", $huge0);
+my $gen = `./nufs-backup export -m mnt data.nufs full.nbk 2>> test.log`;
+chomp $gen;
+write_text("docs/a.txt", "second version");
+write_text("docs/b.txt", "added later");
+system("rm -f mnt/40k.txt");
+system("./nufs-backup export -s $gen -m mnt data.nufs incr.nbk 2>> test.log > /dev/null");
+my $tree0 = tree();
+unmount();
+
+system("rm -f copy.nufs");
+ok(system("./nufs-backup apply full.nbk copy.nufs 2>> test.log") == 0
+   && system("./nufs-backup apply incr.nbk copy.nufs 2>> test.log") == 0,
+   "Applied a full and an incremental backup.");
+ok(system("./nufs-backup apply incr.nbk copy.nufs 2>> test.log") != 0,
+   "Refused a stream for another generation.");
+
+# the copy, mounted in the image's place
+rename "data.nufs", "orig.nufs";
+rename "copy.nufs", "data.nufs";
+mount();
+my $tree1 = tree();
+ok($tree1 eq $tree0, "The copy matches the backed-up tree.");
+unmount();
+rename "orig.nufs", "data.nufs";
+system("rm -f full.nbk incr.nbk");
+
+say "#           == Bulk operations ==";
+
+# the names nufsctl ls reports for a directory
+sub bulk_names {
+    my ($dir) = @_;
+    my @names = map { (split " ", $_, 5)[4] } split /\n/, `./nufsctl mnt/$dir ls`;
+    return join(",", sort @names);
+}
+
+# host files to import, named as given
+sub host_files {
+    my (%files) = @_;
+    system("rm -rf imp && mkdir imp");
+    for my $name (keys %files) {
+        open my $fh, ">", "imp/$name" or die;
+        print $fh $files{$name};
+        close $fh;
+    }
+}
+
+my $big = "0123456789" x 1000;
+fresh();
+system("mkdir mnt/bulk");
+host_files("one.txt" => $msg0, "two.txt" => "second file", "10k.txt" => $big);
+ok(system("./nufsctl mnt/bulk import imp/one.txt imp/two.txt imp/10k.txt 2>> test.log") == 0
+   && read_text("bulk/one.txt") eq $msg0 && read_text("bulk/two.txt") eq "second file"
+   && read_text("bulk/10k.txt") eq $big, "Imported three files.");
+
+my $ls = `./nufsctl mnt/bulk ls`;
+ok($ls =~ /^\s*\d+ 100644\s+1\s+11 two\.txt$/m && $ls =~ /\s10000 10k\.txt$/m,
+   "Bulk stat reports modes and sizes.");
+
+host_files("three.txt" => "third file", "one.txt" => "clash");
+ok(system("./nufsctl mnt/bulk import imp/three.txt imp/one.txt 2>> test.log") != 0
+   && bulk_names("bulk") eq "10k.txt,one.txt,two.txt" && read_text("bulk/one.txt") eq $msg0,
+   "An existing name fails the whole import.");
+
+open my $full, ">", "mnt/fill.dat" or die;
+while (syswrite($full, "f" x 4096)) {}
+close $full;
+host_files(map { ("full$_.dat" => "$_" x 4096) } (1..3));
+ok(system("./nufsctl mnt/bulk import imp/full1.dat imp/full2.dat imp/full3.dat 2>> test.log") != 0
+   && bulk_names("bulk") eq "10k.txt,one.txt,two.txt", "A full disk fails the whole import.");
+system("rm -f mnt/fill.dat");
+unmount();
+
+# the kernel has to look the name up again to see what the import added
+mount("-o cache=short");
+my $late0 = -e "mnt/bulk/late.txt";
+host_files("late.txt" => "imported late");
+system("./nufsctl mnt/bulk import imp/late.txt 2>> test.log");
+ok(!$late0 && read_text("bulk/late.txt") eq "imported late",
+   "A name looked up before an import shows up after it.");
+system("rm -rf imp");
+unmount();
+
+say "#           == Extended Attributes ==";
+
+# a short value fits the inode's slot, a long one takes an overflow page
+my $short0 = "blue";
+my $long3 = "=This string is fourty characters long.=" x 3;
+fresh();
+write_text("attrs.txt", "has attributes");
+set_xattr("attrs.txt", "user.color", $short0);
+set_xattr("attrs.txt", "user.notes", $long3);
+ok(get_xattr("attrs.txt", "user.color") eq $short0, "Read back short attribute.");
+ok(get_xattr("attrs.txt", "user.notes") eq $long3, "Read back long attribute.");
+
+my $names = list_xattrs("attrs.txt");
+say "# '$names'";
+ok($names eq "user.color user.notes", "Listed attributes.");
+
+# XATTR_CREATE is 1
+my $made = set_xattr("attrs.txt", "user.color", "red", 1);
+ok(!$made && $!{EEXIST}, "XATTR_CREATE on an existing name fails");
+
+set_xattr("attrs.txt", "user.gone", "soon");
+remove_xattr("attrs.txt", "user.gone");
+ok(list_xattrs("attrs.txt") eq $names, "Removed attribute.");
+
+unmount();
+mount();
+
+ok(get_xattr("attrs.txt", "user.color") eq $short0, "Short attribute after remount.");
+ok(get_xattr("attrs.txt", "user.notes") eq $long3, "Long attribute after remount.");
+
+unmount();
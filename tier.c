@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "tier.h"
+#include "storage.h"
+#include "inode.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "csum.h"
+#include "snapshot.h"
+#include "util.h"
+#include "fs.h"
+
+// seconds between migration passes
+#define TIER_INTERVAL 2
+// most pages moved in one pass, so a pass holds the lock only briefly
+#define TIER_BATCH 32
+// heat at which a page on the slow tier is worth promoting
+#define TIER_HOT 4
+// part of the fast tier kept free for new metadata and hot pages
+#define TIER_RESERVE_DIV 8
+
+#define tier_thread   (nufs_cur->tier.tier_thread)
+#define tier_mutex    (nufs_cur->tier.tier_mutex)
+#define tier_cond     (nufs_cur->tier.tier_cond)
+#define tier_running  (nufs_cur->tier.tier_running)
+#define tier_stopping (nufs_cur->tier.tier_stopping)
+#define heat          (nufs_cur->tier.heat)
+#define promoted      (nufs_cur->tier.promoted)
+#define demoted       (nufs_cur->tier.demoted)
+#define owners        (nufs_cur->tier.owners)
+
+// note an access to a page; called with the storage lock held
+void
+tier_touch(int pnum)
+{
+    if (pages_tier_size() > 0 && heat[pnum] < 255) {
+        heat[pnum]++;
+    }
+}
+
+static void
+map_owners()
+{
+    for (int pn = 0; pn < PAGE_COUNT; ++pn) {
+        owners[pn].inum = -1;
+    }
+    for (int inum = 0; inum < INODE_COUNT; ++inum) {
+        inode* node = get_inode(inum);
+        if (!bitmap_get(get_inode_bitmap(), inum) || node->refs == 0) {
+            continue;
+        }
+        if (node->iptr != 0) {
+            owners[node->iptr] = (owner){ inum, -1 };
+        }
+        // directories keep their entry page at size 0
+        int pages = S_ISDIR(node->mode) ? 1 : bytes_to_pages(node->size);
+        for (int fpn = 0; fpn < pages; ++fpn) {
+            // fragment pages are shared, and stay where they are
+            int pn = inode_get_pnum(node, fpn);
+            if (pn > 0) {
+                owners[pn] = (owner){ inum, fpn };
+            }
+        }
+    }
+}
+
+static int
+is_meta(owner* ow)
+{
+    return ow->fpn == -1 || S_ISDIR(get_inode(ow->inum)->mode);
+}
+
+// a free page in [lo, hi), 0 if there is none
+static int
+free_in(int lo, int hi)
+{
+    for (int pn = lo; pn < hi; ++pn) {
+        if (pages_available(pn)) {
+            return pn;
+        }
+    }
+    return 0;
+}
+
+static int
+free_count(int lo, int hi)
+{
+    int count = 0;
+    for (int pn = lo; pn < hi; ++pn) {
+        count += pages_available(pn);
+    }
+    return count;
+}
+
+static void
+move_page(int from, int to)
+{
+    pages_move(from, to);
+    csum_move(from, to);
+    inode* node = get_inode(owners[from].inum);
+    if (owners[from].fpn == -1) {
+        node->iptr = to;
+    }
+    else {
+        inode_set_pnum(node, owners[from].fpn, to);
+    }
+    heat[to] = heat[from];
+    heat[from] = 0;
+    owners[to] = owners[from];
+    owners[from].inum = -1;
+}
+
+// the coldest file data page in [lo, hi) below max_heat, 0 if none
+static int
+coldest_data(int lo, int hi, int max_heat)
+{
+    int best = 0;
+    for (int pn = lo; pn < hi; ++pn) {
+        if (owners[pn].inum >= 0 && !is_meta(&owners[pn]) && heat[pn] < max_heat
+            && (best == 0 || heat[pn] < heat[best])) {
+            best = pn;
+        }
+    }
+    return best;
+}
+
+// the hottest file data page in [lo, hi) of at least min_heat, 0 if none
+static int
+hottest_data(int lo, int hi, int min_heat)
+{
+    int best = 0;
+    for (int pn = lo; pn < hi; ++pn) {
+        if (owners[pn].inum >= 0 && !is_meta(&owners[pn]) && heat[pn] >= min_heat
+            && (best == 0 || heat[pn] > heat[best])) {
+            best = pn;
+        }
+    }
+    return best;
+}
+
+// push one cold page out of the fast tier; returns 0 if none could go
+static int
+demote_one(int max_heat)
+{
+    int fast = pages_tier_size();
+    int from = coldest_data(1, fast, max_heat);
+    int to = free_in(fast, PAGE_COUNT);
+    if (from == 0 || to == 0) {
+        return 0;
+    }
+    move_page(from, to);
+    demoted++;
+    return 1;
+}
+
+// one migration pass; called with the storage lock held
+static void
+tier_pass()
+{
+    int fast = pages_tier_size();
+    int reserve = max(1, fast / TIER_RESERVE_DIV);
+    int moved = 0;
+    int before_p = promoted;
+    int before_d = demoted;
+    if (snap_count() > 0) {
+        // snapshots point at pages where they are; nothing moves until
+        // they are gone
+        return;
+    }
+    map_owners();
+
+    // directory and indirect pages belong on the fast tier, hot or not
+    for (int pn = fast; pn < PAGE_COUNT && moved < TIER_BATCH; ++pn) {
+        if (owners[pn].inum < 0 || !is_meta(&owners[pn])) {
+            continue;
+        }
+        if (free_count(1, fast) == 0) {
+            if (!demote_one(256)) {
+                break;
+            }
+            moved++;
+        }
+        move_page(pn, free_in(1, fast));
+        promoted++;
+        moved++;
+    }
+
+    // keep some of the fast tier free
+    while (moved < TIER_BATCH && free_count(1, fast) < reserve) {
+        if (!demote_one(256)) {
+            break;
+        }
+        moved++;
+    }
+
+    // bring hot pages in, displacing pages that have gone much colder
+    while (moved < TIER_BATCH) {
+        int from = hottest_data(fast, PAGE_COUNT, TIER_HOT);
+        if (from == 0) {
+            break;
+        }
+        if (free_count(1, fast) <= reserve) {
+            if (!demote_one(heat[from] / 2)) {
+                break;
+            }
+            moved++;
+        }
+        move_page(from, free_in(1, fast));
+        promoted++;
+        moved++;
+    }
+
+    for (int pn = 0; pn < PAGE_COUNT; ++pn) {
+        heat[pn] >>= 1;
+    }
+    if (moved > 0) {
+        printf("+ tier: promoted %d, demoted %d\n", promoted - before_p, demoted - before_d);
+    }
+}
+
+static void*
+tier_main(void* arg)
+{
+    storage_bind(arg);
+    // stay out of the way of the FUSE workers
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    for (;;) {
+        pthread_mutex_lock(&tier_mutex);
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += TIER_INTERVAL;
+        while (!tier_stopping
+               && pthread_cond_timedwait(&tier_cond, &tier_mutex, &until) == 0) {
+        }
+        int stop = tier_stopping;
+        pthread_mutex_unlock(&tier_mutex);
+        if (stop) {
+            return 0;
+        }
+
+        storage_lock(nufs_cur);
+        tier_pass();
+        storage_unlock(nufs_cur);
+    }
+}
+
+// start the migrator if the image is tiered
+void
+tier_start()
+{
+    if (pages_tier_size() == 0) {
+        return;
+    }
+    pthread_mutex_init(&tier_mutex, 0);
+    pthread_cond_init(&tier_cond, 0);
+    tier_stopping = 0;
+    int rv = pthread_create(&tier_thread, 0, tier_main, nufs_cur);
+    tier_running = (rv == 0);
+}
+
+// called with the storage lock held, which is dropped while waiting
+void
+tier_stop()
+{
+    if (!tier_running) {
+        return;
+    }
+    pthread_mutex_lock(&tier_mutex);
+    tier_stopping = 1;
+    pthread_cond_signal(&tier_cond);
+    pthread_mutex_unlock(&tier_mutex);
+
+    storage_unlock(nufs_cur);
+    pthread_join(tier_thread, 0);
+    storage_lock(nufs_cur);
+    tier_running = 0;
+    pthread_mutex_destroy(&tier_mutex);
+    pthread_cond_destroy(&tier_cond);
+}
@@ -0,0 +1,38 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pages.h"
+
+// Two-tier images (-o tier=N): pages below N are on a fast backing file,
+// the rest on a slow one. Reads and writes heat up the pages they touch,
+// and a background migrator moves hot file pages and all directory and
+// indirect pages to the fast tier, and cold file pages out of it when it
+// runs short of room.
+// what refers to a page: a file page of inode inum, or its indirect page
+// when fpn is -1; inum is -1 for pages no inode points at
+typedef struct owner {
+    int inum;
+    int fpn;
+} owner;
+
+typedef struct tier_state {
+    pthread_t       tier_thread;
+    pthread_mutex_t tier_mutex;
+    pthread_cond_t  tier_cond;
+    int             tier_running;
+    int             tier_stopping;
+    // protected by the storage lock
+    uint8_t         heat[MAX_PAGE_COUNT]; // accesses per page, halved every pass
+    int             promoted;
+    int             demoted;
+    owner           owners[MAX_PAGE_COUNT]; // rebuilt every pass
+} tier_state;
+
+void tier_start();
+void tier_stop();
+void tier_touch(int pnum);
+
+#endif
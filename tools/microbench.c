@@ -0,0 +1,512 @@
+// microbench: time the engine's hot primitives in isolation
+//
+//   microbench [-r reps] [-b blocksize] [-o results.json]
+//              [-c baseline.json] [-t threshold%]
+//
+// Links the engine objects directly and calls bitmap_*, alloc_page,
+// alloc_inode, s_split, tree_lookup, directory_lookup and inode_get_pnum
+// in tight loops on scratch images. The engine is built into it with
+// its traces compiled out (tools/notrace.h), so they aren't timed too.
+// Each case is warmed up and sized to run for a few milliseconds per
+// batch, then timed over reps batches; the median batch gives ns/op, and
+// cycles/op where a cycle counter can be read (x86 TSC, which ticks at a
+// fixed rate).
+//
+// A table goes to stderr and the results as JSON to stdout, or to the
+// file given with -o. With -c, each case is also compared against the
+// same case in an earlier run's JSON, and the exit status is 1 if any
+// got slower by more than the threshold (default 10%).
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#else
+#define HAVE_CYCLES 0
+#endif
+
+#include "storage.h"
+#include "pages.h"
+#include "inode.h"
+#include "directory.h"
+#include "bitmap.h"
+#include "slist.h"
+#include "util.h"
+
+#define MAX_CASES 32
+// a batch runs at least this long, so timer overhead doesn't count
+#define BATCH_NS  (5 * 1000 * 1000)
+#define MAX_DEPTH 8
+#define DIR_NAMES 32
+#define FILE_PAGES 40
+
+typedef struct result {
+    char   name[48];
+    long   iters;   // per batch
+    double ns;      // median per op
+    double ns_min;
+    double cycles;  // median per op, -1 if unknown
+} result;
+
+static result results[MAX_CASES];
+static int    nresults;
+static int    reps = 9;
+
+static nufs_fs* fs;
+static const char* image = "microbench.nufs";
+static int page_size = 4096;
+
+// keeps the compiler from dropping the calls being timed
+static volatile long sink;
+
+// what the case being run works on
+static void*       bench_bm;
+static const char* bench_path;
+static const char* bench_name;
+static inode*      bench_node;
+static int         bench_first;
+static int         bench_count;
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: microbench [-r reps] [-b blocksize] [-o results.json]\n"
+                    "                  [-c baseline.json] [-t threshold%%]\n");
+    exit(1);
+}
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+cycles()
+{
+#if HAVE_CYCLES
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int
+by_value(const void* aa, const void* bb)
+{
+    double xx = *(const double*)aa;
+    double yy = *(const double*)bb;
+    return (xx > yy) - (xx < yy);
+}
+
+// time fn: double the batch until it runs BATCH_NS (which also warms up
+// caches and branch predictors), run one more untimed, then take reps
+static void
+bench(const char* name, void (*fn)(long))
+{
+    long iters = 16;
+    for (;;) {
+        uint64_t t0 = now_ns();
+        fn(iters);
+        if (now_ns() - t0 >= BATCH_NS || iters >= (1L << 30)) {
+            break;
+        }
+        iters *= 2;
+    }
+    fn(iters);
+
+    double ns[reps];
+    double cyc[reps];
+    for (int ii = 0; ii < reps; ++ii) {
+        uint64_t c0 = cycles();
+        uint64_t t0 = now_ns();
+        fn(iters);
+        uint64_t t1 = now_ns();
+        uint64_t c1 = cycles();
+        ns[ii] = (double)(t1 - t0) / iters;
+        cyc[ii] = (double)(c1 - c0) / iters;
+    }
+    qsort(ns, reps, sizeof(double), by_value);
+    qsort(cyc, reps, sizeof(double), by_value);
+
+    result* rr = &results[nresults++];
+    snprintf(rr->name, sizeof(rr->name), "%s", name);
+    rr->iters = iters;
+    rr->ns = ns[reps / 2];
+    rr->ns_min = ns[0];
+    rr->cycles = HAVE_CYCLES ? cyc[reps / 2] : -1;
+    fprintf(stderr, "%-28s %10.2f ns/op %10.2f min", rr->name, rr->ns, rr->ns_min);
+    if (HAVE_CYCLES) {
+        fprintf(stderr, " %10.1f cycles/op", rr->cycles);
+    }
+    fprintf(stderr, "\n");
+}
+
+// a fresh scratch image, bound to this thread
+static void
+open_image()
+{
+    unlink(image);
+    fs = storage_new();
+    storage_set_page_size(fs, page_size);
+    storage_init(fs, image);
+}
+
+static void
+close_image()
+{
+    storage_free(fs);
+    fs = NULL;
+    unlink(image);
+}
+
+// ---- bitmaps
+
+static void
+run_bitmap_get(long iters)
+{
+    long sum = 0;
+    for (long ii = 0; ii < iters; ++ii) {
+        sum += bitmap_get(bench_bm, ii & (MAX_PAGE_COUNT - 1));
+    }
+    sink = sum;
+}
+
+static void
+run_bitmap_put(long iters)
+{
+    for (long ii = 0; ii < iters; ++ii) {
+        bitmap_put(bench_bm, ii & (MAX_PAGE_COUNT - 1), ii & 1);
+    }
+}
+
+static void
+bench_bitmaps()
+{
+    static uint8_t bm[MAX_PAGE_COUNT / 8];
+    bench_bm = bm;
+    bench("bitmap_get", run_bitmap_get);
+    bench("bitmap_put", run_bitmap_put);
+}
+
+// ---- allocation at fill levels; each op takes a page or inode and
+// gives it back, so the fill level stays put
+
+static void
+run_alloc_page(long iters)
+{
+    for (long ii = 0; ii < iters; ++ii) {
+        int pn = alloc_page();
+        free_page(pn);
+    }
+}
+
+static void
+run_alloc_inode(long iters)
+{
+    for (long ii = 0; ii < iters; ++ii) {
+        int inum = alloc_inode();
+        free_inode(inum);
+    }
+}
+
+// take everything, then hand back a random selection until pct of the
+// items are in use, so the free ones are scattered
+static int
+fill(int* taken, int (*take)(), void (*give)(int), int pct)
+{
+    int count = 0;
+    int item;
+    while ((item = take()) >= 0) {
+        taken[count++] = item;
+    }
+    int keep = count * pct / 100;
+    while (count > keep) {
+        int ii = rand() % count;
+        give(taken[ii]);
+        taken[ii] = taken[--count];
+    }
+    return count;
+}
+
+static void
+bench_alloc()
+{
+    static int taken[MAX_PAGE_COUNT + INODE_COUNT];
+    int levels[] = { 0, 50, 90 };
+    char name[48];
+
+    for (int ll = 0; ll < 3; ++ll) {
+        open_image();
+        srand(1);
+        fill(taken, alloc_page, free_page, levels[ll]);
+        snprintf(name, sizeof(name), "alloc_page fill=%d%%", levels[ll]);
+        bench(name, run_alloc_page);
+        close_image();
+    }
+    for (int ll = 0; ll < 3; ++ll) {
+        open_image();
+        srand(1);
+        fill(taken, alloc_inode, free_inode, levels[ll]);
+        snprintf(name, sizeof(name), "alloc_inode fill=%d%%", levels[ll]);
+        bench(name, run_alloc_inode);
+        close_image();
+    }
+}
+
+// ---- paths and directories
+
+static void
+run_s_split(long iters)
+{
+    for (long ii = 0; ii < iters; ++ii) {
+        slist* parts = s_split(bench_path, '/');
+        sink = (long)parts;
+        s_free(parts);
+    }
+}
+
+static void
+run_tree_lookup(long iters)
+{
+    long sum = 0;
+    for (long ii = 0; ii < iters; ++ii) {
+        sum += tree_lookup(bench_path);
+    }
+    sink = sum;
+}
+
+static void
+run_dir_lookup(long iters)
+{
+    long sum = 0;
+    for (long ii = 0; ii < iters; ++ii) {
+        sum += directory_lookup(bench_node, bench_name);
+    }
+    sink = sum;
+}
+
+static void
+bench_paths()
+{
+    open_image();
+    char path[256] = "";
+    char name[48];
+    int depths[] = { 1, 4, 8 };
+    int dd = 0;
+    for (int depth = 1; depth <= MAX_DEPTH; ++depth) {
+        strcat(path, "/subdir");
+        storage_mknod(fs, path, 040755);
+        if (depth != depths[dd]) {
+            continue;
+        }
+        bench_path = path;
+        snprintf(name, sizeof(name), "s_split depth=%d", depth);
+        bench(name, run_s_split);
+        snprintf(name, sizeof(name), "tree_lookup depth=%d", depth);
+        bench(name, run_tree_lookup);
+        dd++;
+    }
+
+    // a directory of DIR_NAMES entries, all links to one file
+    storage_mknod(fs, "/dir", 040755);
+    storage_mknod(fs, "/dir/entry_00", 0100644);
+    for (int ii = 1; ii < DIR_NAMES; ++ii) {
+        snprintf(path, sizeof(path), "/dir/entry_%02d", ii);
+        storage_link(fs, "/dir/entry_00", path);
+    }
+    bench_node = get_inode(tree_lookup("/dir"));
+    bench_name = "entry_16";
+    bench("directory_lookup hit", run_dir_lookup);
+    bench_name = "no_such_entry";
+    bench("directory_lookup miss", run_dir_lookup);
+    close_image();
+}
+
+// ---- block maps
+
+static void
+run_get_pnum(long iters)
+{
+    long sum = 0;
+    for (long ii = 0; ii < iters; ++ii) {
+        sum += inode_get_pnum(bench_node, bench_first + ii % bench_count);
+    }
+    sink = sum;
+}
+
+static void
+bench_blockmap()
+{
+    open_image();
+    storage_mknod(fs, "/file", 0100644);
+    // with big pages the image holds fewer than FILE_PAGES; leave room
+    // for the indirect page
+    int free_pages, runs, largest;
+    pages_free_stats(&free_pages, &runs, &largest);
+    int pages = min(FILE_PAGES, free_pages - 1);
+    size_t size = (size_t)pages * PAGE_BYTES;
+    char* buf = calloc(1, size);
+    int rv = storage_write(fs, "/file", buf, size, 0, NULL);
+    free(buf);
+    if (pages < 3 || rv != (int)size) {
+        fprintf(stderr, "blockmap: couldn't write a %d page file (%d)\n", pages, rv);
+        exit(1);
+    }
+    bench_node = get_inode(tree_lookup("/file"));
+
+    bench_first = 0;
+    bench_count = 2;
+    bench("inode_get_pnum direct", run_get_pnum);
+    bench_first = 2;
+    bench_count = pages - 2;
+    bench("inode_get_pnum indirect", run_get_pnum);
+    close_image();
+}
+
+// ---- output and comparison
+
+static void
+write_json(FILE* out)
+{
+    fprintf(out, "{\n  \"page_size\": %d,\n  \"reps\": %d,\n  \"results\": [\n",
+            page_size, reps);
+    for (int ii = 0; ii < nresults; ++ii) {
+        result* rr = &results[ii];
+        fprintf(out, "    { \"name\": \"%s\", \"iters\": %ld, \"ns_per_op\": %.3f, "
+                     "\"ns_min\": %.3f, \"cycles_per_op\": ",
+                rr->name, rr->iters, rr->ns, rr->ns_min);
+        if (rr->cycles < 0) {
+            fprintf(out, "null }");
+        }
+        else {
+            fprintf(out, "%.1f }", rr->cycles);
+        }
+        fprintf(out, "%s\n", (ii + 1 < nresults) ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+// the ns_per_op a baseline file gives a case, or -1; only reads what
+// write_json writes
+static double
+baseline_ns(const char* json, const char* name)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\"name\": \"%.47s\"", name);
+    const char* at = strstr(json, key);
+    if (at == NULL) {
+        return -1;
+    }
+    at = strstr(at, "\"ns_per_op\":");
+    if (at == NULL) {
+        return -1;
+    }
+    return strtod(at + strlen("\"ns_per_op\":"), NULL);
+}
+
+static int
+compare(const char* path, double threshold)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    rewind(file);
+    char* json = malloc(len + 1);
+    len = fread(json, 1, len, file);
+    json[len] = 0;
+    fclose(file);
+
+    int regressions = 0;
+    fprintf(stderr, "\ncompared with %s (threshold %.0f%%):\n", path, threshold);
+    for (int ii = 0; ii < nresults; ++ii) {
+        result* rr = &results[ii];
+        double base = baseline_ns(json, rr->name);
+        if (base <= 0) {
+            fprintf(stderr, "%-28s %10s\n", rr->name, "new");
+            continue;
+        }
+        double change = (rr->ns - base) * 100 / base;
+        int bad = change > threshold;
+        regressions += bad;
+        fprintf(stderr, "%-28s %10.2f -> %8.2f ns/op %+7.1f%%%s\n",
+                rr->name, base, rr->ns, change, bad ? "  REGRESSION" : "");
+    }
+    free(json);
+    return regressions;
+}
+
+int
+main(int argc, char* argv[])
+{
+    const char* out_path = NULL;
+    const char* base_path = NULL;
+    double threshold = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:o:c:t:")) != -1) {
+        switch (opt) {
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'b':
+            page_size = atoi(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'c':
+            base_path = optarg;
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || reps < 1) {
+        usage();
+    }
+    if (page_size != 4096 && page_size != 16384 && page_size != 65536) {
+        fprintf(stderr, "blocksize must be 4096, 16384 or 65536\n");
+        return 1;
+    }
+
+    // the engine logs every operation to stdout, so keep the real one
+    // for the JSON and silence the rest
+    FILE* out = out_path ? fopen(out_path, "w") : fdopen(dup(1), "w");
+    if (out == NULL) {
+        perror(out_path);
+        return 1;
+    }
+    freopen("/dev/null", "w", stdout);
+
+    bench_bitmaps();
+    bench_alloc();
+    bench_paths();
+    bench_blockmap();
+
+    write_json(out);
+    fclose(out);
+
+    if (base_path != NULL) {
+        int bad = compare(base_path, threshold);
+        if (bad != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
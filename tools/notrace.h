@@ -0,0 +1,15 @@
+// Forced in ahead of the engine's sources (-include) when they are built
+// into a benchmark: the "+ ..." trace every primitive prints would
+// otherwise be most of what gets timed. The call is never made, but its
+// arguments still count as used.
+
+#ifndef NUFS_NOTRACE_H
+#define NUFS_NOTRACE_H
+
+// ahead of the first system header, as the engine's sources expect
+#define _GNU_SOURCE
+#include <stdio.h>
+
+#define printf(...) ((void)(0 && printf(__VA_ARGS__)))
+
+#endif
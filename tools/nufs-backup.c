@@ -0,0 +1,325 @@
+// nufs-backup: incremental image backups from the page change generations
+//
+//   nufs-backup export [-s gen] [-m mountpoint] <image> <stream>
+//   nufs-backup apply <stream> <copy>
+//
+// export writes the pages of an image that changed after generation gen
+// to a stream, or every page in use without -s (a full backup). The
+// generation the stream ends at goes to stdout; pass it with -s the next
+// time. The image is opened in-process, or with -m read while mounted,
+// the changed pages coming from NUFS_IOC_CHANGES on the mountpoint. A
+// page that changes while it is being read also goes in the next stream,
+// so applying the streams in order converges on the image.
+//
+// apply writes a stream's pages into an older copy of the image, which
+// must be at the generation the stream starts from; a full stream makes
+// a new copy. Only single-file images can be exported this way.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "storage.h"
+#include "superblock.h"
+#include "bitmap.h"
+#include "crc32c.h"
+#include "nufs_ioctl.h"
+
+#define STREAM_MAGIC "NUFSINC1"
+
+// a stream is a stream_head, then count pages, each a page_head and
+// page_size bytes
+typedef struct stream_head {
+    char     magic[8];
+    uint32_t page_size;
+    uint32_t since;
+    uint32_t gen;
+    uint32_t count;
+} stream_head;
+
+typedef struct page_head {
+    uint32_t pnum;
+    uint32_t crc;   // CRC32C of the page
+} page_head;
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: nufs-backup export [-s gen] [-m mountpoint] <image> <stream>\n");
+    fprintf(stderr, "       nufs-backup apply <stream> <copy>\n");
+    exit(1);
+}
+
+static void
+die(const char* what)
+{
+    perror(what);
+    exit(1);
+}
+
+static int
+changed_count(nufs_changes* ch)
+{
+    int count = 0;
+    for (int pn = 0; pn < ch->pages; ++pn) {
+        count += bitmap_get(ch->changed, pn);
+    }
+    return count;
+}
+
+static void
+write_head(FILE* out, nufs_changes* ch)
+{
+    stream_head head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, STREAM_MAGIC, 8);
+    head.page_size = ch->page_size;
+    head.since = ch->since;
+    head.gen = ch->gen;
+    head.count = changed_count(ch);
+    fwrite(&head, sizeof(head), 1, out);
+}
+
+static void
+write_page(FILE* out, int pnum, const void* data, int page_size)
+{
+    page_head ph = { pnum, crc32c(0, data, page_size) };
+    fwrite(&ph, sizeof(ph), 1, out);
+    fwrite(data, page_size, 1, out);
+}
+
+// the checksum mode the image was last unmounted with, so opening it
+// here keeps its checksums rather than turning them off
+static int
+image_csum(const char* image)
+{
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) {
+        die(image);
+    }
+    superblock sb;
+    if (pread(fd, &sb, sizeof(sb), SUPERBLOCK_OFFSET) != sizeof(sb)) {
+        die(image);
+    }
+    close(fd);
+    return sb.csum_valid;
+}
+
+// the image opened in-process, so it must not be mounted
+static void
+export_image(const char* image, nufs_changes* ch, FILE* out)
+{
+    nufs_fs* fs = storage_new();
+    storage_set_csum(fs, image_csum(image));
+    storage_init(fs, image);
+    storage_lock(fs);
+    int rv = storage_changes(fs, ch);
+    if (rv < 0) {
+        fprintf(stderr, "%s: %s\n", image, strerror(-rv));
+        exit(1);
+    }
+    if (ch->members != 1) {
+        fprintf(stderr, "%s: only single-file images can be backed up\n", image);
+        exit(1);
+    }
+    write_head(out, ch);
+    for (int pn = 0; pn < ch->pages; ++pn) {
+        if (bitmap_get(ch->changed, pn)) {
+            write_page(out, pn, pages_get_page(pn), ch->page_size);
+        }
+    }
+    storage_stop(fs);
+    storage_unlock(fs);
+    storage_free(fs);
+}
+
+// the image mounted at mnt: the pages are read from its file, where the
+// mapping the filesystem writes through is visible
+static void
+export_mounted(const char* mnt, const char* image, nufs_changes* ch, FILE* out)
+{
+    int mfd = open(mnt, O_RDONLY);
+    if (mfd < 0) {
+        die(mnt);
+    }
+    if (ioctl(mfd, NUFS_IOC_CHANGES, ch) != 0) {
+        die(mnt);
+    }
+    close(mfd);
+    if (ch->members != 1) {
+        fprintf(stderr, "%s: only single-file images can be backed up\n", image);
+        exit(1);
+    }
+
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) {
+        die(image);
+    }
+    char* page = malloc(ch->page_size);
+    write_head(out, ch);
+    for (int pn = 0; pn < ch->pages; ++pn) {
+        if (!bitmap_get(ch->changed, pn)) {
+            continue;
+        }
+        if (pread(fd, page, ch->page_size, (off_t)pn * ch->page_size) != ch->page_size) {
+            die(image);
+        }
+        write_page(out, pn, page, ch->page_size);
+    }
+    free(page);
+    close(fd);
+}
+
+static int
+do_export(int argc, char* argv[])
+{
+    int since = 0;
+    const char* mnt = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m:")) != -1) {
+        switch (opt) {
+        case 's':
+            since = atoi(optarg);
+            break;
+        case 'm':
+            mnt = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+    }
+    const char* image = argv[optind];
+    const char* stream = argv[optind + 1];
+
+    FILE* out = fopen(stream, "w");
+    if (out == NULL) {
+        die(stream);
+    }
+    // the engine logs every operation to stdout; the generation goes there
+    FILE* result = fdopen(dup(1), "w");
+    freopen("/dev/null", "w", stdout);
+
+    nufs_changes ch;
+    memset(&ch, 0, sizeof(ch));
+    ch.since = since;
+    if (mnt != NULL) {
+        export_mounted(mnt, image, &ch, out);
+    }
+    else {
+        export_image(image, &ch, out);
+    }
+    if (fclose(out) != 0) {
+        die(stream);
+    }
+    fprintf(stderr, "%s: %d pages changed after generation %d\n", image, changed_count(&ch), since);
+    fprintf(result, "%d\n", ch.gen);
+    fclose(result);
+    return 0;
+}
+
+static int
+do_apply(int argc, char* argv[])
+{
+    if (argc != 4) {
+        usage();
+    }
+    const char* stream = argv[2];
+    const char* copy = argv[3];
+
+    FILE* in = fopen(stream, "r");
+    if (in == NULL) {
+        die(stream);
+    }
+    stream_head head;
+    if (fread(&head, sizeof(head), 1, in) != 1 || memcmp(head.magic, STREAM_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a nufs backup stream\n", stream);
+        return 1;
+    }
+
+    // read and check it all before the copy is touched
+    size_t rec = sizeof(page_head) + head.page_size;
+    char* recs = malloc(rec * head.count);
+    if (fread(recs, rec, head.count, in) != head.count) {
+        fprintf(stderr, "%s: cut short\n", stream);
+        return 1;
+    }
+    fclose(in);
+    for (uint32_t ii = 0; ii < head.count; ++ii) {
+        page_head* ph = (page_head*)(recs + ii * rec);
+        if ((long)(ph->pnum + 1) * head.page_size > NUFS_SIZE
+            || crc32c(0, ph + 1, head.page_size) != ph->crc) {
+            fprintf(stderr, "%s: page %u is corrupt\n", stream, ph->pnum);
+            return 1;
+        }
+    }
+
+    int fd = open(copy, O_RDWR | (head.since == 0 ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        die(copy);
+    }
+    if (head.since == 0) {
+        if (ftruncate(fd, NUFS_SIZE) < 0) {
+            die(copy);
+        }
+    }
+    else {
+        struct stat st;
+        superblock sb;
+        if (fstat(fd, &st) < 0
+            || pread(fd, &sb, sizeof(sb), SUPERBLOCK_OFFSET) != sizeof(sb)) {
+            die(copy);
+        }
+        if (st.st_size != NUFS_SIZE || sb.magic != NUFS_MAGIC
+            || (sb.page_size ? sb.page_size : 4096) != (int)head.page_size) {
+            fprintf(stderr, "%s: not an image this stream applies to\n", copy);
+            return 1;
+        }
+        // a copy's page 0 was read after its generation ended
+        if (sb.change_gen != head.since + 1) {
+            fprintf(stderr, "%s: copy is at generation %u, stream follows %u\n",
+                    copy, sb.change_gen - 1, head.since);
+            return 1;
+        }
+    }
+
+    for (uint32_t ii = 0; ii < head.count; ++ii) {
+        page_head* ph = (page_head*)(recs + ii * rec);
+        if (pwrite(fd, ph + 1, head.page_size, (off_t)ph->pnum * head.page_size)
+            != head.page_size) {
+            die(copy);
+        }
+    }
+    if (fsync(fd) < 0) {
+        die(copy);
+    }
+    close(fd);
+    free(recs);
+    fprintf(stderr, "%s: %u pages applied, now at generation %u\n", copy, head.count, head.gen);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        usage();
+    }
+    if (strcmp(argv[1], "export") == 0) {
+        return do_export(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "apply") == 0) {
+        return do_apply(argc, argv);
+    }
+    usage();
+    return 1;
+}
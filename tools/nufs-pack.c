@@ -0,0 +1,370 @@
+// nufs-pack: build an image from a host directory tree
+//
+//   nufs-pack [-f] [-j threads] [-c off|meta|all] [-b blocksize] <srcdir> <image>
+//
+// Runs the engine in-process, so nothing goes through FUSE. Directories
+// are created first, breadth first; then files are stored in the same
+// order, each with a single write, so every file and the files of each
+// directory end up in consecutive pages and the image is filled front
+// to back. Source files are read by a pool of threads ahead of the
+// writer. Regular files, directories, symlinks and hard links are
+// packed, with their modes and times; anything else is skipped.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "storage.h"
+#include "directory.h"
+#include "csum.h"
+
+// files read ahead of the one being written, at most
+#define READ_AHEAD 64
+
+typedef struct entry {
+    char*       src;   // path on the host
+    char*       dst;   // path in the image
+    struct stat st;
+    const char* link;  // image path of an earlier hard link, or NULL
+    // filled in by the readers
+    char*       data;
+    ssize_t     len;
+    int         ready;
+} entry;
+
+static entry* ents;
+static int    nents;
+static int    cap;
+
+static nufs_fs* fs;
+
+// reader pool state
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cond = PTHREAD_COND_INITIALIZER;
+static int next_read;  // next entry a reader takes
+static int writing;    // entry the writer is at
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: nufs-pack [-f] [-j threads] [-c off|meta|all] [-b blocksize]"
+            " <srcdir> <image>\n");
+    exit(1);
+}
+
+static entry*
+add_entry(const char* src, const char* dst, struct stat* st)
+{
+    if (nents == cap) {
+        cap = cap ? cap * 2 : 256;
+        ents = realloc(ents, cap * sizeof(entry));
+    }
+    entry* ee = &ents[nents++];
+    memset(ee, 0, sizeof(entry));
+    ee->src = strdup(src);
+    ee->dst = strdup(dst);
+    ee->st = *st;
+    return ee;
+}
+
+// list the tree breadth first: each directory's entries follow each
+// other, subdirectories after their parent's files
+static void
+scan(const char* root)
+{
+    struct stat st;
+    if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s: not a directory\n", root);
+        exit(1);
+    }
+    add_entry(root, "/", &st);
+
+    for (int dd = 0; dd < nents; ++dd) {
+        if (!S_ISDIR(ents[dd].st.st_mode)) {
+            continue;
+        }
+        DIR* dir = opendir(ents[dd].src);
+        if (dir == NULL) {
+            perror(ents[dd].src);
+            continue;
+        }
+        struct dirent* de;
+        while ((de = readdir(dir)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+            if (strlen(de->d_name) > DIR_NAME) {
+                fprintf(stderr, "%s/%s: name too long, skipped\n", ents[dd].src, de->d_name);
+                continue;
+            }
+            char src[4096], dst[4096];
+            snprintf(src, sizeof(src), "%s/%s", ents[dd].src, de->d_name);
+            snprintf(dst, sizeof(dst), "%s%s%s", ents[dd].dst,
+                     (strcmp(ents[dd].dst, "/") == 0) ? "" : "/", de->d_name);
+            if (lstat(src, &st) < 0) {
+                perror(src);
+                continue;
+            }
+            if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) {
+                fprintf(stderr, "%s: not a file, directory or symlink, skipped\n", src);
+                continue;
+            }
+            add_entry(src, dst, &st);
+        }
+        closedir(dir);
+    }
+
+    // later names of a multiply-linked file become links to the first
+    for (int ii = 0; ii < nents; ++ii) {
+        entry* ee = &ents[ii];
+        if (!S_ISREG(ee->st.st_mode) || ee->st.st_nlink < 2) {
+            continue;
+        }
+        for (int jj = 0; jj < ii; ++jj) {
+            if (ents[jj].st.st_ino == ee->st.st_ino && ents[jj].st.st_dev == ee->st.st_dev
+                && ents[jj].link == NULL) {
+                ee->link = ents[jj].dst;
+                break;
+            }
+        }
+    }
+}
+
+static void
+read_entry(entry* ee)
+{
+    if (S_ISLNK(ee->st.st_mode)) {
+        ee->data = malloc(ee->st.st_size + 1);
+        ee->len = readlink(ee->src, ee->data, ee->st.st_size + 1);
+        return;
+    }
+    if (!S_ISREG(ee->st.st_mode) || ee->link != NULL) {
+        return;
+    }
+    int fd = open(ee->src, O_RDONLY);
+    if (fd < 0) {
+        ee->len = -1;
+        return;
+    }
+    ee->data = malloc(ee->st.st_size + 1);
+    ee->len = 0;
+    while (ee->len < ee->st.st_size) {
+        ssize_t got = read(fd, ee->data + ee->len, ee->st.st_size - ee->len);
+        if (got <= 0) {
+            break;
+        }
+        ee->len += got;
+    }
+    close(fd);
+}
+
+static void*
+reader(void* arg)
+{
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (next_read < nents && next_read >= writing + READ_AHEAD) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        if (next_read >= nents) {
+            break;
+        }
+        entry* ee = &ents[next_read++];
+        pthread_mutex_unlock(&lock);
+
+        read_entry(ee);
+
+        pthread_mutex_lock(&lock);
+        ee->ready = 1;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// wait for the readers to finish entry ii
+static entry*
+take(int ii)
+{
+    pthread_mutex_lock(&lock);
+    writing = ii;
+    pthread_cond_broadcast(&cond);
+    while (!ents[ii].ready) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return &ents[ii];
+}
+
+static void
+set_times(entry* ee)
+{
+    struct timespec ts[2] = { ee->st.st_atim, ee->st.st_mtim };
+    storage_set_time(fs, ee->dst, ts);
+}
+
+static void
+fail(entry* ee, const char* what, int rv)
+{
+    fprintf(stderr, "%s: %s: %s\n", ee->src, what, strerror(-rv));
+    exit(1);
+}
+
+// store one file or symlink; directories already exist
+static long
+pack(entry* ee)
+{
+    int rv;
+    if (ee->link != NULL) {
+        rv = storage_link(fs, ee->link, ee->dst);
+        if (rv < 0) {
+            fail(ee, "link", rv);
+        }
+        return 0;
+    }
+    if (ee->len < 0) {
+        fprintf(stderr, "%s: unreadable, skipped\n", ee->src);
+        return 0;
+    }
+
+    mode_t mode = S_ISLNK(ee->st.st_mode) ? 0120000 : (S_IFREG | (ee->st.st_mode & 0777));
+    rv = storage_mknod(fs, ee->dst, mode);
+    if (rv < 0) {
+        fail(ee, "create", rv);
+    }
+    if (ee->len > 0) {
+        rv = storage_write(fs, ee->dst, ee->data, ee->len, 0, NULL);
+        if (rv < ee->len) {
+            fail(ee, "write", rv < 0 ? rv : -ENOSPC);
+        }
+    }
+    set_times(ee);
+    return ee->len;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int force = 0;
+    int threads = 4;
+    int csum = CSUM_OFF;
+    int page_size = 4096;
+    int opt;
+    while ((opt = getopt(argc, argv, "fj:c:b:")) != -1) {
+        switch (opt) {
+        case 'f':
+            force = 1;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            if (strcmp(optarg, "off") == 0) {
+                csum = CSUM_OFF;
+            }
+            else if (strcmp(optarg, "meta") == 0) {
+                csum = CSUM_META;
+            }
+            else if (strcmp(optarg, "all") == 0) {
+                csum = CSUM_ALL;
+            }
+            else {
+                usage();
+            }
+            break;
+        case 'b':
+            page_size = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 2 || threads < 1) {
+        usage();
+    }
+    const char* src = argv[optind];
+    const char* image = argv[optind + 1];
+
+    if (access(image, F_OK) == 0) {
+        if (!force) {
+            fprintf(stderr, "%s exists; use -f to replace it\n", image);
+            return 1;
+        }
+        unlink(image);
+    }
+
+    fs = storage_new();
+    if (storage_set_page_size(fs, page_size) < 0) {
+        fprintf(stderr, "blocksize must be 4096, 16384 or 65536\n");
+        return 1;
+    }
+
+    scan(src);
+
+    pthread_t* pool = malloc(threads * sizeof(pthread_t));
+    for (int ii = 0; ii < threads; ++ii) {
+        pthread_create(&pool[ii], NULL, reader, NULL);
+    }
+
+    // the engine logs every operation to stdout; progress goes to stderr
+    freopen("/dev/null", "w", stdout);
+    storage_set_csum(fs, csum);
+    storage_init(fs, image);
+    storage_lock(fs);
+
+    // all directories first, so the files that follow are laid out
+    // without directory pages in between
+    int dirs = 0;
+    for (int ii = 1; ii < nents; ++ii) {
+        entry* ee = &ents[ii];
+        if (S_ISDIR(ee->st.st_mode)) {
+            int rv = storage_mknod(fs, ee->dst, 040000 | (ee->st.st_mode & 0777));
+            if (rv < 0) {
+                fail(ee, "mkdir", rv);
+            }
+            dirs++;
+        }
+    }
+
+    int files = 0;
+    long bytes = 0;
+    for (int ii = 1; ii < nents; ++ii) {
+        entry* ee = take(ii);
+        if (!S_ISDIR(ee->st.st_mode)) {
+            bytes += pack(ee);
+            files++;
+        }
+        free(ee->data);
+        ee->data = NULL;
+    }
+
+    // directory times last, after their contents stopped changing them
+    for (int ii = 0; ii < nents; ++ii) {
+        if (S_ISDIR(ents[ii].st.st_mode)) {
+            set_times(&ents[ii]);
+        }
+    }
+
+    storage_stop(fs);
+    storage_unlock(fs);
+    storage_free(fs);
+
+    pthread_mutex_lock(&lock);
+    writing = nents;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    for (int ii = 0; ii < threads; ++ii) {
+        pthread_join(pool[ii], NULL);
+    }
+    free(pool);
+
+    fprintf(stderr, "%s: %d directories, %d files, %ld bytes\n", image, dirs, files, bytes);
+    return 0;
+}
@@ -0,0 +1,247 @@
+// nufsctl: drive the nufs ioctls on a mounted filesystem
+//
+//   nufsctl <path> defrag [pages/s]
+//   nufsctl <path> defrag-status
+//   nufsctl <path> spacemap
+//   nufsctl <path> snapshot <name>
+//   nufsctl <path> snapshot-delete <name>
+//   nufsctl <dir> ls
+//   nufsctl <dir> import <file>...
+//
+// ls and import work on a whole directory with one ioctl per batch:
+// import creates the host files in <dir> under their base names, with
+// their contents, as many to a call as fit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "nufs_ioctl.h"
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: nufsctl <path> defrag [pages/s]\n");
+    fprintf(stderr, "       nufsctl <path> defrag-status\n");
+    fprintf(stderr, "       nufsctl <path> spacemap\n");
+    fprintf(stderr, "       nufsctl <path> snapshot <name>\n");
+    fprintf(stderr, "       nufsctl <path> snapshot-delete <name>\n");
+    fprintf(stderr, "       nufsctl <dir> ls\n");
+    fprintf(stderr, "       nufsctl <dir> import <file>...\n");
+    exit(1);
+}
+
+static void
+print_defrag_status(nufs_defrag_status* st)
+{
+    printf("running:      %s\n", st->running ? "yes" : "no");
+    printf("progress:     %d/%d files, %d pages moved\n",
+           st->files_done, st->files_total, st->pages_moved);
+    printf("extents:      %d -> %d\n", st->extents_before, st->extents_after);
+    printf("free runs:    %d -> %d\n", st->free_runs_before, st->free_runs_after);
+    printf("largest free: %d -> %d pages\n", st->largest_free_before, st->largest_free_after);
+}
+
+static void
+print_value(const char* key, int value)
+{
+    char label[64];
+    snprintf(label, sizeof(label), "%s:", key);
+    printf("%-18s%d\n", label, value);
+}
+
+// one "key: value" per line, so monitoring can scrape it
+static void
+print_spacemap(nufs_spacemap* sm)
+{
+    char key[64];
+    print_value("page_size", sm->page_size);
+    print_value("pages", sm->pages);
+    print_value("free_pages", sm->free_pages);
+    print_value("inodes", sm->inodes);
+    print_value("free_inodes", sm->free_inodes);
+    print_value("free_runs", sm->free_runs);
+    print_value("largest_free", sm->largest_free);
+    for (int bb = 0; bb < NUFS_SPACEMAP_BUCKETS; ++bb) {
+        snprintf(key, sizeof(key), "free_runs_%d", 1 << bb);
+        print_value(key, sm->run_hist[bb]);
+    }
+    print_value("files", sm->files);
+    print_value("file_pages", sm->file_pages);
+    print_value("extents", sm->extents);
+    print_value("fragmented_files", sm->fragmented_files);
+    print_value("free_frag", sm->free_frag);
+    print_value("file_frag", sm->file_frag);
+    for (int gg = 0; gg < sm->region_count; ++gg) {
+        nufs_spacemap_region* rr = &sm->regions[gg];
+        snprintf(key, sizeof(key), "region_%d_pages", gg);
+        print_value(key, rr->pages);
+        snprintf(key, sizeof(key), "region_%d_free", gg);
+        print_value(key, rr->free_pages);
+        snprintf(key, sizeof(key), "region_%d_inodes_free", gg);
+        print_value(key, rr->free_inodes);
+    }
+    for (int ii = 0; ii < NUFS_SPACEMAP_FILES; ++ii) {
+        if (sm->file_extents[ii] > 1) {
+            snprintf(key, sizeof(key), "inode_%d_extents", ii);
+            print_value(key, sm->file_extents[ii]);
+        }
+    }
+}
+
+static int
+do_ls(int fd)
+{
+    nufs_bulkstat* bs = calloc(1, sizeof(nufs_bulkstat));
+    do {
+        if (ioctl(fd, NUFS_IOC_BULKSTAT, bs) != 0) {
+            free(bs);
+            return -1;
+        }
+        char* rec = bs->buf;
+        for (int ii = 0; ii < bs->count; ++ii) {
+            nufs_bulk_stat* st = (nufs_bulk_stat*)rec;
+            printf("%6u %06o %3u %8lld %.*s\n", st->ino, st->mode, st->nlink,
+                   (long long)st->size, st->name_len, st->name);
+            rec += st->rec_len;
+        }
+    } while (bs->more);
+    free(bs);
+    return 0;
+}
+
+// send the files packed so far; names[ii] is record ii's host path
+static int
+flush_import(int fd, nufs_bulkcreate* bc, char** names)
+{
+    if (bc->count == 0) {
+        return 0;
+    }
+    int rv = ioctl(fd, NUFS_IOC_BULKCREATE, bc);
+    if (rv != 0 && bc->failed >= 0) {
+        fprintf(stderr, "%s: ", names[bc->failed]);
+    }
+    memset(bc, 0, sizeof(nufs_bulkcreate));
+    return rv;
+}
+
+static int
+do_import(int fd, int argc, char* argv[])
+{
+    nufs_bulkcreate* bc = calloc(1, sizeof(nufs_bulkcreate));
+    char** names = argv;
+    int used = 0;
+    int rv = 0;
+    for (int ii = 0; ii < argc && rv == 0; ++ii) {
+        FILE* in = fopen(argv[ii], "r");
+        if (in == NULL) {
+            perror(argv[ii]);
+            rv = -1;
+            break;
+        }
+        fseek(in, 0, SEEK_END);
+        long len = ftell(in);
+        rewind(in);
+        const char* base = strrchr(argv[ii], '/') ? strrchr(argv[ii], '/') + 1 : argv[ii];
+        int name_len = strlen(base);
+        int rec = (sizeof(nufs_bulk_file) + name_len + len + 7) & ~7;
+        if (rec > NUFS_BULK_BUF) {
+            fprintf(stderr, "%s: too big to import\n", argv[ii]);
+            fclose(in);
+            rv = -1;
+            break;
+        }
+        if (used + rec > NUFS_BULK_BUF) {
+            rv = flush_import(fd, bc, names);
+            names = argv + ii;
+            used = 0;
+            if (rv != 0) {
+                fclose(in);
+                break;
+            }
+        }
+        nufs_bulk_file* bf = (nufs_bulk_file*)(bc->buf + used);
+        bf->mode = 0100644;
+        bf->data_len = len;
+        bf->rec_len = rec;
+        bf->name_len = name_len;
+        memcpy(bf->name, base, name_len);
+        if (fread(bf->name + name_len, 1, len, in) != (size_t)len) {
+            perror(argv[ii]);
+            rv = -1;
+        }
+        fclose(in);
+        bc->count++;
+        used += rec;
+    }
+    if (rv == 0) {
+        rv = flush_import(fd, bc, names);
+    }
+    free(bc);
+    return rv;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 3) {
+        usage();
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    int rv;
+    if (strcmp(argv[2], "defrag") == 0) {
+        int rate = (argc > 3) ? atoi(argv[3]) : 0;
+        rv = ioctl(fd, NUFS_IOC_DEFRAG, &rate);
+    }
+    else if (strcmp(argv[2], "defrag-status") == 0) {
+        nufs_defrag_status st;
+        rv = ioctl(fd, NUFS_IOC_DEFRAG_STATUS, &st);
+        if (rv == 0) {
+            print_defrag_status(&st);
+        }
+    }
+    else if (strcmp(argv[2], "spacemap") == 0) {
+        nufs_spacemap sm;
+        rv = ioctl(fd, NUFS_IOC_SPACEMAP, &sm);
+        if (rv == 0) {
+            print_spacemap(&sm);
+        }
+    }
+    else if (strcmp(argv[2], "snapshot") == 0 || strcmp(argv[2], "snapshot-delete") == 0) {
+        if (argc < 4 || strlen(argv[3]) >= NUFS_SNAP_NAME) {
+            usage();
+        }
+        nufs_snapshot_arg sa;
+        memset(&sa, 0, sizeof(sa));
+        strcpy(sa.name, argv[3]);
+        int cmd = (strcmp(argv[2], "snapshot") == 0) ? NUFS_IOC_SNAPSHOT : NUFS_IOC_SNAPSHOT_DELETE;
+        rv = ioctl(fd, cmd, &sa);
+    }
+    else if (strcmp(argv[2], "ls") == 0) {
+        rv = do_ls(fd);
+    }
+    else if (strcmp(argv[2], "import") == 0) {
+        if (argc < 4) {
+            usage();
+        }
+        rv = do_import(fd, argc - 3, argv + 3);
+    }
+    else {
+        usage();
+    }
+
+    if (rv != 0) {
+        perror(argv[2]);
+    }
+    close(fd);
+    return rv != 0;
+}
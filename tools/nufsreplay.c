@@ -0,0 +1,439 @@
+// nufsreplay: run a recorded operation trace again and compare latencies
+//
+//   nufsreplay [-t] <trace> <image | mountpoint>
+//
+// A trace is recorded by mounting with -o trace=FILE. Given an image,
+// the calls are made in-process through libnufs; given a directory,
+// they become system calls on the files below it. Either way the target
+// should start out as the traced filesystem did (a copy of the image
+// taken before the traced mount), or return values will differ.
+//
+// Calls are replayed one at a time in the order they started, as fast as
+// possible, or with -t at the pace they were recorded. The report gives,
+// per operation, the recorded and replayed mean latency and how many
+// calls returned something other than they did when recorded.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "storage.h"
+#include "inode.h"
+#include "directory.h"
+#include "trace.h"
+
+// a file the trace had open, and what it is open as here
+typedef struct open_file {
+    uint64_t   fh;
+    nufs_file* nf;
+    int        fd;
+} open_file;
+
+typedef struct op_stats {
+    long     count;
+    uint64_t rec_ns;
+    uint64_t replay_ns;
+    long     mismatch;
+} op_stats;
+
+static nufs_fs*   fs;       // in-process target, or NULL
+static const char* mnt;     // mounted target, or NULL
+static open_file* files;
+static int        nfiles;
+static char*      buf;
+static size_t     buf_size;
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: nufsreplay [-t] <trace> <image | mountpoint>\n");
+    exit(1);
+}
+
+static open_file*
+find_file(uint64_t fh)
+{
+    for (int ii = 0; ii < nfiles; ++ii) {
+        if (files[ii].fh == fh) {
+            return &files[ii];
+        }
+    }
+    return NULL;
+}
+
+static void
+add_file(uint64_t fh, nufs_file* nf, int fd)
+{
+    files = realloc(files, (nfiles + 1) * sizeof(open_file));
+    files[nfiles].fh = fh;
+    files[nfiles].nf = nf;
+    files[nfiles].fd = fd;
+    ++nfiles;
+}
+
+static void
+drop_file(open_file* of)
+{
+    *of = files[--nfiles];
+}
+
+static char*
+data_buf(size_t size)
+{
+    if (size > buf_size) {
+        buf = realloc(buf, size);
+        memset(buf, 'r', size);
+        buf_size = size;
+    }
+    return buf;
+}
+
+// the path under the mountpoint; two can be in use at once
+static const char*
+mnt_path(const char* path, int which)
+{
+    static char paths[2][4096];
+    snprintf(paths[which], sizeof(paths[which]), "%s%s", mnt, path);
+    return paths[which];
+}
+
+// system calls report errors in errno, FUSE callbacks as -errno
+static int
+sys_rv(int rv)
+{
+    return (rv < 0) ? -errno : rv;
+}
+
+static int
+replay_mounted(trace_ev* ev)
+{
+    trace_rec* rec = &ev->rec;
+    const char* path = mnt_path(ev->path, 0);
+    const char* path2 = mnt_path(ev->path2, 1); // only for link and rename
+    open_file* of = find_file(rec->fh);
+    struct stat st;
+    int rv;
+
+    switch (rec->op) {
+    case TR_GETATTR:
+        return sys_rv(lstat(path, &st));
+    case TR_READDIR: {
+        DIR* dir = opendir(path);
+        if (dir == NULL) {
+            return -errno;
+        }
+        while (readdir(dir) != NULL) {
+        }
+        closedir(dir);
+        return 0;
+    }
+    case TR_MKNOD:
+        return sys_rv(mknod(path, rec->offset, 0));
+    case TR_MKDIR:
+        return sys_rv(mkdir(path, rec->offset));
+    case TR_UNLINK:
+        return sys_rv(unlink(path));
+    case TR_RMDIR:
+        return sys_rv(rmdir(path));
+    case TR_LINK:
+        return sys_rv(link(path, path2));
+    case TR_RENAME:
+        return sys_rv(rename(path, path2));
+    case TR_CHMOD:
+        return sys_rv(chmod(path, rec->offset));
+    case TR_TRUNCATE:
+        return sys_rv(truncate(path, rec->size));
+    case TR_OPEN:
+        rv = open(path, O_RDWR);
+        if (rv < 0 && errno == EACCES) {
+            rv = open(path, O_RDONLY);
+        }
+        if (rv >= 0) {
+            add_file(rec->fh, NULL, rv);
+            rv = 0;
+        }
+        return sys_rv(rv);
+    case TR_RELEASE:
+        if (of != NULL) {
+            close(of->fd);
+            drop_file(of);
+        }
+        return 0;
+    case TR_READ:
+        if (of == NULL) {
+            return -EBADF;
+        }
+        return sys_rv(pread(of->fd, data_buf(rec->size), rec->size, rec->offset));
+    case TR_WRITE:
+        if (of == NULL) {
+            return -EBADF;
+        }
+        return sys_rv(pwrite(of->fd, data_buf(rec->size), rec->size, rec->offset));
+    case TR_UTIMENS: {
+        struct timespec ts[2] = { { rec->offset, 0 }, { rec->size, 0 } };
+        return sys_rv(utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW));
+    }
+    case TR_FSYNC:
+        if (of == NULL) {
+            return -EBADF;
+        }
+        return sys_rv(fsync(of->fd));
+    case TR_READLINK:
+        return sys_rv(readlink(path, data_buf(rec->size), rec->size));
+    case TR_SYMLINK:
+        return sys_rv(symlink(ev->path2, path));
+    case TR_GETXATTR:
+        return sys_rv(lgetxattr(path, ev->path2, data_buf(rec->size), rec->size));
+    case TR_SETXATTR:
+        return sys_rv(lsetxattr(path, ev->path2, data_buf(rec->size), rec->size, rec->offset));
+    case TR_LISTXATTR:
+        return sys_rv(llistxattr(path, data_buf(rec->size), rec->size));
+    case TR_REMOVEXATTR:
+        return sys_rv(lremovexattr(path, ev->path2));
+    }
+    return -ENOSYS;
+}
+
+// the same calls nufs.c makes for each callback
+static int
+replay_inproc(trace_ev* ev)
+{
+    trace_rec* rec = &ev->rec;
+    open_file* of = find_file(rec->fh);
+    nufs_file* nf = of ? of->nf : NULL;
+    struct stat st;
+    int rv = -ENOSYS;
+
+    storage_lock(fs);
+    switch (rec->op) {
+    case TR_GETATTR:
+        rv = storage_stat(fs, ev->path, &st);
+        break;
+    case TR_READDIR: {
+        rv = tree_lookup(ev->path);
+        if (rv >= 0) {
+            inode* dd = get_inode(rv);
+            int pos = 0;
+            while (directory_next(dd, &pos) != NULL) {
+            }
+            rv = 0;
+        }
+        break;
+    }
+    case TR_MKNOD:
+        rv = storage_mknod(fs, ev->path, rec->offset);
+        break;
+    case TR_MKDIR:
+        rv = storage_mknod(fs, ev->path, 040000 + rec->offset);
+        break;
+    case TR_UNLINK:
+        rv = storage_unlink(fs, ev->path);
+        break;
+    case TR_RMDIR:
+        rv = -1;
+        break;
+    case TR_LINK:
+        rv = storage_link(fs, ev->path, ev->path2);
+        break;
+    case TR_RENAME:
+        rv = storage_rename(fs, ev->path, ev->path2);
+        break;
+    case TR_CHMOD:
+        rv = storage_chmod(fs, ev->path, rec->offset);
+        break;
+    case TR_TRUNCATE:
+        rv = storage_truncate(fs, ev->path, rec->size);
+        break;
+    case TR_OPEN:
+        nf = storage_open(fs, ev->path);
+        rv = -ENOENT;
+        if (nf != NULL) {
+            add_file(rec->fh, nf, -1);
+            rv = 0;
+        }
+        break;
+    case TR_FLUSH:
+        rv = nf ? storage_flush(fs, nf) : -EBADF;
+        break;
+    case TR_RELEASE:
+        rv = 0;
+        if (of != NULL) {
+            storage_release(fs, nf);
+            drop_file(of);
+        }
+        break;
+    case TR_READ:
+        rv = storage_read(fs, ev->path, data_buf(rec->size), rec->size, rec->offset, nf);
+        break;
+    case TR_WRITE:
+        rv = storage_write(fs, ev->path, data_buf(rec->size), rec->size, rec->offset, nf);
+        break;
+    case TR_UTIMENS: {
+        struct timespec ts[2] = { { rec->offset, 0 }, { rec->size, 0 } };
+        rv = storage_set_time(fs, ev->path, ts);
+        break;
+    }
+    case TR_FSYNC:
+        rv = storage_fsync(fs, ev->path);
+        break;
+    case TR_READLINK:
+        rv = storage_read(fs, ev->path, data_buf(rec->size), rec->size, 0, NULL);
+        break;
+    case TR_SYMLINK:
+        rv = storage_mknod(fs, ev->path, 0120000);
+        if (rv == 0) {
+            rv = storage_write(fs, ev->path, ev->path2, strlen(ev->path2), 0, NULL);
+        }
+        break;
+    case TR_GETXATTR:
+        rv = storage_getxattr(fs, ev->path, ev->path2, data_buf(rec->size), rec->size);
+        break;
+    case TR_SETXATTR:
+        rv = storage_setxattr(fs, ev->path, ev->path2, data_buf(rec->size), rec->size, rec->offset);
+        break;
+    case TR_LISTXATTR:
+        rv = storage_listxattr(fs, ev->path, data_buf(rec->size), rec->size);
+        break;
+    case TR_REMOVEXATTR:
+        rv = storage_removexattr(fs, ev->path, ev->path2);
+        break;
+    }
+    storage_unlock(fs);
+    return rv;
+}
+
+static void
+report(op_stats* stats, double wall)
+{
+    fprintf(stderr, "%-11s %9s %12s %12s %8s %9s\n",
+            "op", "calls", "traced us", "replay us", "change", "mismatch");
+    op_stats total = { 0, 0, 0, 0 };
+    for (int op = 1; op < TR_OP_COUNT; ++op) {
+        op_stats* st = &stats[op];
+        if (st->count == 0) {
+            continue;
+        }
+        double rec_us = st->rec_ns / 1e3 / st->count;
+        double replay_us = st->replay_ns / 1e3 / st->count;
+        fprintf(stderr, "%-11s %9ld %12.2f %12.2f %+7.1f%% %9ld\n",
+                trace_op_name(op), st->count, rec_us, replay_us,
+                (replay_us - rec_us) * 100 / rec_us, st->mismatch);
+        total.count += st->count;
+        total.rec_ns += st->rec_ns;
+        total.replay_ns += st->replay_ns;
+        total.mismatch += st->mismatch;
+    }
+    if (total.count > 0) {
+        fprintf(stderr, "%-11s %9ld %12.2f %12.2f %+7.1f%% %9ld\n", "all",
+                total.count, total.rec_ns / 1e3 / total.count,
+                total.replay_ns / 1e3 / total.count,
+                ((double)total.replay_ns - total.rec_ns) * 100 / total.rec_ns,
+                total.mismatch);
+    }
+    fprintf(stderr, "replayed in %.3f s\n", wall);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int timed = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        if (opt == 't') {
+            timed = 1;
+        }
+        else {
+            usage();
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+    }
+    const char* trace_path = argv[optind];
+    const char* target = argv[optind + 1];
+
+    int count;
+    trace_ev* evs = trace_load(trace_path, &count);
+    if (evs == NULL) {
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(target, &st) == 0 && S_ISDIR(st.st_mode)) {
+        mnt = target;
+    }
+    else {
+        // the engine logs every operation to stdout; results go to stderr
+        freopen("/dev/null", "w", stdout);
+        fs = storage_new();
+        storage_init(fs, target);
+        storage_start(fs);
+    }
+
+    op_stats stats[TR_OP_COUNT];
+    memset(stats, 0, sizeof(stats));
+    uint64_t epoch = trace_now();
+    for (int ii = 0; ii < count; ++ii) {
+        trace_ev* ev = &evs[ii];
+        if (ev->rec.op <= 0 || ev->rec.op >= TR_OP_COUNT) {
+            continue;
+        }
+        if (mnt != NULL && ev->rec.op == TR_FLUSH) {
+            // part of close(2), which is replayed at the release
+            continue;
+        }
+        if (timed) {
+            uint64_t due = epoch + ev->rec.start_ns;
+            uint64_t now = trace_now();
+            if (due > now) {
+                struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        uint64_t t0 = trace_now();
+        int rv = mnt ? replay_mounted(ev) : replay_inproc(ev);
+        uint64_t dt = trace_now() - t0;
+
+        op_stats* os = &stats[ev->rec.op];
+        os->count++;
+        os->rec_ns += ev->rec.dur_ns;
+        os->replay_ns += dt;
+        if (rv != ev->rec.rv) {
+            os->mismatch++;
+        }
+    }
+    double wall = (trace_now() - epoch) / 1e9;
+
+    // files the trace left open
+    for (int ii = 0; ii < nfiles; ++ii) {
+        if (fs != NULL) {
+            storage_lock(fs);
+            storage_release(fs, files[ii].nf);
+            storage_unlock(fs);
+        }
+        else {
+            close(files[ii].fd);
+        }
+    }
+    if (fs != NULL) {
+        storage_lock(fs);
+        storage_stop(fs);
+        storage_unlock(fs);
+        storage_free(fs);
+    }
+
+    report(stats, wall);
+    trace_free(evs, count);
+    free(files);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,140 @@
+// pagesbench: compare the mmap and io_uring data paths
+//
+//   pagesbench [image] [rounds]
+//
+// Builds a scratch image with one large file, then times cold sequential
+// and random reads through storage_read for the mmap backend and for
+// io_uring at several queue depths, and the cost of data checksums.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "storage.h"
+#include "pages.h"
+#include "csum.h"
+#include "crc32c.h"
+
+#define FILE_PAGES 200
+#define CHUNK      (128 * 1024)
+
+static const char* image;
+static nufs_fs* fs;
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// push the image out of our mapping and the page cache
+static void
+drop_caches()
+{
+    pages_advise(1, PAGE_COUNT - 1, MADV_DONTNEED);
+    int fd = open(image, O_RDONLY);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static double
+seq_read(char* buf)
+{
+    nufs_file* fh = storage_open(fs, "/bench");
+    double t0 = now();
+    for (off_t off = 0; off < FILE_PAGES * 4096; off += CHUNK) {
+        storage_read(fs, "/bench", buf, CHUNK, off, fh);
+    }
+    double dt = now() - t0;
+    storage_release(fs, fh);
+    return dt;
+}
+
+static double
+rand_read(char* buf)
+{
+    double t0 = now();
+    for (int ii = 0; ii < FILE_PAGES; ++ii) {
+        off_t off = (off_t)(rand() % FILE_PAGES) * 4096;
+        storage_read(fs, "/bench", buf, 4096, off, NULL);
+    }
+    return now() - t0;
+}
+
+static void
+run(const char* name, int backend, int depth, int rounds, char* buf)
+{
+    if (pages_set_backend(backend, depth) < 0) {
+        fprintf(stderr, "%-12s unavailable\n", name);
+        return;
+    }
+
+    double seq = 0, rnd = 0;
+    for (int ii = 0; ii < rounds; ++ii) {
+        drop_caches();
+        seq += seq_read(buf);
+        drop_caches();
+        rnd += rand_read(buf);
+    }
+    double mb = FILE_PAGES * 4096.0 / (1024 * 1024);
+    fprintf(stderr, "%-12s seq %8.1f MB/s   rand %8.1f us/read\n",
+           name, mb * rounds / seq, rnd * 1e6 / (rounds * FILE_PAGES));
+}
+
+static void
+crc_speed(const char* name, uint32_t (*fn)(uint32_t, const void*, size_t), char* buf)
+{
+    double t0 = now();
+    uint32_t crc = 0;
+    for (int ii = 0; ii < 20; ++ii) {
+        crc = fn(crc, buf, FILE_PAGES * 4096);
+    }
+    double mb = 20 * FILE_PAGES * 4096.0 / (1024 * 1024);
+    fprintf(stderr, "%-12s %8.1f MB/s (%08x)\n", name, mb / (now() - t0), crc);
+}
+
+int
+main(int argc, char* argv[])
+{
+    image = (argc > 1) ? argv[1] : "pagesbench.nufs";
+    int rounds = (argc > 2) ? atoi(argv[2]) : 5;
+
+    // the engine logs every operation to stdout; results go to stderr
+    unlink(image);
+    freopen("/dev/null", "w", stdout);
+    // the pages_*/csum_* calls below work on the instance this binds
+    fs = storage_new();
+    storage_init(fs, image);
+    storage_mknod(fs, "/bench", 0100644);
+    char* buf = malloc(FILE_PAGES * 4096);
+    memset(buf, 'b', FILE_PAGES * 4096);
+    storage_write(fs, "/bench", buf, FILE_PAGES * 4096, 0, NULL);
+
+    run("mmap", PAGES_MMAP, 0, rounds, buf);
+    int depths[] = { 1, 4, 16, 64 };
+    for (int ii = 0; ii < 4; ++ii) {
+        char name[32];
+        snprintf(name, sizeof(name), "uring qd=%d", depths[ii]);
+        run(name, PAGES_URING, depths[ii], rounds, buf);
+    }
+
+    csum_init(CSUM_ALL);
+    run("mmap+csum", PAGES_MMAP, 0, rounds, buf);
+    csum_init(CSUM_OFF);
+    crc_speed("crc32c", crc32c, buf);
+    crc_speed("crc32c sw", crc32c_sw, buf);
+
+    pages_set_backend(PAGES_MMAP, 0);
+    storage_free(fs);
+    free(buf);
+    unlink(image);
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+static const char* op_names[TR_OP_COUNT] = {
+    [TR_GETATTR]  = "getattr",
+    [TR_READDIR]  = "readdir",
+    [TR_MKNOD]    = "mknod",
+    [TR_MKDIR]    = "mkdir",
+    [TR_UNLINK]   = "unlink",
+    [TR_RMDIR]    = "rmdir",
+    [TR_LINK]     = "link",
+    [TR_RENAME]   = "rename",
+    [TR_CHMOD]    = "chmod",
+    [TR_TRUNCATE] = "truncate",
+    [TR_OPEN]     = "open",
+    [TR_RELEASE]  = "release",
+    [TR_FLUSH]    = "flush",
+    [TR_READ]     = "read",
+    [TR_WRITE]    = "write",
+    [TR_UTIMENS]  = "utimens",
+    [TR_FSYNC]    = "fsync",
+    [TR_READLINK] = "readlink",
+    [TR_SYMLINK]  = "symlink",
+    [TR_GETXATTR]    = "getxattr",
+    [TR_SETXATTR]    = "setxattr",
+    [TR_LISTXATTR]   = "listxattr",
+    [TR_REMOVEXATTR] = "removexattr",
+};
+
+const char*
+trace_op_name(int op)
+{
+    if (op <= 0 || op >= TR_OP_COUNT) {
+        return "?";
+    }
+    return op_names[op];
+}
+
+uint64_t
+trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+trace*
+trace_open(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+    // records pile up in a large stdio buffer; a write(2) per call would
+    // cost more than most of the calls being traced
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    fwrite(TRACE_MAGIC, 1, 8, file);
+
+    trace* tr = calloc(1, sizeof(trace));
+    tr->file = file;
+    pthread_mutex_init(&tr->lock, 0);
+    tr->epoch_ns = trace_now();
+    printf("+ trace_open(%s)\n", path);
+    return tr;
+}
+
+void
+trace_close(trace* tr)
+{
+    if (tr == NULL) {
+        return;
+    }
+    fclose(tr->file);
+    pthread_mutex_destroy(&tr->lock);
+    free(tr);
+}
+
+// the start time of a traced call; free when tracing is off
+uint64_t
+trace_begin(trace* tr)
+{
+    return (tr == NULL) ? 0 : trace_now();
+}
+
+// log a finished call that began at t0
+void
+trace_end(trace* tr, int op, const char* path, const char* path2,
+          uint64_t fh, int64_t offset, int64_t size, int rv, uint64_t t0)
+{
+    if (tr == NULL) {
+        return;
+    }
+    trace_rec rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.dur_ns = trace_now() - t0;
+    rec.start_ns = t0 - tr->epoch_ns;
+    rec.fh = fh;
+    rec.offset = offset;
+    rec.size = size;
+    rec.rv = rv;
+    rec.path_len = path ? strlen(path) : 0;
+    rec.path2_len = path2 ? strlen(path2) : 0;
+    rec.op = op;
+
+    pthread_mutex_lock(&tr->lock);
+    fwrite(&rec, sizeof(rec), 1, tr->file);
+    fwrite(path, 1, rec.path_len, tr->file);
+    fwrite(path2, 1, rec.path2_len, tr->file);
+    pthread_mutex_unlock(&tr->lock);
+}
+
+static char*
+read_str(FILE* file, int len)
+{
+    char* str = malloc(len + 1);
+    if (fread(str, 1, len, file) != (size_t)len) {
+        free(str);
+        return NULL;
+    }
+    str[len] = 0;
+    return str;
+}
+
+static int
+by_start(const void* aa, const void* bb)
+{
+    const trace_ev* xx = aa;
+    const trace_ev* yy = bb;
+    if (xx->rec.start_ns != yy->rec.start_ns) {
+        return (xx->rec.start_ns < yy->rec.start_ns) ? -1 : 1;
+    }
+    return 0;
+}
+
+// read a whole trace, ordered by start time (records are logged as calls
+// finish, so concurrent calls may be out of order in the file); a record
+// cut short at the end, as after a crash, is dropped
+trace_ev*
+trace_load(const char* path, int* count)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+    char magic[8];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a nufs trace\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    int cap = 1024;
+    int nn = 0;
+    trace_ev* evs = malloc(cap * sizeof(trace_ev));
+    trace_rec rec;
+    while (fread(&rec, sizeof(rec), 1, file) == 1) {
+        char* path1 = read_str(file, rec.path_len);
+        char* path2 = path1 ? read_str(file, rec.path2_len) : NULL;
+        if (path2 == NULL) {
+            free(path1);
+            break;
+        }
+        if (nn == cap) {
+            cap *= 2;
+            evs = realloc(evs, cap * sizeof(trace_ev));
+        }
+        evs[nn].rec = rec;
+        evs[nn].path = path1;
+        evs[nn].path2 = path2;
+        ++nn;
+    }
+    fclose(file);
+
+    qsort(evs, nn, sizeof(trace_ev), by_start);
+    *count = nn;
+    return evs;
+}
+
+void
+trace_free(trace_ev* evs, int count)
+{
+    for (int ii = 0; ii < count; ++ii) {
+        free(evs[ii].path);
+        free(evs[ii].path2);
+    }
+    free(evs);
+}
@@ -0,0 +1,81 @@
+#ifndef NUFS_TRACE_H
+#define NUFS_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Operation traces: the FUSE front end can log every callback it serves
+// to a file (-o trace=FILE), and tools/nufsreplay runs such a file again
+// against an image or a mount.
+//
+// The file is TRACE_MAGIC followed by records, each a trace_rec and then
+// its path and second path, not NUL-terminated.
+
+#define TRACE_MAGIC "NUFSTRC1"
+
+enum {
+    TR_GETATTR = 1,
+    TR_READDIR,
+    TR_MKNOD,    // offset: mode
+    TR_MKDIR,    // offset: mode
+    TR_UNLINK,
+    TR_RMDIR,
+    TR_LINK,     // path2: the new name
+    TR_RENAME,   // path2: the new name
+    TR_CHMOD,    // offset: mode
+    TR_TRUNCATE, // size: the new size
+    TR_OPEN,
+    TR_RELEASE,
+    TR_FLUSH,
+    TR_READ,
+    TR_WRITE,
+    TR_UTIMENS,  // offset: atime, size: mtime (seconds)
+    TR_FSYNC,
+    TR_READLINK,
+    TR_SYMLINK,  // path2: the target
+    TR_GETXATTR,    // path2: the name, size: the buffer's
+    TR_SETXATTR,    // path2: the name, offset: flags, size: the value's
+    TR_LISTXATTR,   // size: the buffer's
+    TR_REMOVEXATTR, // path2: the name
+    TR_OP_COUNT,
+};
+
+typedef struct trace_rec {
+    uint64_t start_ns; // since the trace was opened
+    uint64_t dur_ns;
+    uint64_t fh;       // the open file used, 0 for calls by path only
+    int64_t  offset;
+    int64_t  size;
+    int32_t  rv;
+    uint16_t path_len;
+    uint16_t path2_len;
+    uint8_t  op;
+    uint8_t  _pad[7];
+} trace_rec;
+
+// an open trace being written; calls may come from several threads
+typedef struct trace {
+    FILE*           file;
+    pthread_mutex_t lock;
+    uint64_t        epoch_ns;
+} trace;
+
+// a record read back, with its paths
+typedef struct trace_ev {
+    trace_rec rec;
+    char*     path;
+    char*     path2;
+} trace_ev;
+
+trace*      trace_open(const char* path);
+void        trace_close(trace* tr);
+uint64_t    trace_now();
+uint64_t    trace_begin(trace* tr);
+void        trace_end(trace* tr, int op, const char* path, const char* path2,
+                      uint64_t fh, int64_t offset, int64_t size, int rv, uint64_t t0);
+trace_ev*   trace_load(const char* path, int* count);
+void        trace_free(trace_ev* evs, int count);
+const char* trace_op_name(int op);
+
+#endif
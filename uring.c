@@ -0,0 +1,274 @@
+// A small io_uring driver on top of the raw syscalls: a ring, a
+// completion thread that reaps its CQEs, and batches that callers wait on.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+// user_data of the NOP that wakes the completion thread on shutdown
+#define URING_STOP ((uint64_t)-1)
+
+static int
+sys_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_uring_enter(uring* r, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void
+complete(uring* r, struct io_uring_cqe* cqe)
+{
+    pthread_mutex_lock(&r->mutex);
+    uring_req* req = &r->reqs[cqe->user_data];
+    uring_batch* batch = req->batch;
+    if (batch != 0) {
+        // a short transfer leaves the rest of the buffer stale or unwritten
+        int err = (cqe->res < 0) ? cqe->res : ((size_t)cqe->res != req->len ? -EIO : 0);
+        if (err != 0 && batch->error == 0) {
+            batch->error = err;
+        }
+        batch->pending--;
+    }
+    req->next = r->free_req;
+    r->free_req = req - r->reqs;
+    r->inflight--;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+static void*
+reaper_main(void* arg)
+{
+    uring* r = arg;
+    for (;;) {
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            sys_uring_enter(r, 0, 1, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        int stop = (cqe->user_data == URING_STOP);
+        if (!stop) {
+            complete(r, cqe);
+        }
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (stop) {
+            return 0;
+        }
+    }
+}
+
+// take an SQE, waiting for the queue depth to allow another I/O;
+// called with the ring mutex held
+static struct io_uring_sqe*
+get_sqe(uring* r)
+{
+    while (r->inflight >= r->depth) {
+        if (r->unsubmitted > 0) {
+            sys_uring_enter(r, r->unsubmitted, 0, 0);
+            r->unsubmitted = 0;
+        }
+        pthread_cond_wait(&r->cond, &r->mutex);
+    }
+
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->inflight++;
+    r->unsubmitted++;
+    return sqe;
+}
+
+// set up a ring of the given depth; fixed_buf (if any) is registered
+// so that I/O into it skips the per-request page pinning
+int
+uring_init(uring* r, int depth, void* fixed_buf, size_t fixed_len)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    pthread_mutex_init(&r->mutex, 0);
+    pthread_cond_init(&r->cond, 0);
+    r->fd = sys_uring_setup(depth, &p);
+    if (r->fd < 0) {
+        return -errno;
+    }
+    r->depth = p.sq_entries;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(0, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        close(r->fd);
+        return -errno;
+    }
+    r->cq_ring = r->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ring = mmap(0, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            munmap(r->sq_ring, r->sq_ring_size);
+            close(r->fd);
+            return -errno;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(0, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        uring_exit(r);
+        return -errno;
+    }
+
+    r->sq_tail  = (unsigned*)((char*)r->sq_ring + p.sq_off.tail);
+    r->sq_mask  = (unsigned*)((char*)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)r->sq_ring + p.sq_off.array);
+    r->cq_head  = (unsigned*)((char*)r->cq_ring + p.cq_off.head);
+    r->cq_tail  = (unsigned*)((char*)r->cq_ring + p.cq_off.tail);
+    r->cq_mask  = (unsigned*)((char*)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe*)((char*)r->cq_ring + p.cq_off.cqes);
+
+    if (fixed_buf != 0) {
+        struct iovec iov = { fixed_buf, fixed_len };
+        if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+            r->fixed_base = fixed_buf;
+            r->fixed_size = fixed_len;
+        }
+    }
+
+    r->reqs = calloc(r->depth, sizeof(uring_req));
+    for (int ii = 0; ii < r->depth; ++ii) {
+        r->reqs[ii].next = ii + 1 < r->depth ? ii + 1 : -1;
+    }
+    r->free_req = 0;
+    r->inflight = 0;
+    r->unsubmitted = 0;
+    pthread_create(&r->reaper, 0, reaper_main, r);
+    printf("+ uring_init(%d) -> fd %d\n", r->depth, r->fd);
+    return 0;
+}
+
+// wait for everything in flight, then tear the ring down
+void
+uring_exit(uring* r)
+{
+    if (r->fd < 0) {
+        return;
+    }
+    if (r->sqes != MAP_FAILED && r->sqes != 0) {
+        pthread_mutex_lock(&r->mutex);
+        if (r->unsubmitted > 0) {
+            sys_uring_enter(r, r->unsubmitted, 0, 0);
+            r->unsubmitted = 0;
+        }
+        while (r->inflight > 0) {
+            pthread_cond_wait(&r->cond, &r->mutex);
+        }
+        struct io_uring_sqe* sqe = get_sqe(r);
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = URING_STOP;
+        r->inflight--; // the reaper doesn't count the stop NOP
+        sys_uring_enter(r, r->unsubmitted, 0, 0);
+        r->unsubmitted = 0;
+        pthread_mutex_unlock(&r->mutex);
+        pthread_join(r->reaper, 0);
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    r->fd = -1;
+    r->fixed_base = 0;
+    r->fixed_size = 0;
+    free(r->reqs);
+    r->reqs = 0;
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->cond);
+}
+
+// queue one read or write; nothing is issued until uring_submit. batch
+// may be NULL for fire-and-forget I/O such as prefetching.
+int
+uring_queue(uring* r, int fd, int write, void* buf, size_t len, off_t off, uring_batch* batch)
+{
+    pthread_mutex_lock(&r->mutex);
+    struct io_uring_sqe* sqe = get_sqe(r);
+    int fixed = (char*)buf >= r->fixed_base && (char*)buf + len <= r->fixed_base + r->fixed_size;
+    if (fixed) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    }
+    else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    // get_sqe kept the I/Os in flight under the depth, so a slot is free
+    int slot = r->free_req;
+    r->free_req = r->reqs[slot].next;
+    r->reqs[slot].batch = batch;
+    r->reqs[slot].len = len;
+    sqe->user_data = slot;
+    if (batch != 0) {
+        batch->pending++;
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return 0;
+}
+
+void
+uring_submit(uring* r)
+{
+    pthread_mutex_lock(&r->mutex);
+    if (r->unsubmitted > 0) {
+        sys_uring_enter(r, r->unsubmitted, 0, 0);
+        r->unsubmitted = 0;
+    }
+    pthread_mutex_unlock(&r->mutex);
+}
+
+// submit anything queued and wait for the batch to complete
+int
+uring_wait(uring* r, uring_batch* batch)
+{
+    uring_submit(r);
+    pthread_mutex_lock(&r->mutex);
+    while (batch->pending > 0) {
+        pthread_cond_wait(&r->cond, &r->mutex);
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return batch->error;
+}
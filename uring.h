@@ -0,0 +1,63 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <pthread.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// an I/O in flight: what it is waited on with, and the bytes asked for,
+// as a completion only reports how many were done
+typedef struct uring_req {
+    struct uring_batch* batch;
+    size_t len;
+    int    next; // next free slot, -1 for none
+} uring_req;
+
+// one ring with its completion thread
+typedef struct uring {
+    int fd;
+    int depth;
+
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void*  sq_ring;
+    size_t sq_ring_size;
+    void*  cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // the registered buffer, read/written with the _FIXED opcodes
+    char*  fixed_base;
+    size_t fixed_size;
+
+    pthread_t       reaper;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    int inflight;    // submitted or queued, not completed
+    int unsubmitted;
+    uring_req* reqs; // one per queue slot, their index the user_data
+    int free_req;
+} uring;
+
+// a group of I/Os that is waited on together
+typedef struct uring_batch {
+    int pending; // I/Os not completed yet
+    int error;   // first failure (-errno), 0 if none
+} uring_batch;
+
+int  uring_init(uring* r, int depth, void* fixed_buf, size_t fixed_len);
+void uring_exit(uring* r);
+int  uring_queue(uring* r, int fd, int write, void* buf, size_t len, off_t off, uring_batch* batch);
+void uring_submit(uring* r);
+int  uring_wait(uring* r, uring_batch* batch);
+
+#endif
@@ -5,6 +5,8 @@
 
 #include <string.h>
 
+#include "pages.h"
+
 static int
 streq(const char* aa, const char* bb)
 {
@@ -32,8 +34,8 @@ clamp(int x, int v0, int v1)
 static int
 bytes_to_pages(int bytes)
 {
-    int quo = bytes / 4096;
-    int rem = bytes % 4096;
+    int quo = PAGE_OF(bytes);
+    int rem = PAGE_OFF(bytes);
     if (rem == 0) {
         return quo;
     }
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "writeback.h"
+#include "storage.h"
+#include "superblock.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "util.h"
+#include "fs.h"
+
+#define wb_thread   (nufs_cur->writeback.wb_thread)
+#define wb_mutex    (nufs_cur->writeback.wb_mutex)
+#define wb_cond     (nufs_cur->writeback.wb_cond)
+#define wb_running  (nufs_cur->writeback.wb_running)
+#define wb_stopping (nufs_cur->writeback.wb_stopping)
+#define wb_kicked   (nufs_cur->writeback.wb_kicked)
+#define interval_ms (nufs_cur->writeback.interval_ms)
+#define dirty_bytes (nufs_cur->writeback.dirty_bytes)
+#define dirty_limit (nufs_cur->writeback.dirty_limit)
+#define passes      (nufs_cur->writeback.passes)
+#define throttled   (nufs_cur->writeback.throttled)
+#define started     (nufs_cur->writeback.started)
+#define async_err   (nufs_cur->writeback.async_err)
+
+// flush interval and dirty limit; set before writeback_start
+void
+writeback_set(int interval, int bytes)
+{
+    interval_ms = interval;
+    dirty_bytes = bytes;
+}
+
+// the pages that change without being marked: page 0 (bitmaps, inodes,
+// superblock), and the fragment map, checksum and change tables
+static void
+mark_metadata()
+{
+    superblock* sb = get_superblock();
+    pages_mark_dirty(0, 1);
+    if (sb->frag_page != 0) {
+        pages_mark_dirty(sb->frag_page, 1);
+    }
+    if (sb->csum_page != 0) {
+        pages_mark_dirty(sb->csum_page, 1);
+    }
+    if (sb->change_page != 0) {
+        pages_mark_dirty(sb->change_page, 1);
+    }
+}
+
+// with the storage lock held: take what is dirty, to be written with
+// pages_write_runs
+static int
+take_dirty(page_run* runs)
+{
+    mark_metadata();
+    passes++;
+    return pages_take_dirty(runs);
+}
+
+// the runs the flusher started writing and nobody has waited for yet;
+// they are forgotten, as the caller is about to wait for them
+static int
+take_started(page_run* runs)
+{
+    int count = 0;
+    for (int pn = 0; pn < PAGE_COUNT; ++pn) {
+        if (!bitmap_get(started, pn)) {
+            continue;
+        }
+        bitmap_put(started, pn, 0);
+        if (count > 0 && runs[count - 1].pnum + runs[count - 1].count == pn) {
+            runs[count - 1].count++;
+        }
+        else {
+            runs[count++] = (page_run){ pn, 1 };
+        }
+    }
+    return count;
+}
+
+// write back everything dirty and wait for it, and for the writes the
+// flusher only started; with the storage lock held. Returns the first
+// error, one of the flusher's included.
+int
+writeback_sync()
+{
+    page_run runs[MAX_PAGE_COUNT];
+    int count = take_dirty(runs);
+    int err = pages_write_runs(runs, count, 1);
+    count = take_started(runs);
+    int rv = pages_write_runs(runs, count, 1);
+    if (err == 0) {
+        err = rv;
+    }
+    if (err == 0) {
+        err = async_err;
+    }
+    async_err = 0;
+    return err;
+}
+
+static void
+kick()
+{
+    pthread_mutex_lock(&wb_mutex);
+    wb_kicked = 1;
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_mutex);
+}
+
+// called by writers, with the storage lock held, after dirtying pages
+void
+writeback_dirtied()
+{
+    if (!wb_running) {
+        return;
+    }
+    int dirty = pages_dirty_count();
+    if (dirty >= dirty_limit) {
+        // over the limit: this writer pays for the writeback
+        throttled++;
+        writeback_sync();
+    }
+    else if (dirty >= dirty_limit / 2) {
+        kick();
+    }
+}
+
+static void*
+writeback_main(void* arg)
+{
+    storage_bind(arg);
+    page_run runs[MAX_PAGE_COUNT];
+    for (;;) {
+        pthread_mutex_lock(&wb_mutex);
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += interval_ms / 1000;
+        until.tv_nsec += (long)(interval_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        while (!wb_stopping && !wb_kicked
+               && pthread_cond_timedwait(&wb_cond, &wb_mutex, &until) == 0) {
+        }
+        wb_kicked = 0;
+        int stop = wb_stopping;
+        pthread_mutex_unlock(&wb_mutex);
+        if (stop) {
+            return 0;
+        }
+
+        // noted as started in the same step as they stop being dirty, so
+        // a sync in between still waits for them
+        storage_lock(nufs_cur);
+        int count = take_dirty(runs);
+        for (int ii = 0; ii < count; ++ii) {
+            for (int pn = runs[ii].pnum; pn < runs[ii].pnum + runs[ii].count; ++pn) {
+                bitmap_put(started, pn, 1);
+            }
+        }
+        storage_unlock(nufs_cur);
+        // only starts the writes, so the next pass isn't held up by them
+        int rv = pages_write_runs(runs, count, 0);
+        if (rv < 0) {
+            storage_lock(nufs_cur);
+            if (async_err == 0) {
+                async_err = rv;
+            }
+            storage_unlock(nufs_cur);
+        }
+    }
+}
+
+// start the flusher, unless writeback is left to the kernel
+void
+writeback_start()
+{
+    if (interval_ms <= 0) {
+        return;
+    }
+    dirty_limit = max(1, dirty_bytes / PAGE_BYTES);
+    pthread_mutex_init(&wb_mutex, 0);
+    pthread_cond_init(&wb_cond, 0);
+    wb_stopping = 0;
+    wb_kicked = 0;
+    int rv = pthread_create(&wb_thread, 0, writeback_main, nufs_cur);
+    wb_running = (rv == 0);
+    printf("+ writeback: every %d ms, limit %d pages\n", interval_ms, dirty_limit);
+}
+
+// called with the storage lock held, which is dropped while waiting
+void
+writeback_stop()
+{
+    if (!wb_running) {
+        return;
+    }
+    pthread_mutex_lock(&wb_mutex);
+    wb_stopping = 1;
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_mutex);
+
+    storage_unlock(nufs_cur);
+    pthread_join(wb_thread, 0);
+    storage_lock(nufs_cur);
+    wb_running = 0;
+    pthread_mutex_destroy(&wb_mutex);
+    pthread_cond_destroy(&wb_cond);
+    printf("+ writeback: %ld passes, %ld throttled writes\n", passes, throttled);
+}
@@ -0,0 +1,38 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pages.h"
+
+// Writeback of the mapping. Changed pages are tracked at the pages layer
+// (pages_mark_dirty); a background flusher starts writing them out every
+// interval, or early once half the dirty limit is reached, and a writer
+// that takes the image over the limit writes back and waits itself, so
+// dirty data stays bounded instead of piling up until the kernel flushes
+// it all at once.
+typedef struct writeback_state {
+    pthread_t       wb_thread;
+    pthread_mutex_t wb_mutex;
+    pthread_cond_t  wb_cond;
+    int             wb_running;
+    int             wb_stopping;
+    int             wb_kicked;
+    int             interval_ms; // 0 leaves writeback to the kernel
+    int             dirty_bytes;
+    // protected by the storage lock
+    int             dirty_limit; // pages
+    long            passes;
+    long            throttled;
+    uint8_t         started[MAX_PAGE_COUNT / 8]; // writes begun, not waited for
+    int             async_err;   // first failure of those, for the next sync
+} writeback_state;
+
+void writeback_set(int interval_ms, int dirty_bytes);
+void writeback_start();
+void writeback_stop();
+void writeback_dirtied();
+int  writeback_sync();
+
+#endif
@@ -0,0 +1,319 @@
+// Extended attributes; see xattr.h. Everything here runs with the storage
+// lock held.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/xattr.h>
+
+#include "xattr.h"
+#include "superblock.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "csum.h"
+#include "fs.h"
+
+_Static_assert(INODE_COUNT * sizeof(xattr_slot) <= 4096,
+               "the attribute table must fit the smallest page");
+
+// one attribute: the name, not NUL-terminated, then the value; records
+// are padded to keep value_len aligned
+typedef struct xattr_rec {
+    uint8_t  name_len;
+    uint8_t  _pad;
+    uint16_t value_len;
+    char     name[];
+} xattr_rec;
+
+#define has_xattrs (nufs_cur->xattrs.has)
+
+static int
+rec_size(int name_len, int value_len)
+{
+    return (sizeof(xattr_rec) + name_len + value_len + 1) & ~1;
+}
+
+static xattr_slot*
+slot(int inum)
+{
+    return (xattr_slot*)pages_get_page(get_superblock()->xattr_page) + inum;
+}
+
+static char*
+records(xattr_slot* sl)
+{
+    return sl->overflow ? pages_get_page(sl->overflow) : sl->data;
+}
+
+// offset of name's record in a list, or -1
+static int
+find(char* list, int used, const char* name)
+{
+    int len = strlen(name);
+    for (int off = 0; off < used; ) {
+        xattr_rec* rec = (xattr_rec*)(list + off);
+        if (rec->name_len == len && memcmp(rec->name, name, len) == 0) {
+            return off;
+        }
+        off += rec_size(rec->name_len, rec->value_len);
+    }
+    return -1;
+}
+
+// the namespaces a file can have attributes in; system.* is for ACLs and
+// the like, which nufs doesn't do
+static int
+valid_name(const char* name)
+{
+    return strncmp(name, "user.", 5) == 0 || strncmp(name, "trusted.", 8) == 0
+        || strncmp(name, "security.", 9) == 0;
+}
+
+// mark the attribute table and the slot's page for writeback
+static void
+touch(int pnum)
+{
+    pages_mark_dirty(pnum, 1);
+    csum_update(pnum);
+}
+
+// called at mount after the superblock is set up: note which inodes have
+// attributes. Slots of free inodes can be left over from an unmount that
+// didn't finish; they are cleared, leaking any overflow page rather than
+// freeing one that may since have been reused.
+void
+xattr_init()
+{
+    memset(has_xattrs, 0, sizeof(has_xattrs));
+    superblock* sb = get_superblock();
+    if (sb->xattr_page == 0) {
+        return;
+    }
+    int count = 0;
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        xattr_slot* sl = slot(ii);
+        if (sl->used == 0) {
+            continue;
+        }
+        if (!bitmap_get(get_inode_bitmap(), ii)) {
+            memset(sl, 0, sizeof(xattr_slot));
+            touch(sb->xattr_page);
+            continue;
+        }
+        bitmap_put(has_xattrs, ii, 1);
+        count++;
+    }
+    printf("+ xattr_init() -> %d inodes with attributes\n", count);
+}
+
+// copy attribute name of inode inum to value; with size 0, only its length
+int
+xattr_get(int inum, const char* name, char* value, size_t size)
+{
+    // the common case: a probe on a file that has none
+    if (!bitmap_get(has_xattrs, inum)) {
+        return -ENODATA;
+    }
+    xattr_slot* sl = slot(inum);
+    char* list = records(sl);
+    int off = find(list, sl->used, name);
+    if (off < 0) {
+        return -ENODATA;
+    }
+    xattr_rec* rec = (xattr_rec*)(list + off);
+    if (size == 0) {
+        return rec->value_len;
+    }
+    if (size < rec->value_len) {
+        return -ERANGE;
+    }
+    memcpy(value, rec->name + rec->name_len, rec->value_len);
+    return rec->value_len;
+}
+
+// the attribute names of inode inum, each NUL-terminated; with size 0,
+// only the bytes they need
+int
+xattr_list(int inum, char* list, size_t size)
+{
+    if (!bitmap_get(has_xattrs, inum)) {
+        return 0;
+    }
+    xattr_slot* sl = slot(inum);
+    char* recs = records(sl);
+    int total = 0;
+    for (int off = 0; off < (int)sl->used; ) {
+        xattr_rec* rec = (xattr_rec*)(recs + off);
+        if (size > 0) {
+            if (total + rec->name_len + 1 > (int)size) {
+                return -ERANGE;
+            }
+            memcpy(list + total, rec->name, rec->name_len);
+            list[total + rec->name_len] = 0;
+        }
+        total += rec->name_len + 1;
+        off += rec_size(rec->name_len, rec->value_len);
+    }
+    return total;
+}
+
+// replace inode inum's records with list: inline if they fit the slot,
+// else on the overflow page, taken on the way up and freed on the way
+// down. Returns -ENOSPC, with nothing changed, if there is no page.
+static int
+store(int inum, const char* list, int used)
+{
+    superblock* sb = get_superblock();
+    xattr_slot* sl = slot(inum);
+    if (used > XATTR_INLINE) {
+        if (sl->overflow == 0) {
+            int pn = alloc_page();
+            if (pn < 0) {
+                return -ENOSPC;
+            }
+            sl->overflow = pn;
+        }
+        memcpy(pages_get_page(sl->overflow), list, used);
+        touch(sl->overflow);
+    }
+    else {
+        if (sl->overflow != 0) {
+            free_page(sl->overflow);
+            csum_update(sl->overflow);
+            sl->overflow = 0;
+        }
+        if (used > 0) {
+            memcpy(sl->data, list, used);
+        }
+    }
+    sl->used = used;
+    bitmap_put(has_xattrs, inum, used > 0);
+    touch(sb->xattr_page);
+    return 0;
+}
+
+// set attribute name of inode inum; flags are XATTR_CREATE or
+// XATTR_REPLACE, as for setxattr(2)
+int
+xattr_set(int inum, const char* name, const char* value, size_t size, int flags)
+{
+    int name_len = strlen(name);
+    if (!valid_name(name)) {
+        return -EOPNOTSUPP;
+    }
+    if (name_len > 255) {
+        return -ERANGE;
+    }
+    // an inode's attributes can't take more than the one overflow page
+    if (size > PAGE_BYTES) {
+        return -E2BIG;
+    }
+
+    superblock* sb = get_superblock();
+    if (sb->xattr_page == 0) {
+        int pn = alloc_page();
+        if (pn < 0) {
+            return -ENOSPC;
+        }
+        memset(pages_get_page(pn), 0, PAGE_BYTES);
+        sb->xattr_page = pn;
+        sb->features |= FEAT_XATTRS;
+    }
+
+    xattr_slot* sl = slot(inum);
+    int used = bitmap_get(has_xattrs, inum) ? sl->used : 0;
+    char* old = records(sl);
+    int off = find(old, used, name);
+    if (off >= 0 && (flags & XATTR_CREATE)) {
+        return -EEXIST;
+    }
+    if (off < 0 && (flags & XATTR_REPLACE)) {
+        return -ENODATA;
+    }
+
+    // the new list: the others as they were, then this one
+    int old_len = 0;
+    if (off >= 0) {
+        xattr_rec* rec = (xattr_rec*)(old + off);
+        old_len = rec_size(rec->name_len, rec->value_len);
+    }
+    int new_used = used - old_len + rec_size(name_len, size);
+    if (new_used > PAGE_BYTES) {
+        return -ENOSPC;
+    }
+    char* list = malloc(new_used);
+    int at = 0;
+    if (off >= 0) {
+        memcpy(list, old, off);
+        memcpy(list + off, old + off + old_len, used - off - old_len);
+        at = used - old_len;
+    }
+    else {
+        memcpy(list, old, used);
+        at = used;
+    }
+    xattr_rec* rec = (xattr_rec*)(list + at);
+    memset(rec, 0, rec_size(name_len, size));
+    rec->name_len = name_len;
+    rec->value_len = size;
+    memcpy(rec->name, name, name_len);
+    memcpy(rec->name + name_len, value, size);
+
+    int rv = store(inum, list, new_used);
+    free(list);
+    printf("+ xattr_set(%d, %s, %zu) -> %d, %s\n", inum, name, size, rv,
+           new_used > XATTR_INLINE ? "overflow" : "inline");
+    return rv;
+}
+
+int
+xattr_remove(int inum, const char* name)
+{
+    if (!bitmap_get(has_xattrs, inum)) {
+        return -ENODATA;
+    }
+    xattr_slot* sl = slot(inum);
+    char* old = records(sl);
+    int off = find(old, sl->used, name);
+    if (off < 0) {
+        return -ENODATA;
+    }
+    xattr_rec* rec = (xattr_rec*)(old + off);
+    int len = rec_size(rec->name_len, rec->value_len);
+    int used = sl->used - len;
+    char* list = malloc(used + 1);
+    memcpy(list, old, off);
+    memcpy(list + off, old + off + len, used - off);
+    // shrinking never needs a page
+    store(inum, list, used);
+    free(list);
+    return 0;
+}
+
+// drop every attribute of a freed inode
+void
+xattr_drop(int inum)
+{
+    if (bitmap_get(has_xattrs, inum)) {
+        store(inum, NULL, 0);
+    }
+}
+
+// call fn on the attribute table and the overflow pages
+void
+xattr_for_each_meta(void (*fn)(int pnum, void* arg), void* arg)
+{
+    superblock* sb = get_superblock();
+    if (sb->xattr_page == 0) {
+        return;
+    }
+    fn(sb->xattr_page, arg);
+    // from the table itself, as this runs before xattr_init at mount
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        if (slot(ii)->overflow != 0) {
+            fn(slot(ii)->overflow, arg);
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef XATTR_H
+#define XATTR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "inode.h"
+
+// Extended attributes. Every inode has a slot in the attribute table, a
+// page of its own recorded in the superblock and allocated with the first
+// attribute set on the image. An inode's attributes are one list of
+// records: while the list fits its slot it is stored there, inline, and
+// past that it moves whole to an overflow page of the inode's own.
+//
+// Which inodes have attributes at all is also kept in memory, so the
+// probes the kernel makes for security.capability and the like on every
+// write and exec are answered for plain files without touching a page.
+
+#define XATTR_INLINE 44
+
+typedef struct xattr_slot {
+    uint32_t used;     // bytes of records, 0 if none
+    int32_t  overflow; // page holding the records, 0 while inline
+    char     data[XATTR_INLINE];
+} xattr_slot;
+
+typedef struct xattr_state {
+    uint8_t has[(INODE_COUNT + 7) / 8]; // inodes with attributes
+} xattr_state;
+
+void xattr_init();
+int  xattr_get(int inum, const char* name, char* value, size_t size);
+int  xattr_set(int inum, const char* name, const char* value, size_t size, int flags);
+int  xattr_list(int inum, char* list, size_t size);
+int  xattr_remove(int inum, const char* name);
+void xattr_drop(int inum);
+void xattr_for_each_meta(void (*fn)(int pnum, void* arg), void* arg);
+
+#endif